@@ -2,12 +2,13 @@ from setuptools import setup, find_packages, Extension
 import numpy as np
 
 module1 =  Extension('PixelILC',
-	sources = ['source/pixel_ILC.c','source/pixel_ILC_mod.c','source/query_disc_wrapper.cpp'],
+	sources = ['source/pixel_ILC.c','source/pixel_ILC_mod.c','source/pixel_ILC_stats.c','source/pixel_ILC_ringfft.c','source/pixel_ILC_factor.c','source/pixel_ILC_driver.c','source/pixel_ILC_plan.c','source/pixel_ILC_lazy.c','source/pixel_ILC_float.c','source/pixel_ILC_writer.c','source/pixel_ILC_degrade.c','source/pixel_ILC_subsample.c','source/pixel_ILC_coarse.c','source/pixel_ILC_batch.c','source/pixel_ILC_gnilc.c','source/pixel_ILC_cost.c','source/pixel_ILC_quant.c','source/pixel_ILC_update.c','source/pixel_ILC_leaveout.c','source/pixel_ILC_qu.c','source/pixel_ILC_api.c','source/query_disc_wrapper.cpp'],
 	include_dirs = ['source',np.get_include()],
 	libraries=['gsl','gslcblas','gomp','healpix_cxx'],
 	library_dirs = ["lib"],
+	define_macros = [('PIXELILC_STATS',None)], # per-phase timers and counters read with getStats(), remove to compile them out
 	extra_compile_args=['-fPIC','-Wall','-g','-fopenmp','-std=c99'],
-	extra_link_args=['-fopenmp'],
+	extra_link_args=['-fopenmp','-pthread'],
 )
 
 setup (name = 'PixelILC',
@@ -1,23 +1,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include <Python.h>
-#include <numpy/ndarrayobject.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_linalg.h>
+#include <omp.h>
 #include <query_disc_wrapper.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
 
-void invert_a_matrix(gsl_matrix *matrix, gsl_matrix *inv, int size){
+int invert_a_matrix(gsl_matrix *matrix, gsl_matrix *inv, int size){
     gsl_permutation *p = gsl_permutation_alloc(size);
-    int s;
+    int ill_conditioned = pixelILC_InvertMatrix(matrix, inv, size, p);
+    gsl_permutation_free(p);
+    return ill_conditioned;
+}
+
+const char *pixelILC_DispatchLevel(void){
+	// the clone of the PIXELILC_HOT kernels the loader picks on this CPU, with the same tests as the GCC resolvers
+#if PIXELILC_TARGET_CLONES == 2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("x86-64-v4")) return "x86-64-v4";
+	if(__builtin_cpu_supports("x86-64-v3")) return "x86-64-v3";
+	return "default";
+#elif PIXELILC_TARGET_CLONES == 1
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) return "avx512f";
+	if(__builtin_cpu_supports("avx2")) return "avx2";
+	return "default";
+#else
+	return "build flags";
+#endif
+}
+
+int pixelILC_InvertMatrix(gsl_matrix *matrix, gsl_matrix *inv, int size, gsl_permutation *p){
+    // invert_a_matrix with a permutation of the given size supplied by the caller
+    int s, i, ill_conditioned;
+    double pivot, pivot_min, pivot_max;
 
     // Compute the LU decomposition of this matrix
     gsl_linalg_LU_decomp(matrix, p, &s);
 
+    // The ratio between the smallest and largest pivot is a cheap proxy for the conditioning
+    pivot_min = pivot_max = fabs(gsl_matrix_get(matrix, 0, 0));
+    for (i = 1; i < size; i++) {
+        pivot = fabs(gsl_matrix_get(matrix, i, i));
+        if (pivot < pivot_min) pivot_min = pivot;
+        if (pivot > pivot_max) pivot_max = pivot;
+    }
+    ill_conditioned = (pivot_min <= PIXELILC_PIVOT_RATIO_MIN * pivot_max);
+    STATS_COUNT(PILC_FACTORIZED, 1);
+    if (ill_conditioned) STATS_COUNT(PILC_ILL_CONDITIONED, 1);
+
     // Compute the  inverse of the LU decomposition
     gsl_linalg_LU_invert(matrix, p, inv);
-
-    gsl_permutation_free(p);
+    return ill_conditioned;
 }
 
 void print_mat_contents(gsl_matrix *matrix,  int size){
@@ -45,15 +81,14 @@ void empty_mat_contents(gsl_matrix *matrix,  int size){
 
 void pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(long ipix,  int Nfreqs, double* TEBmaps, gsl_matrix *CovF,  int Nfreqs2){
 	// 
-	int n,nn,c,ipix_int;
+	int n,nn,c;
 	double vF;
 	//float vF_float;
 	c = 0;
-	ipix_int = (int) ipix ;
 	for(n=0;n<Nfreqs;n++){
 		for(nn=n;nn<Nfreqs;nn++){
 			// TEBmaps is a numpy array with shape npix_per_window,Nfreqs2 = Nfreqs*(Nfreqs+1)/2
-			vF = TEBmaps[ipix_int*Nfreqs2 + c] ;
+			vF = TEBmaps[ipix*Nfreqs2 + c] ;
 			gsl_matrix_set(CovF, n, nn, vF );
 			if(n!=nn){
 				gsl_matrix_set(CovF, nn, n, vF );
@@ -63,31 +98,249 @@ void pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(long ipix,  int Nfreqs,
 	}
 }
 
-void pixelILC_DefineCovMat_NILC_CovarPixelSpace_SingleField(long ipix,  int Nfreqs, int nside, double* Covar_maps, double* Field_filtered_map, double* mask, long *pixel_buffer, gsl_matrix *CovF,  int Nfreqs2, double fwhm){
+long pixelILC_QueryDisc(pixelILC_arena *arena, long ipix, double radius, int nside, int nest){
+	// The pixels of the disc of the given radius around ipix go to arena->pixel_buffer, which grows when the disc does
+	// not fit. Returns their number, 0 if the query fails
+	long nipix;
+	int sucess;
+	query_disc_wrapper(ipix, radius, nside, nest, arena->pixel_buffer, arena->pixel_buffer_size, &nipix, &sucess);
+	if(!sucess && nipix > arena->pixel_buffer_size){
+		// the disc does not fit in the buffer of this thread, grow it and query again
+		arena->pixel_buffer_size = nipix;
+		arena->pixel_buffer = realloc(arena->pixel_buffer, nipix*sizeof(long));
+		query_disc_wrapper(ipix, radius, nside, nest, arena->pixel_buffer, arena->pixel_buffer_size, &nipix, &sucess);
+	}
+	if(!sucess) nipix = 0;
+	return nipix;
+}
+
+void pixelILC_DefineCovMat_NILC_CovarPixelSpace_SingleField(long ipix,  int Nfreqs, int nside, int nest, double* Covar_maps, double* Field_filtered_map, double* mask, pixelILC_arena *arena, gsl_matrix *CovF,  int Nfreqs2, double fwhm){
 	// 
-	int sucess,nipix;
-	int n,nn,ii,c,ipix_int,ipix2_int;
-	ipix_int = (int) ipix;
+	long nipix;
+	// we need to know the pixels in the disc shaped domain around ipix, we use query_disc for that
+	// the disc is the same for every frequency pair, so we query it once and visit each disc pixel once
+	STATS_TIC(t_stats);
+	nipix = pixelILC_QueryDisc(arena, ipix, 0.5*fwhm, nside, nest);
+	STATS_LAP(PILC_QUERY_DISC, t_stats);
+	// pixels outside the mask add nothing, drop them before their maps are read
+	long ii, nkeep = 0;
+	for(ii=0;ii<nipix;ii++){
+		if(mask[arena->pixel_buffer[ii]] != 0.0) arena->pixel_buffer[nkeep++] = arena->pixel_buffer[ii];
+	}
+	pixelILC_DefineCovMat_NILC_DiscPixels_SingleField(ipix, Nfreqs, 12L*nside*nside, Covar_maps, Field_filtered_map, mask, arena->pixel_buffer, NULL, nkeep, CovF, Nfreqs2);
+}
+
+long pixelILC_MaskDiscs(long Npixels, long *disc_start, long *disc_pixels, double *mask, long *mask_start, long *mask_pixels, double *mask_weights){
+	// Keeps from the discs disc_start/disc_pixels only the pixels where the mask is not zero, in mask_start/mask_pixels,
+	// and their mask values in mask_weights. mask_start has size Npixels+1, mask_pixels and mask_weights room for
+	// disc_start[Npixels] entries. Returns the number of pixels kept.
+	long p, ii;
+	mask_start[0] = 0;
+	#pragma omp parallel for private(ii) schedule(dynamic,64)
+	for(p=0;p<Npixels;p++){
+		long nkeep = 0;
+		for(ii=disc_start[p];ii<disc_start[p+1];ii++) if(mask[disc_pixels[ii]] != 0.0) nkeep++;
+		mask_start[p+1] = nkeep;
+	}
+	for(p=0;p<Npixels;p++) mask_start[p+1] += mask_start[p];
+	#pragma omp parallel for private(ii) schedule(dynamic,64)
+	for(p=0;p<Npixels;p++){
+		long k = mask_start[p];
+		for(ii=disc_start[p];ii<disc_start[p+1];ii++){
+			long ipix2 = disc_pixels[ii];
+			if(mask[ipix2] != 0.0){
+				mask_pixels[k] = ipix2;
+				mask_weights[k] = mask[ipix2];
+				k++;
+			}
+		}
+	}
+	return mask_start[Npixels];
+}
+
+PIXELILC_HOT void pixelILC_DefineCovMat_NILC_DiscPixels_SingleField(long ipix,  int Nfreqs, long npix_map, double* Covar_maps, double* Field_filtered_map, double* mask, long *disc_pixels, double *disc_weights, long ndisc, gsl_matrix *CovF,  int Nfreqs2){
+	// the pixel-space covariance of ipix, when the pixels of its disc are already known. The mask value of disc pixel ii
+	// is disc_weights[ii] when disc_weights is not NULL (see pixelILC_MaskDiscs), mask[disc_pixels[ii]] otherwise.
+	// The maps have npix_map pixels, 12*nside^2 or fewer for the compact maps of a Plan, and the covariance goes to row
+	// ipix of Covar_maps
+	int n,nn,c;
+	long ii, ipix2;
+	double xm, w;
+	double *Covar_pix = &Covar_maps[ipix*Nfreqs2];
+	STATS_TIC(t_stats);
+	STATS_COUNT(PILC_DISC_PIXELS, ndisc);
+	// we loop over the disc pixels summing
+	for(ii=0;ii<ndisc;ii++){
+		ipix2 = disc_pixels[ii];
+		w = (disc_weights != NULL) ? disc_weights[ii] : mask[ipix2];
+		c = 0;
+		for(n=0;n<Nfreqs;n++){
+			xm = Field_filtered_map[n*npix_map + ipix2] * w;
+			for(nn=n;nn<Nfreqs;nn++){
+				Covar_pix[c] += xm * Field_filtered_map[nn*npix_map + ipix2] ;
+				c += 1;
+			}
+		}
+	}
 	c = 0;
 	for(n=0;n<Nfreqs;n++){
 		for(nn=n;nn<Nfreqs;nn++){
-			// we need to know the pixels in the disc shaped domain around ipix, we use query_disc for that
-			query_disc_wrapper(ipix, 0.5*fwhm, nside, pixel_buffer, &nipix, &sucess);
-			// now the pixels in the disc are in the array pixel_buffer with size nipix, we loop over them summing
-			for(ii=0;ii<nipix;ii++){
-				ipix2_int = (int) pixel_buffer[ii];
-				Covar_maps[ipix_int*Nfreqs2 + c] += Field_filtered_map[n*12*nside*nside + ipix2_int] * Field_filtered_map[nn*12*nside*nside + ipix2_int] * mask[ipix2_int] ;
-			}
-			gsl_matrix_set(CovF, n, nn, Covar_maps[ipix_int*Nfreqs2 + c] );
+			gsl_matrix_set(CovF, n, nn, Covar_pix[c] );
 			if(n!=nn){
-				gsl_matrix_set(CovF, nn, n, Covar_maps[ipix_int*Nfreqs2 + c] );
+				gsl_matrix_set(CovF, nn, n, Covar_pix[c] );
 			}
 			c += 1;
 		}
 	}
+	STATS_LAP(PILC_COVARIANCE, t_stats);
+}
+
+typedef struct {
+	long key;
+	long p;
+} pixelILC_sort_item;
+
+static int pixelILC_compare_sort_items(const void *a, const void *b){
+	long ka = ((const pixelILC_sort_item*) a)->key, kb = ((const pixelILC_sort_item*) b)->key;
+	return (ka > kb) - (ka < kb);
+}
+
+void pixelILC_TraversalOrder(long *ipix_arr, long Npixels, int nside, int spatial, int nest, long *order){
+	// order[q] is the position in ipix_arr of the q-th pixel to process.
+	// With spatial=1 the pixels are visited along the NEST space filling curve, so consecutive work items have overlapping
+	// discs and read the same parts of the maps. Otherwise they are visited by increasing index, which is the memory order
+	// of the per-pixel arrays like TEBmaps.
+	long p;
+	int sorted = 1;
+	long *keys = ipix_arr;
+	if(spatial && !nest){
+		keys = malloc(Npixels*sizeof(long));
+		ring2nest_wrapper(ipix_arr, Npixels, nside, keys);
+	}
+	for(p=1;p<Npixels && sorted;p++) sorted = (keys[p-1] <= keys[p]);
+	if(sorted){
+		for(p=0;p<Npixels;p++) order[p] = p;
+	}
+	else{
+		pixelILC_sort_item *items = malloc(Npixels*sizeof(pixelILC_sort_item));
+		for(p=0;p<Npixels;p++){
+			items[p].key = keys[p];
+			items[p].p = p;
+		}
+		qsort(items, Npixels, sizeof(pixelILC_sort_item), pixelILC_compare_sort_items);
+		for(p=0;p<Npixels;p++) order[p] = items[p].p;
+		free(items);
+	}
+	if(keys != ipix_arr) free(keys);
+}
+
+static int pixelILC_compare_block_cost(const void *a, const void *b){
+	// sorts the sort items by decreasing key, the key being the block cost
+	long ka = ((const pixelILC_sort_item*) a)->key, kb = ((const pixelILC_sort_item*) b)->key;
+	return (ka < kb) - (ka > kb);
+}
+
+static void pixelILC_ScheduleSortBlocks(pixelILC_schedule *sched){
+	// longest blocks first, so that the cheap ones fill the gaps at the end of the loop
+	long b;
+	pixelILC_sort_item *items = malloc(sched->Nblocks*sizeof(pixelILC_sort_item));
+	for(b=0;b<sched->Nblocks;b++){
+		items[b].key = (long) sched->block_cost[b];
+		items[b].p = b;
+	}
+	qsort(items, sched->Nblocks, sizeof(pixelILC_sort_item), pixelILC_compare_block_cost);
+	for(b=0;b<sched->Nblocks;b++) sched->block_queue[b] = items[b].p;
+	free(items);
+}
+
+void pixelILC_ScheduleInit(pixelILC_schedule *sched, long *ipix_arr, long Npixels, int nside, int spatial, int nest, int nthreads){
+	// Splits the traversal order of pixelILC_TraversalOrder into blocks of consecutive pixels, which are spatially coherent
+	// when spatial=1. Until a better estimate is given every pixel costs the same, so a block costs its number of pixels.
+	long b, block_size;
+	sched->Npixels = Npixels;
+	sched->order = malloc((Npixels > 0 ? Npixels : 1)*sizeof(long));
+	pixelILC_TraversalOrder(ipix_arr, Npixels, nside, spatial, nest, sched->order);
+	// around PIXELILC_BLOCKS_PER_THREAD blocks per thread, enough to balance the load while keeping the blocks compact
+	block_size = Npixels / ((long) PIXELILC_BLOCKS_PER_THREAD * (nthreads > 0 ? nthreads : 1));
+	if(block_size < PIXELILC_BLOCK_SIZE_MIN) block_size = PIXELILC_BLOCK_SIZE_MIN;
+	if(block_size > PIXELILC_BLOCK_SIZE_MAX) block_size = PIXELILC_BLOCK_SIZE_MAX;
+	sched->Nblocks = (Npixels + block_size - 1) / block_size;
+	sched->block_start = malloc((sched->Nblocks + 1)*sizeof(long));
+	sched->block_queue = malloc((sched->Nblocks > 0 ? sched->Nblocks : 1)*sizeof(long));
+	sched->block_cost = malloc((sched->Nblocks > 0 ? sched->Nblocks : 1)*sizeof(double));
+	for(b=0;b<sched->Nblocks;b++){
+		sched->block_start[b] = b*block_size;
+		sched->block_cost[b] = (double) (b < sched->Nblocks-1 ? block_size : Npixels - b*block_size);
+	}
+	sched->block_start[sched->Nblocks] = Npixels;
+	sched->progress = NULL;
+	pixelILC_ScheduleSortBlocks(sched);
+}
+
+void pixelILC_ScheduleDiscCost(pixelILC_schedule *sched, long *ipix_arr, int nside, int nest, double radius){
+	// The cost of a pixel in the pixel-space covariance is the number of disc pixels it visits. It changes slowly across
+	// the sky, so we query the disc of the first pixel of each block and assume it for the whole block.
+	long b, pixel_buffer_size = PIXELILC_PIXEL_BUFFER_SIZE;
+	long *pixel_buffer = malloc(pixel_buffer_size*sizeof(long));
+	long nipix;
+	int sucess;
+	for(b=0;b<sched->Nblocks;b++){
+		long nblock = sched->block_start[b+1] - sched->block_start[b];
+		query_disc_wrapper(ipix_arr[sched->order[sched->block_start[b]]], radius, nside, nest, pixel_buffer, pixel_buffer_size, &nipix, &sucess);
+		// nipix is the size of the disc even when it does not fit in the buffer
+		sched->block_cost[b] = (double) nblock * (double) (nipix + 1);
+	}
+	free(pixel_buffer);
+	pixelILC_ScheduleSortBlocks(sched);
+}
+
+void pixelILC_ScheduleFree(pixelILC_schedule *sched){
+	free(sched->order);
+	free(sched->block_start);
+	free(sched->block_queue);
+	free(sched->block_cost);
+}
+
+void pixelILC_ProgressInit(pixelILC_progress *progress, long total, double interval){
+	// poll and data are left to the caller
+	progress->done = 0;
+	progress->total = total;
+	progress->cancel = 0;
+	progress->interval = interval;
+	progress->last_poll = omp_get_wtime();
+}
+
+void pixelILC_ProgressBlock(pixelILC_progress *progress, long n){
+	// called by every thread when it finishes a block of n pixels
+	#pragma omp atomic
+	progress->done += n;
+	// only the calling thread polls, so that poll can call back into python while the other threads go on
+	if(progress->poll != NULL && omp_get_thread_num() == 0){
+		double now = omp_get_wtime();
+		if(now - progress->last_poll >= progress->interval){
+			progress->last_poll = now;
+			if(progress->poll(progress)) progress->cancel = 1;
+		}
+	}
+}
+
+void pixelILC_CancelBlock(pixelILC_schedule *sched, long block, double *weights, long stride){
+	// the pixels of a block skipped after a cancel get NaN in their stride entries of weights, so the pixels which were
+	// done can be told from the others
+	long q, k;
+	for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+		for(k=0;k<stride;k++) weights[sched->order[q]*stride + k] = NAN;
+	}
+}
+
+void pixelILC_CancelBlockFloat(pixelILC_schedule *sched, long block, float *weights, long stride){
+	long q, k;
+	for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+		for(k=0;k<stride;k++) weights[sched->order[q]*stride + k] = NAN;
+	}
 }
 
-void pixelILC_CalculateILCWeight_NILC_SingleField(double* a, gsl_matrix *CovFi, double* weights,  int Nfreqs,  int p){
+PIXELILC_HOT void pixelILC_CalculateILCWeight_NILC_SingleField(double* a, gsl_matrix *CovFi, double* weights,  int Nfreqs,  long p){
 	// shape of weights Npixels_*Nfreqs_
 	double aCia_F=0.0;
 	int i,j;
@@ -105,7 +358,7 @@ void pixelILC_CalculateILCWeight_NILC_SingleField(double* a, gsl_matrix *CovFi,
 	// after this weights will have the calculated weights.
 }
 
-void pixelILC_CalculateILCWeight_CNILC_SingleField(double* a, double* b, gsl_matrix *CovFi, double* weights,  int Nfreqs,  int p){
+PIXELILC_HOT void pixelILC_CalculateILCWeight_CNILC_SingleField(double* a, double* b, gsl_matrix *CovFi, double* weights,  int Nfreqs,  long p){
 	// shape of weights Npixels_*Nfreqs_
 	// Ci means covariance inverse
 	double aCia_F=0.0,aCib_F=0.0,bCib_F=0.0;
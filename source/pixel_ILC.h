@@ -1,12 +1,252 @@
+#ifndef PIXEL_ILC_H
+#define PIXEL_ILC_H
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_linalg.h>
 
+// invert_a_matrix flags a matrix as ill-conditioned when its smallest LU pivot is below this fraction of the largest
+#define PIXELILC_PIVOT_RATIO_MIN 1.0e-12
+// the same for the single precision inverses, a float LU has lost all its digits long before 1e-12
+#define PIXELILC_PIVOT_RATIO_MIN_FLOAT 1.0e-6
+// initial size of the per-thread buffer holding the pixels of a disc, it grows when a disc does not fit
+#define PIXELILC_PIXEL_BUFFER_SIZE 60000
+// the pixel loops hand out blocks of pixels, about PIXELILC_BLOCKS_PER_THREAD per thread
+#define PIXELILC_BLOCKS_PER_THREAD 16
+#define PIXELILC_BLOCK_SIZE_MIN 16
+#define PIXELILC_BLOCK_SIZE_MAX 1024
+// the float disc sums are done in float over runs of this many pixels, and the runs are added in double
+#define PIXELILC_FLOAT_RUN 64
+// pixels per disc the degraded pixel-space covariances aim for, see pixelILC_DegradedNside
+#define PIXELILC_DEGRADE_TARGET_PIXELS 4096
+// samples per Nyquist interval pi/lmax of the subsampled pixel-space covariances, see pixelILC_SubsampleNside
+#define PIXELILC_SUBSAMPLE_OVERSAMPLING 2.0
+// the Jacobi eigensolver of GNILC stops when the off-diagonal norm is below this fraction of the diagonal one
+#define PIXELILC_JACOBI_TOL 1.0e-15
+#define PIXELILC_JACOBI_MAX_SWEEPS 50
+// the cost model refuses a strategy which needs more than this fraction of the physical memory
+#define PIXELILC_MEMORY_FRACTION 0.8
+// sizes of the calibration benchmark of the cost model, which runs for a few milliseconds
+#define PIXELILC_CALIBRATE_NSIDE 32
+#define PIXELILC_CALIBRATE_RADIUS 0.3
+#define PIXELILC_CALIBRATE_DISCS 16
+#define PIXELILC_CALIBRATE_DISC_PIXELS 65536
+#define PIXELILC_CALIBRATE_SOLVES 1000
+#define PIXELILC_CALIBRATE_DENSE 96
+// multiply-adds an interpolation of the pixel-pixel correlation costs, for the cost model
+#define PIXELILC_SPLINE_MADDS 20.0
+// coarse grid pixels per fwhm for the interpolated weights, see pixelILC_CoarseNside
+#define PIXELILC_COARSE_PIXELS_PER_FWHM 3.0
+// disc pixels per rank-k update of the covariances of a batch of realizations
+#define PIXELILC_BATCH_PANEL 64
+// pixels per tile of PixelILC.LazyWeights when tile_nside is not given
+#define PIXELILC_LAZY_TILE_PIXELS 4096
+// pixels per scale of the 16 bit weights, see pixel_ILC_quant.c, the largest integer and the one which stands for NaN
+#define PIXELILC_QUANT_BLOCK 64
+#define PIXELILC_QUANT_MAX 32767
+#define PIXELILC_QUANT_NAN (-32768)
+// seconds between two calls of the progress callback of the module, and between two checks for Ctrl-C
+#define PIXELILC_PROGRESS_INTERVAL 1.0
+// The hot kernels (disc sums, small solves and weights) are compiled for several ISA levels and the loader picks the
+// best one the CPU supports, so one build runs on old and new nodes alike. Build with -DPIXELILC_NO_TARGET_CLONES
+// to compile them once, for the flags of the build.
+// The clones are picked on CPU features: the x86-64-v4 (AVX-512) and v3 (AVX2, FMA) levels with GCC 12 or later, the
+// AVX-512F and AVX2 extensions before. The arch=<cpu name> clones are not used, GCC picks those on the CPU model.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12 && defined(__x86_64__) && defined(__linux__) && !defined(PIXELILC_NO_TARGET_CLONES)
+#define PIXELILC_HOT __attribute__((target_clones("arch=x86-64-v4","arch=x86-64-v3","default")))
+#define PIXELILC_TARGET_CLONES 2
+#elif defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6 && defined(__x86_64__) && defined(__linux__) && !defined(PIXELILC_NO_TARGET_CLONES)
+#define PIXELILC_HOT __attribute__((target_clones("avx512f","avx2","default")))
+#define PIXELILC_TARGET_CLONES 1
+#else
+#define PIXELILC_HOT
+#define PIXELILC_TARGET_CLONES 0
+#endif
+// position of the (n,nn) entry, n <= nn, in a packed upper triangle stored like a row of TEBmaps
+#define PIXELILC_PACKED_INDEX(n,nn,Nfreqs) ((n)*(Nfreqs) - (n)*((n)-1)/2 + (nn) - (n))
+
+// Progress of a running call and the flag which stops it. The pixel loops add the pixels of every block they finish to
+// done and, once cancel is set, skip the blocks left and give their pixels NaN weights. poll is called by thread 0, the
+// thread which started the call, at most every interval seconds, and cancels the call when it returns nonzero.
+typedef struct pixelILC_progress {
+	long done;		// pixels finished, updated atomically
+	long total;
+	volatile int cancel;
+	int (*poll)(struct pixelILC_progress *progress);	// may be NULL
+	void *data;		// for poll
+	double interval;
+	double last_poll;	// omp_get_wtime() of the last poll
+} pixelILC_progress;
+
+// Pixels in traversal order, split in blocks which the threads take from a queue sorted by decreasing cost
+typedef struct {
+	long Npixels;
+	long Nblocks;
+	long *order;		// order[q] is the position in ipix_arr of the q-th pixel in traversal order
+	long *block_start;	// block b holds the pixels order[block_start[b]] ... order[block_start[b+1]-1]
+	long *block_queue;	// block indices by decreasing cost
+	double *block_cost;	// estimated cost of each block, in arbitrary units
+	pixelILC_progress *progress;	// NULL unless the caller follows the call, set after pixelILC_ScheduleInit
+} pixelILC_schedule;
+
+// at the start of a block of the pixel loops, true when the call is cancelled and the block is skipped
+#define PIXELILC_CANCELLED(sched) ((sched)->progress != NULL && (sched)->progress->cancel)
+// at the end of a block of n pixels, one atomic add, and a clock read on thread 0
+#define PIXELILC_PROGRESS(sched,n) do { if((sched)->progress != NULL) pixelILC_ProgressBlock((sched)->progress, (n)); } while(0)
+
+#define H_PLANCK 6.6260755e-34
+#define K_BOLTZ 1.380658e-23
+#define T_CMB 2.72548
+#ifndef PI
+#define PI 3.14159265358979323846
+#endif
+
+// Scratch of one thread, allocated once and reused for every pixel it processes
+typedef struct {
+	gsl_matrix *CovF, *CovFi;
+	gsl_permutation *perm, *perm3;	// for the Nfreqs x Nfreqs and the 3 x 3 inverses
+	gsl_matrix *A, *first, *second, *second_i, *third, *fourth, *fifth, *e_t;	// the 3 component constrained ILC
+	double *b;		// a second SED, size Nfreqs
+	double *work;		// size 2*Nfreqs
+	long *pixel_buffer;	// pixels of a disc, grows when a disc does not fit
+	long pixel_buffer_size;
+	gsl_matrix_float *CovF_float, *CovFi_float;	// the single precision path
+	float *run_float;	// size Nfreqs2
+	double *acc;		// size Nfreqs2
+} pixelILC_arena;
+
+// the ring FFT smoothing ignores rings further than this many sigmas, and Fourier modes where the kernel is below EPS
+#define PIXELILC_RINGFFT_NSIGMA 5.0
+#define PIXELILC_RINGFFT_EPS 1.0e-10
+
+// one iso-latitude ring of a RING ordered map
+typedef struct {
+	long start;	// first pixel of the ring
+	long nphi;	// number of pixels in the ring
+	double theta;
+	double phi0;	// azimuth of the first pixel
+} pixelILC_ring;
+
+// geometry and kernel width of the ring FFT smoothing for a given nside and fwhm
+typedef struct {
+	int nside;
+	long nrings;
+	double sigma;
+	pixelILC_ring *rings;
+	double *norm;	// kernel summed around every pixel, RING ordered
+} pixelILC_ringfft_plan;
+
+// seconds per unit operation of the cost model, on one thread
+typedef struct {
+	double query;		// a pixel of a disc query
+	double madd;		// a multiply-add of the disc sums
+	double solve;		// the inverse and the weights of one pixel
+	double flop;		// a flop of the dense inverse
+	double ring_mode;	// a kernel mode of the ring FFT smoothing
+} pixelILC_cost_rates;
+
+// the estimated cost of one way to get the pixel-space weights
+#define PIXELILC_NSTRATEGIES 5
+typedef struct {
+	const char *name;
+	const char *function;	// the module function or method which runs it
+	int exact;		// 1 if it gives the weights of the disc sums, 0 for the approximations
+	double setup_seconds;	// once, for the strategies that can be reused
+	double seconds;		// every call
+	double bytes;		// inputs, outputs and scratch
+	int feasible;		// bytes is within the memory limit
+} pixelILC_strategy;
+
+pixelILC_arena *pixelILC_ArenasAlloc(int nthreads, int Nfreqs);
+void pixelILC_ArenasFree(pixelILC_arena *arenas, int nthreads);
+// the disc around ipix in arena->pixel_buffer, returns its size or 0 if the query fails
+long pixelILC_QueryDisc(pixelILC_arena *arena, long ipix, double radius, int nside, int nest);
+void pixelILC_Thermo2RJ(double *freq_arr, int Nfreqs, double *thermo_2_rj);
+void pixelILC_Run_NILC_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *a, double *weights);
+void pixelILC_Run_CNILC_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *a, double *b, double *weights);
+void pixelILC_Run_CNILC_ThermalDust_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *a, double *beta_dust_map, double *T_dust_map, double *freq_arr, double *thermo_2_rj, double *weights);
+void pixelILC_Run_CNILC_ThermalDust_Synchrotron_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *a, double *beta_dust_map, double *T_dust_map, double *beta_syn_map, double *freq_arr, double *thermo_2_rj, double *weights);
+void pixelILC_Run_NILC_CovarPixelSpace(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, long *disc_start, long *disc_pixels, double *disc_weights, long npix_map, double *a, double *weights);
+void pixelILC_Run_Factorize(pixelILC_schedule *sched, long *ipix_arr, int Nfreqs, double *TEBmaps, double *U);
+
 void print_mat_contents(gsl_matrix *matrix,  int size);
 void empty_mat_contents(gsl_matrix *matrix,  int size);
-void invert_a_matrix_single(gsl_matrix_float *matrix, gsl_matrix_float *inv,  int size);
-void invert_a_matrix(gsl_matrix *matrix, gsl_matrix *inv,  int size);
+int invert_a_matrix_single(gsl_matrix_float *matrix, gsl_matrix_float *inv,  int size);
+int pixelILC_InvertMatrixFloat(gsl_matrix_float *matrix, gsl_matrix_float *inv, int size, gsl_permutation *p);
+int invert_a_matrix(gsl_matrix *matrix, gsl_matrix *inv,  int size);
+int pixelILC_InvertMatrix(gsl_matrix *matrix, gsl_matrix *inv, int size, gsl_permutation *p);
 
 void pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField( long ipix,  int Nfreqs, double* TEBmaps, gsl_matrix *CovF,  int Nfreqs2);
-void pixelILC_CalculateILCWeight_NILC_SingleField(double* a, gsl_matrix *CovFi, double* weights,  int Nfreqs,  int p);
-void pixelILC_CalculateILCWeight_CNILC_SingleField(double* a, double* b, gsl_matrix *CovFi, double* weights,  int Nfreqs,  int p);
-void pixelILC_DefineCovMat_NILC_CovarPixelSpace_SingleField(long ipix,  int Nfreqs, int nside, double* Covar_maps, double* Field_filtered_map, double* mask, long *pixel_buffer, gsl_matrix *CovF,  int Nfreqs2, double fwhm);
\ No newline at end of file
+void pixelILC_CalculateILCWeight_NILC_SingleField(double* a, gsl_matrix *CovFi, double* weights,  int Nfreqs,  long p);
+void pixelILC_CalculateILCWeight_CNILC_SingleField(double* a, double* b, gsl_matrix *CovFi, double* weights,  int Nfreqs,  long p);
+void pixelILC_DefineCovMat_NILC_CovarPixelSpace_SingleField(long ipix,  int Nfreqs, int nside, int nest, double* Covar_maps, double* Field_filtered_map, double* mask, pixelILC_arena *arena, gsl_matrix *CovF,  int Nfreqs2, double fwhm);
+void pixelILC_DefineCovMat_NILC_DiscPixels_SingleField(long ipix,  int Nfreqs, long npix_map, double* Covar_maps, double* Field_filtered_map, double* mask, long *disc_pixels, double *disc_weights, long ndisc, gsl_matrix *CovF,  int Nfreqs2);
+long pixelILC_MaskDiscs(long Npixels, long *disc_start, long *disc_pixels, double *mask, long *mask_start, long *mask_pixels, double *mask_weights);
+void pixelILC_TraversalOrder(long *ipix_arr, long Npixels, int nside, int spatial, int nest, long *order);
+void pixelILC_ScheduleInit(pixelILC_schedule *sched, long *ipix_arr, long Npixels, int nside, int spatial, int nest, int nthreads);
+void pixelILC_ScheduleDiscCost(pixelILC_schedule *sched, long *ipix_arr, int nside, int nest, double radius);
+void pixelILC_ScheduleFree(pixelILC_schedule *sched);
+void pixelILC_ProgressInit(pixelILC_progress *progress, long total, double interval);
+void pixelILC_ProgressBlock(pixelILC_progress *progress, long n);
+void pixelILC_CancelBlock(pixelILC_schedule *sched, long block, double *weights, long stride);
+void pixelILC_CancelBlockFloat(pixelILC_schedule *sched, long block, float *weights, long stride);
+
+void pixelILC_RingInfo(int nside, pixelILC_ring *rings);
+void pixelILC_RingFFTPlanInit(pixelILC_ringfft_plan *plan, int nside, double fwhm);
+void pixelILC_RingFFTPlanFree(pixelILC_ringfft_plan *plan);
+void pixelILC_RingFFTSmooth(pixelILC_ringfft_plan *plan, double *map, double *coef, double *map_out);
+
+int pixelILC_CholeskyPacked(double *Cov, double *U, int Nfreqs);
+void pixelILC_CholeskySolveLower(double *U, double *x, int Nfreqs);
+void pixelILC_CholeskySolveUpper(double *U, double *x, int Nfreqs);
+void pixelILC_CholeskyRank1Update(double *U, double *x, int Nfreqs);
+int pixelILC_CholeskyRank1Downdate(double *U, double *x, int Nfreqs);
+void pixelILC_CalculateILCWeight_NILC_Factorized(double* a, double *U, double* weights,  int Nfreqs,  long p, double *work);
+void pixelILC_CalculateILCWeight_CNILC_Factorized(double* a, double* b, double *U, double* weights,  int Nfreqs,  long p, double *work);
+
+void pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField_float(long ipix,  int Nfreqs, float* TEBmaps, gsl_matrix_float *CovF,  int Nfreqs2);
+void pixelILC_DefineCovMat_NILC_DiscPixels_SingleField_float(long ipix,  int Nfreqs, long npix_map, float* Covar_maps, float* Field_filtered_map, float* mask, long *disc_pixels, double *disc_weights, long ndisc, gsl_matrix_float *CovF,  int Nfreqs2, float *run, double *acc);
+void pixelILC_CalculateILCWeight_NILC_SingleField_float(double* a, gsl_matrix_float *CovFi, float* weights,  int Nfreqs,  long p);
+void pixelILC_CalculateILCWeight_CNILC_SingleField_float(double* a, double* b, gsl_matrix_float *CovFi, float* weights,  int Nfreqs,  long p);
+void pixelILC_Run_NILC_SHTSmoothing_float(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, float *TEBmaps, double *a, float *weights);
+void pixelILC_Run_CNILC_SHTSmoothing_float(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, float *TEBmaps, double *a, double *b, float *weights);
+void pixelILC_Run_CNILC_ThermalDust_SHTSmoothing_float(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, float *TEBmaps, double *a, double *beta_dust_map, double *T_dust_map, double *freq_arr, double *thermo_2_rj, float *weights);
+void pixelILC_Run_NILC_CovarPixelSpace_float(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, float *Covar_maps, float *Field_filtered_map, float *mask, long *disc_start, long *disc_pixels, double *disc_weights, long npix_map, double *a, float *weights);
+
+int pixelILC_DegradedNside(int nside, double fwhm, long target_pixels);
+void pixelILC_DegradeProducts(int Nfreqs, int nside, int nest, int nside_lo, double *Field_filtered_map, double *mask, double *products);
+void pixelILC_Run_NILC_CovarPixelSpace_Degraded(pixelILC_arena *arenas, long *ipix_arr, long Npixels, int Nfreqs, int nside, int nest, int nside_lo, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, double *a, double *weights, pixelILC_progress *progress);
+
+int pixelILC_SubsampleNside(int nside, int lmax, double oversampling);
+void pixelILC_Run_NILC_CovarPixelSpace_Subsampled(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, int nside_s, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, double *a, double *weights, double *rel_error);
+
+int pixelILC_CoarseNside(int nside, double fwhm);
+long pixelILC_Run_SHTSmoothing_Coarse(pixelILC_arena *arenas, int nthreads, long *ipix_arr, long Npixels, int Nfreqs, int nside, int nest, int nside_c, double *TEBmaps, double *a, double *b, double tol, double *weights, pixelILC_progress *progress);
+
+void pixelILC_Run_NILC_CovarPixelSpace_Batch(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, long Npixels, int Nreal, int Nfreqs, int nside, int nest, double fwhm, double *Field_filtered_maps, double *mask, double *a, double *weights);
+
+int pixelILC_JacobiEigen(double *A, double *V, double *lambda, int N);
+int pixelILC_GNILC_AIC(double *lambda, int N, double Nmodes);
+int pixelILC_CalculateGNILCWeight_SingleField(gsl_matrix *CovF, double *U, gsl_matrix *V, double *lambda, double Nmodes, double *weights, int Nfreqs, long p);
+void pixelILC_Run_GNILC_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *NuisanceMaps, double Nmodes, double *weights, int *dims);
+
+void pixelILC_Run_UpdateFactors_Channel(pixelILC_schedule *sched, long *ipix_arr, int Nfreqs, double *TEBmaps, int channel, double *U, long *refactorized);
+void pixelILC_Run_NILC_CovarPixelSpace_Channel(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, int channel, double *a, double *weights);
+long pixelILC_Run_NILC_CovarPixelSpace_MaskEdit(pixelILC_arena *arenas, long *ipix_arr, long Npixels, int Nfreqs, int nside, int nest, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, long *edited, double *new_values, long Nedited, double *a, double *weights, long **updated, pixelILC_progress *progress);
+
+void pixelILC_Run_NILC_CovarPixelSpace_LeaveOut(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, double core_radius, double *Covar_maps, double *Field_filtered_map, double *mask, double *a, double *weights, long *refactorized);
+
+void pixelILC_Run_NILC_CovarPixelSpace_QU(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, double *Covar_maps, double *Q_maps, double *U_maps, double *mask, double *a, double *weights);
+
+void pixelILC_QuantizeWeights(const double *weights, long Npixels, int Nfreqs, long block_pixels, short *q, float *scales);
+void pixelILC_DequantizeWeights(const short *q, const float *scales, long Npixels, int Nfreqs, long block_pixels, double *weights);
+void pixelILC_ApplyQuantizedWeights(const short *q, const float *scales, long block_pixels, const long *ipix, long Npixels, int Nfreqs, const double *maps, long npix, double *out);
+
+void pixelILC_CostDefaultRates(pixelILC_cost_rates *rates);
+void pixelILC_CostCalibrate(int nside, double fwhm, int Nfreqs, pixelILC_cost_rates *rates);
+double pixelILC_CostDiscPixels(int nside, double fwhm);
+double pixelILC_CostMemoryLimit(void);
+double pixelILC_CostDenseBytes(int Nfreqs, long Npixels, int nside);
+int pixelILC_CostPlan(int nside, double fwhm, int Nfreqs, long Npixels, double fsky, int nthreads, double memory_limit, pixelILC_cost_rates *rates, pixelILC_strategy *strategies);
+
+const char *pixelILC_DispatchLevel(void);
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gsl/gsl_matrix.h>
+#include <omp.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_api.h>
+
+// The C API of pixel_ILC_api.h, on top of the same schedules, arenas and drivers as the Python module.
+// The drivers take non-const pointers but do not write to their inputs, hence the casts.
+
+struct pixelilc_context {
+	int Nfreqs;
+	int nthreads;
+	pixelILC_arena *arenas;
+};
+
+pixelilc_context *pixelilc_context_new(int Nfreqs, int nthreads){
+	if(Nfreqs < 1) return NULL;
+	pixelilc_context *ctx = malloc(sizeof(pixelilc_context));
+	ctx->Nfreqs = Nfreqs;
+	ctx->nthreads = (nthreads > 0) ? nthreads : omp_get_max_threads();
+	ctx->arenas = pixelILC_ArenasAlloc(ctx->nthreads, Nfreqs);
+	return ctx;
+}
+
+void pixelilc_context_free(pixelilc_context *ctx){
+	if(ctx == NULL) return;
+	pixelILC_ArenasFree(ctx->arenas, ctx->nthreads);
+	free(ctx);
+}
+
+int pixelilc_context_nfreqs(const pixelilc_context *ctx){
+	return ctx->Nfreqs;
+}
+
+int pixelilc_context_nthreads(const pixelilc_context *ctx){
+	return ctx->nthreads;
+}
+
+// the parallel regions of a call run on the threads of the context, the caller's setting is put back afterwards
+#define PIXELILC_API_ENTER(ctx) int api_saved_threads = omp_get_max_threads(); omp_set_num_threads((ctx)->nthreads)
+#define PIXELILC_API_LEAVE() omp_set_num_threads(api_saved_threads)
+
+static int pixelilc_check(const pixelilc_context *ctx, const long *ipix, long Npixels){
+	if(ctx == NULL || Npixels < 0 || (Npixels > 0 && ipix == NULL)) return -1;
+	return 0;
+}
+
+int pixelilc_covariance_pixel_space(pixelilc_context *ctx, int nside, int nest, double fwhm, const long *ipix, long Npixels, const double *field_maps, const double *mask, double *covar){
+	if(pixelilc_check(ctx, ipix, Npixels) || nside < 1 || fwhm <= 0.0 || field_maps == NULL || mask == NULL || covar == NULL) return -1;
+	int Nfreqs = ctx->Nfreqs, Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	PIXELILC_API_ENTER(ctx);
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, (long*) ipix, Npixels, nside, 1, nest, ctx->nthreads);
+	pixelILC_ScheduleDiscCost(&sched, (long*) ipix, nside, nest, 0.5*fwhm);
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &ctx->arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched.Nblocks;b++){
+		long block = sched.block_queue[b];
+		for(q=sched.block_start[block];q<sched.block_start[block+1];q++){
+			long ipix_q = ipix[sched.order[q]];
+			memset(&covar[ipix_q*Nfreqs2], 0, Nfreqs2*sizeof(double));
+			pixelILC_DefineCovMat_NILC_CovarPixelSpace_SingleField(ipix_q, Nfreqs, nside, nest, covar, (double*) field_maps, (double*) mask, arena, arena->CovF, Nfreqs2, fwhm);
+		}
+	}
+	}
+	pixelILC_ScheduleFree(&sched);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_weights_nilc(pixelilc_context *ctx, const double *covar, const long *ipix, long Npixels, const double *a, double *weights){
+	if(pixelilc_check(ctx, ipix, Npixels) || covar == NULL || a == NULL || weights == NULL) return -1;
+	PIXELILC_API_ENTER(ctx);
+	memset(weights, 0, Npixels*ctx->Nfreqs*sizeof(double));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, (long*) ipix, Npixels, 0, 0, 0, ctx->nthreads);
+	pixelILC_Run_NILC_SHTSmoothing(&sched, ctx->arenas, (long*) ipix, ctx->Nfreqs, (double*) covar, (double*) a, weights);
+	pixelILC_ScheduleFree(&sched);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_weights_cnilc(pixelilc_context *ctx, const double *covar, const long *ipix, long Npixels, const double *a, const double *b, double *weights){
+	if(pixelilc_check(ctx, ipix, Npixels) || covar == NULL || a == NULL || b == NULL || weights == NULL) return -1;
+	PIXELILC_API_ENTER(ctx);
+	memset(weights, 0, Npixels*ctx->Nfreqs*sizeof(double));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, (long*) ipix, Npixels, 0, 0, 0, ctx->nthreads);
+	pixelILC_Run_CNILC_SHTSmoothing(&sched, ctx->arenas, (long*) ipix, ctx->Nfreqs, (double*) covar, (double*) a, (double*) b, weights);
+	pixelILC_ScheduleFree(&sched);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_weights_cnilc_thermal_dust(pixelilc_context *ctx, const double *covar, const long *ipix, long Npixels, const double *a, const double *freqs, const double *beta_dust, const double *T_dust, double *weights){
+	if(pixelilc_check(ctx, ipix, Npixels) || covar == NULL || a == NULL || freqs == NULL || beta_dust == NULL || T_dust == NULL || weights == NULL) return -1;
+	PIXELILC_API_ENTER(ctx);
+	memset(weights, 0, Npixels*ctx->Nfreqs*sizeof(double));
+	double *thermo_2_rj = malloc(ctx->Nfreqs*sizeof(double));
+	pixelILC_Thermo2RJ((double*) freqs, ctx->Nfreqs, thermo_2_rj);
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, (long*) ipix, Npixels, 0, 0, 0, ctx->nthreads);
+	pixelILC_Run_CNILC_ThermalDust_SHTSmoothing(&sched, ctx->arenas, (long*) ipix, ctx->Nfreqs, (double*) covar, (double*) a, (double*) beta_dust, (double*) T_dust, (double*) freqs, thermo_2_rj, weights);
+	pixelILC_ScheduleFree(&sched);
+	free(thermo_2_rj);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_weights_cnilc_thermal_dust_synchrotron(pixelilc_context *ctx, const double *covar, const long *ipix, long Npixels, const double *a, const double *freqs, const double *beta_dust, const double *T_dust, const double *beta_syn, double *weights){
+	if(pixelilc_check(ctx, ipix, Npixels) || covar == NULL || a == NULL || freqs == NULL || beta_dust == NULL || T_dust == NULL || beta_syn == NULL || weights == NULL) return -1;
+	PIXELILC_API_ENTER(ctx);
+	memset(weights, 0, Npixels*ctx->Nfreqs*sizeof(double));
+	double *thermo_2_rj = malloc(ctx->Nfreqs*sizeof(double));
+	pixelILC_Thermo2RJ((double*) freqs, ctx->Nfreqs, thermo_2_rj);
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, (long*) ipix, Npixels, 0, 0, 0, ctx->nthreads);
+	pixelILC_Run_CNILC_ThermalDust_Synchrotron_SHTSmoothing(&sched, ctx->arenas, (long*) ipix, ctx->Nfreqs, (double*) covar, (double*) a, (double*) beta_dust, (double*) T_dust, (double*) beta_syn, (double*) freqs, thermo_2_rj, weights);
+	pixelILC_ScheduleFree(&sched);
+	free(thermo_2_rj);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_weights_nilc_pixel_space(pixelilc_context *ctx, int nside, int nest, double fwhm, const long *ipix, long Npixels, const double *field_maps, const double *mask, const double *a, double *covar, double *weights){
+	if(pixelilc_check(ctx, ipix, Npixels) || nside < 1 || fwhm <= 0.0 || field_maps == NULL || mask == NULL || a == NULL || covar == NULL || weights == NULL) return -1;
+	int Nfreqs2 = ctx->Nfreqs*(ctx->Nfreqs+1)/2;
+	long p;
+	PIXELILC_API_ENTER(ctx);
+	memset(weights, 0, Npixels*ctx->Nfreqs*sizeof(double));
+	for(p=0;p<Npixels;p++) memset(&covar[ipix[p]*Nfreqs2], 0, Nfreqs2*sizeof(double));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, (long*) ipix, Npixels, nside, 1, nest, ctx->nthreads);
+	pixelILC_ScheduleDiscCost(&sched, (long*) ipix, nside, nest, 0.5*fwhm);
+	pixelILC_Run_NILC_CovarPixelSpace(&sched, ctx->arenas, (long*) ipix, ctx->Nfreqs, nside, nest, fwhm, covar, (double*) field_maps, (double*) mask, NULL, NULL, NULL, 12L*nside*nside, (double*) a, weights);
+	pixelILC_ScheduleFree(&sched);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_apply_weights(pixelilc_context *ctx, const double *weights, const long *ipix, long Npixels, const double *maps, long npix, double *out){
+	if(pixelilc_check(ctx, ipix, Npixels) || weights == NULL || maps == NULL || npix < 1 || out == NULL) return -1;
+	int Nfreqs = ctx->Nfreqs;
+	long p;
+	PIXELILC_API_ENTER(ctx);
+	#pragma omp parallel for schedule(static)
+	for(p=0;p<Npixels;p++){
+		double s = 0.0;
+		int n;
+		for(n=0;n<Nfreqs;n++) s += weights[p*Nfreqs + n] * maps[n*npix + ipix[p]];
+		out[p] = s;
+	}
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_quantize_weights(pixelilc_context *ctx, const double *weights, long Npixels, long block_pixels, short *q, float *scales){
+	if(ctx == NULL || Npixels < 0 || block_pixels < 1 || weights == NULL || q == NULL || scales == NULL) return -1;
+	PIXELILC_API_ENTER(ctx);
+	pixelILC_QuantizeWeights(weights, Npixels, ctx->Nfreqs, block_pixels, q, scales);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_dequantize_weights(pixelilc_context *ctx, const short *q, const float *scales, long Npixels, long block_pixels, double *weights){
+	if(ctx == NULL || Npixels < 0 || block_pixels < 1 || weights == NULL || q == NULL || scales == NULL) return -1;
+	PIXELILC_API_ENTER(ctx);
+	pixelILC_DequantizeWeights(q, scales, Npixels, ctx->Nfreqs, block_pixels, weights);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
+
+int pixelilc_apply_quantized_weights(pixelilc_context *ctx, const short *q, const float *scales, long block_pixels, const long *ipix, long Npixels, const double *maps, long npix, double *out){
+	if(pixelilc_check(ctx, ipix, Npixels) || block_pixels < 1 || q == NULL || scales == NULL || maps == NULL || npix < 1 || out == NULL) return -1;
+	PIXELILC_API_ENTER(ctx);
+	pixelILC_ApplyQuantizedWeights(q, scales, block_pixels, ipix, Npixels, ctx->Nfreqs, maps, npix, out);
+	PIXELILC_API_LEAVE();
+	return 0;
+}
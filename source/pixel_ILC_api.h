@@ -0,0 +1,60 @@
+#ifndef PIXEL_ILC_API_H
+#define PIXEL_ILC_API_H
+
+// C API of the ILC kernels, for programs that call them without going through Python. It is built into libpixelilc
+// by the Makefile at the top of the repository and only needs this header.
+//
+// Conventions, the same as the ones of the Python module:
+//  - maps hold every pixel of a HEALPix map, npix = 12 nside^2, in RING ordering or NEST when nest is 1
+//  - the per-frequency maps are [Nfreqs][npix], frequency major
+//  - covariances are [npix][Nfreqs2] with Nfreqs2 = Nfreqs(Nfreqs+1)/2, the upper triangle packed by rows
+//  - ipix lists the Npixels pixels to work on, and weights are [Npixels][Nfreqs] in the order of ipix
+//  - pixel indices are long, 64 bits on the LP64 platforms
+// Every function returns 0, or -1 when its arguments are invalid, in which case nothing was computed.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIXELILC_API_VERSION 2
+
+// The number of threads and the per-thread scratch space of the kernels, reused from call to call.
+// A context is not thread safe, use one per calling thread.
+typedef struct pixelilc_context pixelilc_context;
+
+// nthreads <= 0 uses the OpenMP default. Returns NULL when Nfreqs < 1.
+pixelilc_context *pixelilc_context_new(int Nfreqs, int nthreads);
+void pixelilc_context_free(pixelilc_context *ctx);
+int pixelilc_context_nfreqs(const pixelilc_context *ctx);
+int pixelilc_context_nthreads(const pixelilc_context *ctx);
+
+// Covariances of the ipix pixels, summed over the discs of radius fwhm/2 around them and weighted by the mask,
+// written to the rows ipix of covar. The other rows are left untouched.
+int pixelilc_covariance_pixel_space(pixelilc_context *ctx, int nside, int nest, double fwhm, const long *ipix, long Npixels, const double *field_maps, const double *mask, double *covar);
+
+// Weights from the covariances, for the ipix pixels. a and b are the SEDs of the preserved and the nulled components.
+int pixelilc_weights_nilc(pixelilc_context *ctx, const double *covar, const long *ipix, long Npixels, const double *a, double *weights);
+int pixelilc_weights_cnilc(pixelilc_context *ctx, const double *covar, const long *ipix, long Npixels, const double *a, const double *b, double *weights);
+// Also nulling a modified black body, and a power law, with the per-pixel spectral parameters of the maps
+// beta_dust, T_dust and beta_syn of npix pixels, at the frequencies freqs in GHz.
+int pixelilc_weights_cnilc_thermal_dust(pixelilc_context *ctx, const double *covar, const long *ipix, long Npixels, const double *a, const double *freqs, const double *beta_dust, const double *T_dust, double *weights);
+int pixelilc_weights_cnilc_thermal_dust_synchrotron(pixelilc_context *ctx, const double *covar, const long *ipix, long Npixels, const double *a, const double *freqs, const double *beta_dust, const double *T_dust, const double *beta_syn, double *weights);
+
+// Covariances and NILC weights in a single pass over the discs, covar is filled as by pixelilc_covariance_pixel_space
+int pixelilc_weights_nilc_pixel_space(pixelilc_context *ctx, int nside, int nest, double fwhm, const long *ipix, long Npixels, const double *field_maps, const double *mask, const double *a, double *covar, double *weights);
+
+// out[p] = sum_n weights[p][n] maps[n][ipix[p]], the ILC map at the ipix pixels
+int pixelilc_apply_weights(pixelilc_context *ctx, const double *weights, const long *ipix, long Npixels, const double *maps, long npix, double *out);
+
+// Weights in 16 bits, q[p][n] times scales[p/block_pixels][n], about 4 times smaller than the doubles and within 1.5e-5
+// of the largest weight of their frequency in the block. scales is [(Npixels+block_pixels-1)/block_pixels][Nfreqs].
+int pixelilc_quantize_weights(pixelilc_context *ctx, const double *weights, long Npixels, long block_pixels, short *q, float *scales);
+int pixelilc_dequantize_weights(pixelilc_context *ctx, const short *q, const float *scales, long Npixels, long block_pixels, double *weights);
+// pixelilc_apply_weights with the quantized weights, decoded as they are applied
+int pixelilc_apply_quantized_weights(pixelilc_context *ctx, const short *q, const float *scales, long block_pixels, const long *ipix, long Npixels, const double *maps, long npix, double *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
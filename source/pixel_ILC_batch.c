@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_linalg.h>
+#include <gsl/gsl_blas.h>
+#include <omp.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Pixel-space NILC of R realizations sharing the mask and the pixel geometry, as in Monte Carlo runs. Every disc is
+// queried once for all of them. Its pixels go through in panels of PIXELILC_BATCH_PANEL: the values of the panel,
+// times the square root of the mask, are gathered into an (R*Nfreqs) x PIXELILC_BATCH_PANEL matrix, and the
+// covariance of realization r gets the symmetric rank-k update of its Nfreqs rows. The mask must be non-negative.
+
+void pixelILC_Run_NILC_CovarPixelSpace_Batch(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, long Npixels, int Nreal, int Nfreqs, int nside, int nest, double fwhm, double *Field_filtered_maps, double *mask, double *a, double *weights){
+	// Field_filtered_maps is [Nreal][Nfreqs][npix] and weights [Nreal][Npixels][Nfreqs], zeroed by the caller
+	long npix_map = 12L*nside*nside;
+	int Nrows = Nreal*Nfreqs;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	gsl_matrix *panel = gsl_matrix_alloc(Nrows, PIXELILC_BATCH_PANEL);
+	gsl_matrix *Cov = gsl_matrix_alloc(Nrows, Nfreqs);	// the Nfreqs x Nfreqs covariances stacked, upper triangles
+	double *sqrt_w = malloc(PIXELILC_BATCH_PANEL*sizeof(double));
+	long b,q;
+	int r;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			for(r=0;r<Nreal;r++) pixelILC_CancelBlock(sched, block, &weights[r*Npixels*Nfreqs], Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			long nipix;
+			int n, nn, k, row;
+			long ii, nkeep = 0, start;
+			STATS_TIC(t_stats);
+			nipix = pixelILC_QueryDisc(arena, ipix, 0.5*fwhm, nside, nest);
+			STATS_LAP(PILC_QUERY_DISC, t_stats);
+			for(ii=0;ii<nipix;ii++){
+				if(mask[arena->pixel_buffer[ii]] != 0.0) arena->pixel_buffer[nkeep++] = arena->pixel_buffer[ii];
+			}
+			STATS_COUNT(PILC_DISC_PIXELS, nkeep*Nreal);
+
+			gsl_matrix_set_zero(Cov);
+			for(start=0;start<nkeep;start+=PIXELILC_BATCH_PANEL){
+				int K = (nkeep - start < PIXELILC_BATCH_PANEL) ? (int) (nkeep - start) : PIXELILC_BATCH_PANEL;
+				long *disc = &arena->pixel_buffer[start];
+				for(k=0;k<K;k++) sqrt_w[k] = sqrt(mask[disc[k]]);
+				for(row=0;row<Nrows;row++){
+					double *map = &Field_filtered_maps[row*npix_map];
+					double *dst = gsl_matrix_ptr(panel, row, 0);
+					for(k=0;k<K;k++) dst[k] = sqrt_w[k] * map[disc[k]];
+				}
+				for(r=0;r<Nreal;r++){
+					gsl_matrix_view X = gsl_matrix_submatrix(panel, r*Nfreqs, 0, Nfreqs, K);
+					gsl_matrix_view C = gsl_matrix_submatrix(Cov, r*Nfreqs, 0, Nfreqs, Nfreqs);
+					gsl_blas_dsyrk(CblasUpper, CblasNoTrans, 1.0, &X.matrix, 1.0, &C.matrix);
+				}
+			}
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+
+			for(r=0;r<Nreal;r++){
+				for(n=0;n<Nfreqs;n++){
+					for(nn=n;nn<Nfreqs;nn++){
+						double c = gsl_matrix_get(Cov, r*Nfreqs + n, nn);
+						gsl_matrix_set(arena->CovF, n, nn, c);
+						gsl_matrix_set(arena->CovF, nn, n, c);
+					}
+				}
+				gsl_matrix_set_zero(arena->CovFi);
+				pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+				STATS_LAP(PILC_INVERT, t_stats);
+				pixelILC_CalculateILCWeight_NILC_SingleField(a, arena->CovFi, &weights[r*Npixels*Nfreqs], Nfreqs, p);
+				STATS_LAP(PILC_WEIGHTS, t_stats);
+			}
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	gsl_matrix_free(panel);
+	gsl_matrix_free(Cov);
+	free(sqrt_w);
+	}
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include <query_disc_wrapper.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// ILC weights solved on a coarse HEALPix grid and interpolated to the requested pixels. The covariances are smoothed on
+// the scale of the window, so the weights vary on that scale too and a grid a few pixels per fwhm resolves them.
+// The weights of a coarse pixel are the ones of the requested resolution pixel holding its centre, and the requested
+// pixels get the bilinear interpolation of the 4 coarse pixels around them. The interpolation weights add up to 1,
+// so the constraints w.a = 1 and w.b = 0 of the NILC and CNILC hold exactly for the interpolated weights.
+// With tol > 0, one pixel of every coarse cell is also solved exactly, the first one in NEST order, at a corner of the
+// cell where it is farthest from the coarse pixel centres. When its interpolated weights are off by more than tol times
+// its largest exact weight, all the pixels of the cell are solved exactly.
+
+int pixelILC_CoarseNside(int nside, double fwhm){
+	// the smallest power of two with PIXELILC_COARSE_PIXELS_PER_FWHM pixels per fwhm, at most nside
+	int nside_c = 1;
+	while(nside_c < nside && sqrt(PI/3.0)/nside_c > fwhm/PIXELILC_COARSE_PIXELS_PER_FWHM) nside_c *= 2;
+	return nside_c;
+}
+
+typedef struct {
+	long key;
+	long p;
+} pixelILC_coarse_item;
+
+static int pixelILC_compare_coarse_items(const void *a, const void *b){
+	long ka = ((const pixelILC_coarse_item*) a)->key, kb = ((const pixelILC_coarse_item*) b)->key;
+	long pa = ((const pixelILC_coarse_item*) a)->p, pb = ((const pixelILC_coarse_item*) b)->p;
+	if(ka != kb) return (ka > kb) - (ka < kb);
+	return (pa > pb) - (pa < pb);
+}
+
+static int pixelILC_compare_coarse_longs(const void *a, const void *b){
+	long ka = *(const long*) a, kb = *(const long*) b;
+	return (ka > kb) - (ka < kb);
+}
+
+static double *pixelILC_CoarseSolve(pixelILC_arena *arenas, int nthreads, long *ipix_list, long n, int Nfreqs, int nside, double *TEBmaps, double *a, double *b, pixelILC_progress *progress){
+	// the exact weights of the pixels of ipix_list, NILC when b is NULL and CNILC otherwise. The solves add to the total
+	// of progress, and the ones skipped after a cancel get NaN weights
+	double *w = calloc((n > 0 ? n : 1)*Nfreqs, sizeof(double));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_list, n, nside, 0, 0, nthreads);
+	if(progress != NULL) progress->total += n;
+	sched.progress = progress;
+	if(b == NULL) pixelILC_Run_NILC_SHTSmoothing(&sched, arenas, ipix_list, Nfreqs, TEBmaps, a, w);
+	else pixelILC_Run_CNILC_SHTSmoothing(&sched, arenas, ipix_list, Nfreqs, TEBmaps, a, b, w);
+	pixelILC_ScheduleFree(&sched);
+	return w;
+}
+
+long pixelILC_Run_SHTSmoothing_Coarse(pixelILC_arena *arenas, int nthreads, long *ipix_arr, long Npixels, int Nfreqs, int nside, int nest, int nside_c, double *TEBmaps, double *a, double *b, double tol, double *weights, pixelILC_progress *progress){
+	// NILC weights when b is NULL, CNILC otherwise, for the pixels of ipix_arr in RING (or NEST when nest is 1).
+	// nside_c is a power of two not above nside. Returns the number of ILC solves. progress, which may be NULL, counts
+	// the solves, its total grows as the stages find how many they need. After a cancel the pixels next to a coarse
+	// pixel which was not solved get NaN weights, and the tol refinement is skipped.
+	long p, q, k, nsolves;
+	int shift = 0;
+	while((nside_c << shift) < nside) shift++;
+
+	// the coarse pixels around every requested pixel, and the list of the ones needed
+	long *pix4 = malloc((Npixels > 0 ? Npixels : 1)*4*sizeof(long));
+	double *wgt4 = malloc((Npixels > 0 ? Npixels : 1)*4*sizeof(double));
+	interpol_wrapper(ipix_arr, Npixels, nside, nest, nside_c, pix4, wgt4);
+	long *coarse = malloc((Npixels > 0 ? Npixels : 1)*4*sizeof(long));
+	memcpy(coarse, pix4, Npixels*4*sizeof(long));
+	qsort(coarse, Npixels*4, sizeof(long), pixelILC_compare_coarse_longs);
+	long Ncoarse = 0;
+	for(q=0;q<Npixels*4;q++) if(Ncoarse == 0 || coarse[q] != coarse[Ncoarse-1]) coarse[Ncoarse++] = coarse[q];
+
+	long *centers = malloc((Ncoarse > 0 ? Ncoarse : 1)*sizeof(long));
+	coarse_center_wrapper(coarse, Ncoarse, nside_c, nside, nest, centers);
+	double *w_coarse = pixelILC_CoarseSolve(arenas, nthreads, centers, Ncoarse, Nfreqs, nside, TEBmaps, a, b, progress);
+	nsolves = Ncoarse;
+
+	#pragma omp parallel for private(k) schedule(static)
+	for(p=0;p<Npixels;p++){
+		int i;
+		for(i=0;i<Nfreqs;i++) weights[p*Nfreqs + i] = 0.0;
+		for(k=0;k<4;k++){
+			long *found = bsearch(&pix4[4*p + k], coarse, Ncoarse, sizeof(long), pixelILC_compare_coarse_longs);
+			double *wc = &w_coarse[(found - coarse)*Nfreqs];
+			for(i=0;i<Nfreqs;i++) weights[p*Nfreqs + i] += wgt4[4*p + k] * wc[i];
+		}
+	}
+	free(pix4);
+	free(wgt4);
+	free(coarse);
+	free(centers);
+	free(w_coarse);
+	if(tol <= 0.0 || (progress != NULL && progress->cancel)) return nsolves;
+
+	// group the requested pixels by the coarse cell they are in, in NEST order, and probe the first pixel of every cell
+	pixelILC_coarse_item *items = malloc((Npixels > 0 ? Npixels : 1)*sizeof(pixelILC_coarse_item));
+	long *cell = malloc((Npixels > 0 ? Npixels : 1)*sizeof(long));
+	if(nest) memcpy(cell, ipix_arr, Npixels*sizeof(long));
+	else ring2nest_wrapper(ipix_arr, Npixels, nside, cell);
+	for(p=0;p<Npixels;p++){
+		items[p].key = cell[p];
+		items[p].p = p;
+	}
+	qsort(items, Npixels, sizeof(pixelILC_coarse_item), pixelILC_compare_coarse_items);
+	long Ncells = 0;
+	long *cell_start = malloc((Npixels + 1)*sizeof(long));
+	for(p=0;p<Npixels;p++) if(p == 0 || (items[p].key >> 2*shift) != (items[p-1].key >> 2*shift)) cell_start[Ncells++] = p;
+	cell_start[Ncells] = Npixels;
+	long *probes = malloc((Ncells > 0 ? Ncells : 1)*sizeof(long));
+	for(q=0;q<Ncells;q++) probes[q] = ipix_arr[items[cell_start[q]].p];
+	double *w_probe = pixelILC_CoarseSolve(arenas, nthreads, probes, Ncells, Nfreqs, nside, TEBmaps, a, b, progress);
+	nsolves += Ncells;
+
+	// every pixel of the cells failing the check is solved exactly
+	long Nrefine = 0;
+	for(q=0;q<Ncells;q++){
+		long pp = items[cell_start[q]].p;
+		double dmax = 0.0, wmax = 0.0;
+		int i;
+		for(i=0;i<Nfreqs;i++){
+			double d = fabs(weights[pp*Nfreqs + i] - w_probe[q*Nfreqs + i]);
+			if(d > dmax || isnan(d)) dmax = d;
+			if(fabs(w_probe[q*Nfreqs + i]) > wmax) wmax = fabs(w_probe[q*Nfreqs + i]);
+		}
+		memcpy(&weights[pp*Nfreqs], &w_probe[q*Nfreqs], Nfreqs*sizeof(double));
+		if(!(dmax <= tol*wmax)){
+			for(k=cell_start[q];k<cell_start[q+1];k++) if(items[k].p != pp) items[Nrefine++].p = items[k].p;
+		}
+	}
+	// items[0 ... Nrefine-1].p now lists the pixels to refine, it only ever overwrites entries already visited
+	long *refine = malloc((Nrefine > 0 ? Nrefine : 1)*sizeof(long));
+	for(k=0;k<Nrefine;k++) refine[k] = ipix_arr[items[k].p];
+	double *w_refine = pixelILC_CoarseSolve(arenas, nthreads, refine, Nrefine, Nfreqs, nside, TEBmaps, a, b, progress);
+	nsolves += Nrefine;
+	for(k=0;k<Nrefine;k++) memcpy(&weights[items[k].p*Nfreqs], &w_refine[k*Nfreqs], Nfreqs*sizeof(double));
+	free(items);
+	free(cell);
+	free(cell_start);
+	free(probes);
+	free(w_probe);
+	free(refine);
+	free(w_refine);
+	return nsolves;
+}
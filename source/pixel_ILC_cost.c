@@ -0,0 +1,170 @@
+#define _DEFAULT_SOURCE	// sysconf(_SC_PHYS_PAGES) with -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <gsl/gsl_matrix.h>
+#include <omp.h>
+#include <pixel_ILC.h>
+
+// A cost model of the pixel-space covariance strategies. Every strategy is a count of a few unit operations (a disc
+// pixel queried, a multiply-add of a disc sum, the solve of one pixel, a flop of the dense inverse, a kernel mode of
+// the ring FFT smoothing) and of the bytes it holds. The seconds per unit come from a short single thread benchmark
+// of the same kernels, or from defaults, and the parallel parts are divided by the number of threads.
+
+void pixelILC_CostDefaultRates(pixelILC_cost_rates *rates){
+	rates->query = 2.0e-8;
+	rates->madd = 1.0e-9;
+	rates->solve = 1.0e-6;
+	rates->flop = 1.0e-9;
+	rates->ring_mode = 5.0e-9;
+}
+
+double pixelILC_CostDiscPixels(int nside, double fwhm){
+	// pixels in a disc of radius fwhm/2, at least the pixel itself
+	double d = 6.0*nside*(double)nside*(1.0 - cos(0.5*fwhm));
+	return (d > 1.0) ? d : 1.0;
+}
+
+static double pixelILC_CostRingUnits(int nside, double fwhm){
+	// kernel modes visited by one ring FFT smoothing: every ring sums the rings within PIXELILC_RINGFFT_NSIGMA sigma,
+	// with about 2*mkernel+1 modes each, mkernel ~ sqrt(2 log(1/EPS)) sin(theta)/sigma and sin(theta) ~ pi/4 on average
+	double nrings = 4.0*nside - 1.0, sigma = 0.25*fwhm;
+	double near = 2.0*PIXELILC_RINGFFT_NSIGMA*sigma / (PI/(4.0*nside)) + 1.0;
+	double mkernel = sqrt(-2.0*log(PIXELILC_RINGFFT_EPS)) * 0.25*PI / sigma + 1.0;
+	if(near > nrings) near = nrings;
+	if(mkernel > 2.0*nside) mkernel = 2.0*nside;
+	return nrings * near * (2.0*mkernel + 1.0);
+}
+
+double pixelILC_CostMemoryLimit(void){
+	// PIXELILC_MEMORY_FRACTION of the physical memory, 0 when it is unknown
+	long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+	if(pages <= 0 || page_size <= 0) return 0.0;
+	return PIXELILC_MEMORY_FRACTION * (double) pages * (double) page_size;
+}
+
+double pixelILC_CostDenseBytes(int Nfreqs, long Npixels, int nside){
+	// doNILC_SHTSmoothing_SingleField_pixpixcorr: the covariance and its inverse, dense (Nfreqs*Npixels)^2, the pair
+	// maps and the unit vectors of all the pixels
+	double n = (double) Nfreqs * Npixels, npix = 12.0*nside*nside;
+	return 2.0*n*n*sizeof(double) + (double) Npixels*(Npixels+1)*sizeof(int) + 3.0*npix*sizeof(double) + n*sizeof(double);
+}
+
+void pixelILC_CostCalibrate(int nside, double fwhm, int Nfreqs, pixelILC_cost_rates *rates){
+	// runs every unit operation on the calling thread for a few milliseconds
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2, nside_cal = PIXELILC_CALIBRATE_NSIDE, k, n;
+	long npix_cal = 12L*nside_cal*nside_cal, i, nipix, total;
+	int saved_threads = omp_get_max_threads();
+	double t;
+	omp_set_num_threads(1);
+	pixelILC_arena *arena = pixelILC_ArenasAlloc(1, Nfreqs);
+
+	// queries at the resolution of the problem, degraded when the discs are too large to query quickly
+	int nside_q = pixelILC_DegradedNside(nside, fwhm, PIXELILC_CALIBRATE_DISC_PIXELS);
+	long npix_q = 12L*nside_q*nside_q;
+	t = omp_get_wtime();
+	total = 0;
+	for(k=0;k<PIXELILC_CALIBRATE_DISCS;k++){
+		long ipix = (2*k + 1) * (npix_q / (2*PIXELILC_CALIBRATE_DISCS));
+		nipix = pixelILC_QueryDisc(arena, ipix, 0.5*fwhm, nside_q, 0);
+		total += nipix + 1;
+	}
+	rates->query = (omp_get_wtime() - t) / total;
+
+	// disc sums over discs of a small synthetic map
+	double *maps = malloc(Nfreqs*npix_cal*sizeof(double));
+	double *mask = malloc(npix_cal*sizeof(double));
+	double *Covar = calloc(Nfreqs2, sizeof(double));
+	for(i=0;i<Nfreqs*npix_cal;i++) maps[i] = (double) ((i*2654435761L) % 1000) / 1000.0 - 0.5;
+	for(i=0;i<npix_cal;i++) mask[i] = 1.0;
+	nipix = pixelILC_QueryDisc(arena, npix_cal/2, PIXELILC_CALIBRATE_RADIUS, nside_cal, 0);
+	t = omp_get_wtime();
+	for(k=0;k<PIXELILC_CALIBRATE_DISCS;k++){
+		memset(Covar, 0, Nfreqs2*sizeof(double));
+		pixelILC_DefineCovMat_NILC_DiscPixels_SingleField(0, Nfreqs, npix_cal, Covar, maps, mask, arena->pixel_buffer, NULL, nipix, arena->CovF, Nfreqs2);
+	}
+	rates->madd = (omp_get_wtime() - t) / ((double) PIXELILC_CALIBRATE_DISCS * (nipix + 1) * Nfreqs2);
+
+	// the solve of one pixel, on the covariance of the last disc made positive definite
+	double *a = malloc(Nfreqs*sizeof(double));
+	double *weights = calloc(Nfreqs, sizeof(double));
+	gsl_matrix *Cov = gsl_matrix_alloc(Nfreqs, Nfreqs);
+	for(n=0;n<Nfreqs;n++){
+		a[n] = 1.0;
+		gsl_matrix_set(arena->CovF, n, n, gsl_matrix_get(arena->CovF, n, n) + 1.0);
+	}
+	t = omp_get_wtime();
+	for(k=0;k<PIXELILC_CALIBRATE_SOLVES;k++){
+		gsl_matrix_memcpy(Cov, arena->CovF);
+		pixelILC_InvertMatrix(Cov, arena->CovFi, Nfreqs, arena->perm);
+		pixelILC_CalculateILCWeight_NILC_SingleField(a, arena->CovFi, weights, Nfreqs, 0);
+	}
+	rates->solve = (omp_get_wtime() - t) / PIXELILC_CALIBRATE_SOLVES;
+
+	// the dense inverse, LU and inversion take about 2 n^3 flops
+	int ndense = PIXELILC_CALIBRATE_DENSE;
+	gsl_matrix *dense = gsl_matrix_alloc(ndense, ndense), *dense_i = gsl_matrix_alloc(ndense, ndense);
+	for(k=0;k<ndense;k++) for(n=0;n<ndense;n++) gsl_matrix_set(dense, k, n, (k == n) ? ndense : 1.0/(1.0 + k + n));
+	t = omp_get_wtime();
+	invert_a_matrix(dense, dense_i, ndense);
+	rates->flop = (omp_get_wtime() - t) / (2.0*ndense*(double)ndense*ndense);
+
+	// one ring FFT smoothing, the plan of a map of ones
+	pixelILC_ringfft_plan plan;
+	t = omp_get_wtime();
+	pixelILC_RingFFTPlanInit(&plan, nside_cal, PIXELILC_CALIBRATE_RADIUS);
+	rates->ring_mode = (omp_get_wtime() - t) / pixelILC_CostRingUnits(nside_cal, PIXELILC_CALIBRATE_RADIUS);
+	pixelILC_RingFFTPlanFree(&plan);
+
+	gsl_matrix_free(Cov);
+	gsl_matrix_free(dense);
+	gsl_matrix_free(dense_i);
+	free(maps);
+	free(mask);
+	free(Covar);
+	free(a);
+	free(weights);
+	pixelILC_ArenasFree(arena, 1);
+	omp_set_num_threads(saved_threads);
+}
+
+int pixelILC_CostPlan(int nside, double fwhm, int Nfreqs, long Npixels, double fsky, int nthreads, double memory_limit, pixelILC_cost_rates *rates, pixelILC_strategy *strategies){
+	// Fills the PIXELILC_NSTRATEGIES strategies and returns the index of the fastest feasible one, preferring the exact
+	// disc sums, or -1 when none fits in memory_limit bytes (no limit when it is 0).
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2, s, best = -1;
+	double npix = 12.0*nside*nside, Np = (double) Npixels, T = (double) nthreads;
+	double D = pixelILC_CostDiscPixels(nside, fwhm);
+	// what every strategy holds: the filtered maps, the mask, the covariance maps, ipix_arr and the weights
+	double base = (Nfreqs + 1.0 + Nfreqs2)*npix*sizeof(double) + Np*sizeof(long) + Np*Nfreqs*sizeof(double);
+	double solve = Np*rates->solve;
+
+	strategies[0] = (pixelILC_strategy) {"disc_sums", "doNILC_CovarPixelSpace_SingleField", 1, 0.0,
+		(Np*D*rates->query + Np*D*fsky*Nfreqs2*rates->madd + solve) / T,
+		base + T*D*sizeof(long), 0};
+	strategies[1] = (pixelILC_strategy) {"plan_discs", "Plan.doNILC_CovarPixelSpace", 1, 2.0*Np*D*rates->query / T,
+		(Np*D*fsky*Nfreqs2*rates->madd + solve) / T,
+		base + (Np*D + Np + 1.0)*sizeof(long), 0};
+	int nside_lo = pixelILC_DegradedNside(nside, fwhm, PIXELILC_DEGRADE_TARGET_PIXELS);
+	double npix_lo = 12.0*nside_lo*nside_lo, D_lo = pixelILC_CostDiscPixels(nside_lo, fwhm);
+	double parents = (Np < npix_lo) ? Np : npix_lo;
+	strategies[2] = (pixelILC_strategy) {"degraded", "doNILC_CovarPixelSpace_Degraded_SingleField", 0, 0.0,
+		(npix*fsky*Nfreqs2*rates->madd + parents*(D_lo*rates->query + D_lo*Nfreqs2*rates->madd + rates->solve)) / T,
+		base + npix_lo*Nfreqs2*sizeof(double) + parents*(Nfreqs + Nfreqs2)*sizeof(double) + 2.0*Np*sizeof(long), 0};
+	strategies[3] = (pixelILC_strategy) {"ringfft", "doNILC_CovarRingFFT_SingleField", 0, 0.0,
+		((Nfreqs2 + 1.0)*pixelILC_CostRingUnits(nside, fwhm)*rates->ring_mode + npix*Nfreqs2*rates->madd + solve) / T,
+		base + 5.0*npix*sizeof(double), 0};
+	double n = Nfreqs*Np;
+	strategies[4] = (pixelILC_strategy) {"dense", "doNILC_SHTSmoothing_SingleField_pixpixcorr", 0, 0.0,
+		0.5*Np*Np*Nfreqs2*PIXELILC_SPLINE_MADDS*rates->madd / T + 2.0*n*n*n*rates->flop + 2.0*n*n*rates->madd,
+		Nfreqs2*npix*sizeof(double) + pixelILC_CostDenseBytes(Nfreqs, Npixels, nside), 0};
+
+	for(s=0;s<PIXELILC_NSTRATEGIES;s++){
+		pixelILC_strategy *st = &strategies[s];
+		st->feasible = (memory_limit <= 0.0 || st->bytes <= memory_limit);
+		if(!st->feasible) continue;
+		if(best < 0 || (st->exact && !strategies[best].exact) || (st->exact == strategies[best].exact && st->seconds < strategies[best].seconds)) best = s;
+	}
+	return best;
+}
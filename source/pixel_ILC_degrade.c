@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_linalg.h>
+#include <omp.h>
+#include <query_disc_wrapper.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Pixel-space covariances of wide windows, estimated at a lower resolution. The products mask*F_n*F_nn of the filtered
+// maps are summed into the pixels of a degraded map, so a disc sum over the degraded pixels is the disc sum over the
+// full resolution pixels up to the edge of the disc. The weights are computed once per degraded pixel, with its disc
+// centred on it, and copied to the requested pixels inside it. Everything at the low resolution is in NEST ordering.
+
+int pixelILC_DegradedNside(int nside, double fwhm, long target_pixels){
+	// the smallest power of two whose discs of radius fwhm/2 hold at least target_pixels pixels, at most nside
+	double disc_area = 1.0 - cos(0.5*fwhm);	// over 2 pi, the disc holds 6 nside^2 disc_area pixels
+	int nside_lo = 1;
+	while(nside_lo < nside && 6.0*nside_lo*(double)nside_lo*disc_area < (double) target_pixels) nside_lo *= 2;
+	return nside_lo;
+}
+
+void pixelILC_DegradeProducts(int Nfreqs, int nside, int nest, int nside_lo, double *Field_filtered_map, double *mask, double *products){
+	// products[J*Nfreqs2 + c] is the sum over the full resolution pixels inside the NEST pixel J of nside_lo of
+	// mask*F_n*F_nn, in the packed order of the covariances
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	long npix_map = 12L*nside*nside, npix_lo = 12L*nside_lo*nside_lo;
+	long nchildren = npix_map/npix_lo;
+	long J;
+	#pragma omp parallel
+	{
+	long *children = malloc(nchildren*sizeof(long));
+	long *children_map = malloc(nchildren*sizeof(long));
+	long k, ipix2;
+	int n, nn, c;
+	double xm, w;
+	#pragma omp for schedule(dynamic,16)
+	for(J=0;J<npix_lo;J++){
+		double *prod = &products[J*Nfreqs2];
+		// the children of J are consecutive in NEST
+		for(k=0;k<nchildren;k++) children[k] = J*nchildren + k;
+		if(nest) memcpy(children_map, children, nchildren*sizeof(long));
+		else nest2ring_wrapper(children, nchildren, nside, children_map);
+		for(c=0;c<Nfreqs2;c++) prod[c] = 0.0;
+		for(k=0;k<nchildren;k++){
+			ipix2 = children_map[k];
+			w = mask[ipix2];
+			if(w == 0.0) continue;
+			c = 0;
+			for(n=0;n<Nfreqs;n++){
+				xm = Field_filtered_map[n*npix_map + ipix2] * w;
+				for(nn=n;nn<Nfreqs;nn++){
+					prod[c] += xm * Field_filtered_map[nn*npix_map + ipix2] ;
+					c += 1;
+				}
+			}
+		}
+	}
+	free(children);
+	free(children_map);
+	}
+}
+
+static int pixelILC_compare_longs(const void *a, const void *b){
+	long ka = *(const long*) a, kb = *(const long*) b;
+	return (ka > kb) - (ka < kb);
+}
+
+void pixelILC_Run_NILC_CovarPixelSpace_Degraded(pixelILC_arena *arenas, long *ipix_arr, long Npixels, int Nfreqs, int nside, int nest, int nside_lo, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, double *a, double *weights, pixelILC_progress *progress){
+	// Like pixelILC_Run_NILC_CovarPixelSpace with the covariances estimated at nside_lo, a power of two not above nside.
+	// Covar_maps gets the degraded disc sums of the requested pixels. progress, when not NULL, counts the degraded pixels
+	// and its total is set here; after a cancel the weights of the pixels whose degraded pixel was not reached are NaN.
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	long npix_lo = 12L*nside_lo*nside_lo;
+	int shift = 0;
+	while((nside_lo << shift) < nside) shift++;
+	long p, q;
+	STATS_TIC(t_stats);
+	double *products = malloc(npix_lo*Nfreqs2*sizeof(double));
+	pixelILC_DegradeProducts(Nfreqs, nside, nest, nside_lo, Field_filtered_map, mask, products);
+	STATS_LAP(PILC_COVARIANCE, t_stats);
+
+	// the degraded pixels holding the requested ones, each once and sorted, so neighbours are processed together
+	long *parent = malloc((Npixels > 0 ? Npixels : 1)*sizeof(long));
+	if(nest) memcpy(parent, ipix_arr, Npixels*sizeof(long));
+	else ring2nest_wrapper(ipix_arr, Npixels, nside, parent);
+	for(p=0;p<Npixels;p++) parent[p] >>= 2*shift;
+	long *parents = malloc((Npixels > 0 ? Npixels : 1)*sizeof(long));
+	memcpy(parents, parent, Npixels*sizeof(long));
+	qsort(parents, Npixels, sizeof(long), pixelILC_compare_longs);
+	long Nparents = 0;
+	for(p=0;p<Npixels;p++) if(Nparents == 0 || parents[p] != parents[Nparents-1]) parents[Nparents++] = parents[p];
+	double *weights_lo = calloc((Nparents > 0 ? Nparents : 1)*Nfreqs, sizeof(double));
+	double *Covar_lo = calloc((Nparents > 0 ? Nparents : 1)*Nfreqs2, sizeof(double));
+	STATS_LAP(PILC_MARSHAL, t_stats);
+	if(progress != NULL) progress->total = Nparents;
+
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long nipix;
+	int n, nn, c;
+	long ii;
+	#pragma omp for schedule(dynamic,16)
+	for(q=0;q<Nparents;q++){
+		if(progress != NULL && progress->cancel){
+			for(n=0;n<Nfreqs;n++) weights_lo[q*Nfreqs + n] = NAN;
+			continue;
+		}
+		STATS_TIC(t_query);
+		nipix = pixelILC_QueryDisc(arena, parents[q], 0.5*fwhm, nside_lo, 1);
+		STATS_LAP(PILC_QUERY_DISC, t_query);
+		double *Covar_pix = &Covar_lo[q*Nfreqs2];
+		for(ii=0;ii<nipix;ii++){
+			double *prod = &products[arena->pixel_buffer[ii]*Nfreqs2];
+			for(c=0;c<Nfreqs2;c++) Covar_pix[c] += prod[c];
+		}
+		STATS_COUNT(PILC_DISC_PIXELS, nipix);
+		c = 0;
+		for(n=0;n<Nfreqs;n++){
+			for(nn=n;nn<Nfreqs;nn++){
+				gsl_matrix_set(arena->CovF, n, nn, Covar_pix[c] );
+				if(n!=nn){
+					gsl_matrix_set(arena->CovF, nn, n, Covar_pix[c] );
+				}
+				c += 1;
+			}
+		}
+		STATS_LAP(PILC_COVARIANCE, t_query);
+		pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+		STATS_LAP(PILC_INVERT, t_query);
+		pixelILC_CalculateILCWeight_NILC_SingleField(a, arena->CovFi, weights_lo, Nfreqs, q);
+		STATS_LAP(PILC_WEIGHTS, t_query);
+		STATS_COUNT(PILC_PIXELS, 1);
+		if(progress != NULL) pixelILC_ProgressBlock(progress, 1);
+	}
+
+	// back to the requested pixels
+	#pragma omp for schedule(static)
+	for(p=0;p<Npixels;p++){
+		long *found = bsearch(&parent[p], parents, Nparents, sizeof(long), pixelILC_compare_longs);
+		long qp = found - parents;
+		memcpy(&weights[p*Nfreqs], &weights_lo[qp*Nfreqs], Nfreqs*sizeof(double));
+		memcpy(&Covar_maps[ipix_arr[p]*Nfreqs2], &Covar_lo[qp*Nfreqs2], Nfreqs2*sizeof(double));
+	}
+	}
+	free(products);
+	free(parent);
+	free(parents);
+	free(weights_lo);
+	free(Covar_lo);
+}
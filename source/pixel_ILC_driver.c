@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_linalg.h>
+#include <gsl/gsl_blas.h>
+#include <omp.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// The pixel loops of the ILC variants, independent of python. They run the pixels of a schedule in an omp parallel region
+// with the number of threads set by the caller, and thread t works in arenas[t], so arenas must hold one arena per thread.
+// The module functions allocate the arenas for one call, a PixelILC.Plan keeps them between calls.
+
+pixelILC_arena *pixelILC_ArenasAlloc(int nthreads, int Nfreqs){
+	int t;
+	pixelILC_arena *arenas = malloc(nthreads*sizeof(pixelILC_arena));
+	for(t=0;t<nthreads;t++){
+		pixelILC_arena *arena = &arenas[t];
+		arena->CovF = gsl_matrix_calloc(Nfreqs, Nfreqs);
+		arena->CovFi = gsl_matrix_calloc(Nfreqs, Nfreqs);
+		arena->perm = gsl_permutation_alloc(Nfreqs);
+		arena->perm3 = gsl_permutation_alloc(3);
+		arena->A = gsl_matrix_calloc(Nfreqs, 3); // the 3 is because we do CMB, dust, syn
+		arena->first = gsl_matrix_calloc(Nfreqs, 3);
+		arena->second = gsl_matrix_calloc(3, 3);
+		arena->second_i = gsl_matrix_calloc(3, 3);
+		arena->third = gsl_matrix_calloc(3, Nfreqs);
+		arena->fourth = gsl_matrix_calloc(3, Nfreqs);
+		arena->fifth = gsl_matrix_calloc(1, Nfreqs);
+		arena->e_t = gsl_matrix_calloc(1, 3);
+		gsl_matrix_set(arena->e_t,0,0,1.0); gsl_matrix_set(arena->e_t,0,1,0.0); gsl_matrix_set(arena->e_t,0,2,0.0);
+		arena->b = calloc(Nfreqs, sizeof(double));
+		arena->work = calloc(2*Nfreqs, sizeof(double));
+		arena->pixel_buffer_size = PIXELILC_PIXEL_BUFFER_SIZE;
+		arena->pixel_buffer = calloc(arena->pixel_buffer_size, sizeof(long));
+		arena->CovF_float = gsl_matrix_float_calloc(Nfreqs, Nfreqs);
+		arena->CovFi_float = gsl_matrix_float_calloc(Nfreqs, Nfreqs);
+		arena->run_float = calloc(Nfreqs*(Nfreqs+1)/2, sizeof(float));
+		arena->acc = calloc(Nfreqs*(Nfreqs+1)/2, sizeof(double));
+	}
+	return arenas;
+}
+
+void pixelILC_ArenasFree(pixelILC_arena *arenas, int nthreads){
+	int t;
+	for(t=0;t<nthreads;t++){
+		pixelILC_arena *arena = &arenas[t];
+		gsl_matrix_free(arena->CovF);
+		gsl_matrix_free(arena->CovFi);
+		gsl_permutation_free(arena->perm);
+		gsl_permutation_free(arena->perm3);
+		gsl_matrix_free(arena->A);
+		gsl_matrix_free(arena->first); gsl_matrix_free(arena->second); gsl_matrix_free(arena->second_i);
+		gsl_matrix_free(arena->third); gsl_matrix_free(arena->fourth); gsl_matrix_free(arena->fifth);
+		gsl_matrix_free(arena->e_t);
+		free(arena->b);
+		free(arena->work);
+		free(arena->pixel_buffer);
+		gsl_matrix_float_free(arena->CovF_float);
+		gsl_matrix_float_free(arena->CovFi_float);
+		free(arena->run_float);
+		free(arena->acc);
+	}
+	free(arenas);
+}
+
+void pixelILC_Thermo2RJ(double *freq_arr, int Nfreqs, double *thermo_2_rj){
+	// multiplying by this factor transform thermo 2 RJ units, divide for the reverse conversion
+	for(int n=0;n<Nfreqs;n++){
+		double x_cmb = H_PLANCK * freq_arr[n] * 1.0e9 / (K_BOLTZ*T_CMB) ;
+		thermo_2_rj[n] = pow(x_cmb,2) * exp(x_cmb) / pow(exp(x_cmb) - 1.0,2) ;
+	}
+}
+
+void pixelILC_Run_NILC_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *a, double *weights){
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			// This is the index of the pixel to process
+			long ipix = ipix_arr[p];
+			// Cov is a gsl_matrix and has shape [Nfreqs,Nfreqs] with indices n,nn
+			// I need to make sure to empty their content from the previous iteration
+			STATS_TIC(t_stats);
+			gsl_matrix_set_zero(arena->CovF);
+			gsl_matrix_set_zero(arena->CovFi);
+			pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs, TEBmaps, arena->CovF, Nfreqs2);
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			// Now we need to invert the Cov matrices
+			pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_NILC_SingleField(a, arena->CovFi, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+void pixelILC_Run_CNILC_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *a, double *b_sed, double *weights){
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			STATS_TIC(t_stats);
+			gsl_matrix_set_zero(arena->CovF);
+			gsl_matrix_set_zero(arena->CovFi);
+			pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs, TEBmaps, arena->CovF, Nfreqs2);
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_CNILC_SingleField(a, b_sed, arena->CovFi, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+void pixelILC_Run_CNILC_ThermalDust_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *a, double *beta_dust_map, double *T_dust_map, double *freq_arr, double *thermo_2_rj, double *weights){
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			STATS_TIC(t_stats);
+			gsl_matrix_set_zero(arena->CovF);
+			gsl_matrix_set_zero(arena->CovFi);
+			pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs, TEBmaps, arena->CovF, Nfreqs2);
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			// calculate the b vector with the Thermal dust SED
+			for(int nn=0;nn<Nfreqs;nn++){
+				double x_d_nu = H_PLANCK * freq_arr[nn] * 1.e9 / ( K_BOLTZ * T_dust_map[ipix] );
+				arena->b[nn] = pow(freq_arr[nn],beta_dust_map[ipix]+1.0)/(exp(x_d_nu)-1.0) / thermo_2_rj[nn]  ;
+			}
+			pixelILC_CalculateILCWeight_CNILC_SingleField(a, arena->b, arena->CovFi, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+void pixelILC_Run_CNILC_ThermalDust_Synchrotron_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *a, double *beta_dust_map, double *T_dust_map, double *beta_syn_map, double *freq_arr, double *thermo_2_rj, double *weights){
+	// this follows the nomencleture of arxiv:2006.0862
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			STATS_TIC(t_stats);
+			pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs, TEBmaps, arena->CovF, Nfreqs2);
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			// we need to fill the A matrix
+			for(int nn=0;nn<Nfreqs;nn++){
+				gsl_matrix_set(arena->A,nn,0,1.0) ;
+				double x_d_nu = H_PLANCK * freq_arr[nn] * 1.e9 / ( K_BOLTZ * T_dust_map[ipix] );
+				gsl_matrix_set(arena->A,nn,1,pow(freq_arr[nn],beta_dust_map[ipix]+1.0)/(exp(x_d_nu)-1.0) / thermo_2_rj[nn]) ; // this is dust
+				gsl_matrix_set(arena->A,nn,2,pow(freq_arr[nn],beta_syn_map[ipix])/thermo_2_rj[nn] ) ; // this is syn
+			}
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			// Now we need to invert the Cov matrices
+			pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			// multiply C^-1 with A, which is a Nfreqs x 3 size matrix. this is called first
+			gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, arena->CovFi, arena->A, 0.0, arena->first);
+			// now multiply A_t and first, which is size (3,3), this is second
+			gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, arena->A, arena->first, 0.0, arena->second);
+			// now we need to invert the matrix second
+			pixelILC_InvertMatrix(arena->second, arena->second_i, 3, arena->perm3);
+			// we need to multiply A_t with C^-1, which is size (3,Nfreq) and we call it third
+			gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, arena->A, arena->CovFi, 0.0, arena->third);
+			// we need to multiply second_i and third, which is size (3,Nfreq) and we call it fourth
+			gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, arena->second_i, arena->third, 0.0, arena->fourth);
+			// we need to multiply e_t and fourth, which is size (1,Nfreq) and we call it fifth
+			gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, arena->e_t, arena->fourth, 0.0, arena->fifth);
+			// fifth is a matrix that contains the weights
+			for(int nn=0;nn<Nfreqs;nn++){
+				weights[p*Nfreqs + nn] = gsl_matrix_get(arena->fifth,0,nn);
+			}
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+void pixelILC_Run_NILC_CovarPixelSpace(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, long *disc_start, long *disc_pixels, double *disc_weights, long npix_map, double *a, double *weights){
+	// when disc_start is not NULL the disc of ipix_arr[p] is disc_pixels[disc_start[p]] ... disc_pixels[disc_start[p+1]-1],
+	// otherwise every disc is queried. With disc_weights (from pixelILC_MaskDiscs) the mask values come from there and
+	// mask is not read. npix_map is the number of pixels of the maps, 12*nside^2 unless the discs index compact maps,
+	// in which case ipix_arr[p] is only the row of Covar_maps.
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			gsl_matrix_set_zero(arena->CovF);
+			gsl_matrix_set_zero(arena->CovFi);
+			if(disc_start == NULL){
+				pixelILC_DefineCovMat_NILC_CovarPixelSpace_SingleField(ipix, Nfreqs, nside, nest, Covar_maps, Field_filtered_map, mask, arena, arena->CovF, Nfreqs2, fwhm);
+			}
+			else{
+				pixelILC_DefineCovMat_NILC_DiscPixels_SingleField(ipix, Nfreqs, npix_map, Covar_maps, Field_filtered_map, mask, &disc_pixels[disc_start[p]], (disc_weights != NULL) ? &disc_weights[disc_start[p]] : NULL, disc_start[p+1] - disc_start[p], arena->CovF, Nfreqs2);
+			}
+			STATS_TIC(t_stats);
+			pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_NILC_SingleField(a, arena->CovFi, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+void pixelILC_Run_Factorize(pixelILC_schedule *sched, long *ipix_arr, int Nfreqs, double *TEBmaps, double *U){
+	// row p of U is the packed Cholesky factor of the covariance of ipix_arr[p]. After a cancel the rows not reached are
+	// NaN, unless U is TEBmaps itself, factorized in place, where they keep the covariances of the caller.
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	int in_place = (U == TEBmaps);
+	#pragma omp parallel
+	{
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			if(!in_place) pixelILC_CancelBlock(sched, block, U, Nfreqs2);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			STATS_TIC(t_stats);
+			pixelILC_CholeskyPacked(&TEBmaps[ipix_arr[p]*Nfreqs2], &U[p*Nfreqs2], Nfreqs);
+			STATS_LAP(PILC_INVERT, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Cholesky factors of the per-pixel covariances, kept packed like a row of TEBmaps so a cache of factors takes the same
+// memory as the covariances. With C = U^T U, where U is upper triangular, every weight only needs two triangular solves
+// per constraint vector, so the factors can be reused by the NILC and constrained ILC weights.
+
+PIXELILC_HOT int pixelILC_CholeskyPacked(double *Cov, double *U, int Nfreqs){
+	// Cov and U are packed upper triangles, U can be the same array as Cov. Returns 1 if the matrix is ill-conditioned,
+	// with the same criterion as invert_a_matrix. A matrix which is not positive definite gives NaNs in U.
+	int n, nn, k, ill_conditioned;
+	double s, pivot, pivot_min = 0.0, pivot_max = 0.0;
+	for(n=0;n<Nfreqs;n++){
+		for(nn=n;nn<Nfreqs;nn++){
+			s = Cov[PIXELILC_PACKED_INDEX(n,nn,Nfreqs)];
+			for(k=0;k<n;k++) s -= U[PIXELILC_PACKED_INDEX(k,n,Nfreqs)] * U[PIXELILC_PACKED_INDEX(k,nn,Nfreqs)];
+			if(nn == n){
+				// U_nn^2 are the LU pivots of Cov without pivoting
+				pivot = fabs(s);
+				if(n == 0 || pivot < pivot_min) pivot_min = pivot;
+				if(n == 0 || pivot > pivot_max) pivot_max = pivot;
+				U[PIXELILC_PACKED_INDEX(n,n,Nfreqs)] = sqrt(s);
+			}
+			else U[PIXELILC_PACKED_INDEX(n,nn,Nfreqs)] = s / U[PIXELILC_PACKED_INDEX(n,n,Nfreqs)];
+		}
+	}
+	ill_conditioned = !(pivot_min > PIXELILC_PIVOT_RATIO_MIN * pivot_max);
+	STATS_COUNT(PILC_FACTORIZED, 1);
+	if (ill_conditioned) STATS_COUNT(PILC_ILL_CONDITIONED, 1);
+	return ill_conditioned;
+}
+
+PIXELILC_HOT void pixelILC_CholeskySolveLower(double *U, double *x, int Nfreqs){
+	// x <- U^-T x
+	int n, k;
+	for(n=0;n<Nfreqs;n++){
+		for(k=0;k<n;k++) x[n] -= U[PIXELILC_PACKED_INDEX(k,n,Nfreqs)] * x[k];
+		x[n] /= U[PIXELILC_PACKED_INDEX(n,n,Nfreqs)];
+	}
+}
+
+PIXELILC_HOT void pixelILC_CholeskySolveUpper(double *U, double *x, int Nfreqs){
+	// x <- U^-1 x
+	int n, k;
+	for(n=Nfreqs-1;n>=0;n--){
+		for(k=n+1;k<Nfreqs;k++) x[n] -= U[PIXELILC_PACKED_INDEX(n,k,Nfreqs)] * x[k];
+		x[n] /= U[PIXELILC_PACKED_INDEX(n,n,Nfreqs)];
+	}
+}
+
+PIXELILC_HOT void pixelILC_CalculateILCWeight_NILC_Factorized(double* a, double *U, double* weights,  int Nfreqs,  long p, double *work){
+	// same weights as pixelILC_CalculateILCWeight_NILC_SingleField, work has size Nfreqs
+	double aCia_F=0.0;
+	int i;
+	for(i=0;i<Nfreqs;i++) work[i] = a[i];
+	pixelILC_CholeskySolveLower(U, work, Nfreqs);
+	for(i=0;i<Nfreqs;i++) aCia_F += work[i] * work[i];
+	pixelILC_CholeskySolveUpper(U, work, Nfreqs);
+	for(i=0;i<Nfreqs;i++) weights[p*Nfreqs + i] += work[i] / aCia_F;
+}
+
+PIXELILC_HOT void pixelILC_CalculateILCWeight_CNILC_Factorized(double* a, double* b, double *U, double* weights,  int Nfreqs,  long p, double *work){
+	// same weights as pixelILC_CalculateILCWeight_CNILC_SingleField, eq. 19 in arXiv:2006.0862. work has size 2*Nfreqs
+	double aCia_F=0.0,aCib_F=0.0,bCib_F=0.0;
+	double *Cia = work, *Cib = &work[Nfreqs];
+	double down;
+	int i;
+	for(i=0;i<Nfreqs;i++){
+		Cia[i] = a[i];
+		Cib[i] = b[i];
+	}
+	pixelILC_CholeskySolveLower(U, Cia, Nfreqs);
+	pixelILC_CholeskySolveLower(U, Cib, Nfreqs);
+	for(i=0;i<Nfreqs;i++){
+		aCia_F += Cia[i] * Cia[i];
+		aCib_F += Cia[i] * Cib[i];
+		bCib_F += Cib[i] * Cib[i];
+	}
+	pixelILC_CholeskySolveUpper(U, Cia, Nfreqs);
+	pixelILC_CholeskySolveUpper(U, Cib, Nfreqs);
+	down = aCia_F * bCib_F - aCib_F*aCib_F ;
+	for(i=0;i<Nfreqs;i++) weights[p*Nfreqs + i] += (bCib_F*Cia[i] - aCib_F*Cib[i]) / down;
+}
+
+PIXELILC_HOT void pixelILC_CholeskyRank1Update(double *U, double *x, int Nfreqs){
+	// U^T U <- U^T U + x x^T, by Givens rotations in O(Nfreqs^2). x is destroyed.
+	int n, k;
+	for(n=0;n<Nfreqs;n++){
+		double u = U[PIXELILC_PACKED_INDEX(n,n,Nfreqs)];
+		double r = hypot(u, x[n]);
+		double c = r / u, s = x[n] / u;
+		U[PIXELILC_PACKED_INDEX(n,n,Nfreqs)] = r;
+		for(k=n+1;k<Nfreqs;k++){
+			U[PIXELILC_PACKED_INDEX(n,k,Nfreqs)] = (U[PIXELILC_PACKED_INDEX(n,k,Nfreqs)] + s*x[k]) / c;
+			x[k] = c*x[k] - s*U[PIXELILC_PACKED_INDEX(n,k,Nfreqs)];
+		}
+	}
+}
+
+PIXELILC_HOT int pixelILC_CholeskyRank1Downdate(double *U, double *x, int Nfreqs){
+	// U^T U <- U^T U - x x^T, by hyperbolic rotations. x is destroyed. Returns 1, with U partly updated, when the result
+	// is not positive definite or a pivot falls below PIXELILC_PIVOT_RATIO_MIN of its previous value, in which case the
+	// caller factorizes the new matrix from scratch.
+	int n, k;
+	for(n=0;n<Nfreqs;n++){
+		double u = U[PIXELILC_PACKED_INDEX(n,n,Nfreqs)];
+		double r2 = (u - x[n]) * (u + x[n]);
+		if(!(r2 > PIXELILC_PIVOT_RATIO_MIN * u*u)) return 1;
+		double r = sqrt(r2);
+		double c = r / u, s = x[n] / u;
+		U[PIXELILC_PACKED_INDEX(n,n,Nfreqs)] = r;
+		for(k=n+1;k<Nfreqs;k++){
+			U[PIXELILC_PACKED_INDEX(n,k,Nfreqs)] = (U[PIXELILC_PACKED_INDEX(n,k,Nfreqs)] - s*x[k]) / c;
+			x[k] = c*x[k] - s*U[PIXELILC_PACKED_INDEX(n,k,Nfreqs)];
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_linalg.h>
+#include <omp.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// The single precision pipeline: float32 covariance cubes, filtered maps and weights, with the same structure as the
+// double path. The maps and the Nfreqs x Nfreqs matrices are float, the sums which lose precision are not:
+// disc sums are accumulated in float over short runs of pixels and the runs are added in double, and the dot products
+// with the SEDs are done in double. The SEDs and the dust parameter maps stay double, they are read once per pixel.
+
+int invert_a_matrix_single(gsl_matrix_float *matrix, gsl_matrix_float *inv, int size){
+	gsl_permutation *p = gsl_permutation_alloc(size);
+	int ill_conditioned = pixelILC_InvertMatrixFloat(matrix, inv, size, p);
+	gsl_permutation_free(p);
+	return ill_conditioned;
+}
+
+PIXELILC_HOT int pixelILC_InvertMatrixFloat(gsl_matrix_float *matrix, gsl_matrix_float *inv, int size, gsl_permutation *p){
+	// GSL has no single precision LU, so this is the LU decomposition with partial pivoting done here, in place in matrix,
+	// followed by a solve for every column of the inverse. Returns 1 if the matrix is ill-conditioned, with the same
+	// criterion as invert_a_matrix.
+	int i, j, k, imax, ill_conditioned;
+	float pivot, pivot_min, pivot_max, tmp, *row_i, *row_k;
+	size_t *perm = p->data;
+	for(i=0;i<size;i++) perm[i] = i;
+	for(k=0;k<size;k++){
+		// the largest entry of column k at or below the diagonal is the pivot
+		imax = k;
+		for(i=k+1;i<size;i++) if(fabsf(gsl_matrix_float_get(matrix,i,k)) > fabsf(gsl_matrix_float_get(matrix,imax,k))) imax = i;
+		if(imax != k){
+			gsl_matrix_float_swap_rows(matrix, k, imax);
+			j = perm[k]; perm[k] = perm[imax]; perm[imax] = j;
+		}
+		row_k = gsl_matrix_float_ptr(matrix, k, 0);
+		for(i=k+1;i<size;i++){
+			row_i = gsl_matrix_float_ptr(matrix, i, 0);
+			row_i[k] /= row_k[k];
+			for(j=k+1;j<size;j++) row_i[j] -= row_i[k] * row_k[j];
+		}
+	}
+	pivot_min = pivot_max = fabsf(gsl_matrix_float_get(matrix, 0, 0));
+	for (i = 1; i < size; i++) {
+		pivot = fabsf(gsl_matrix_float_get(matrix, i, i));
+		if (pivot < pivot_min) pivot_min = pivot;
+		if (pivot > pivot_max) pivot_max = pivot;
+	}
+	ill_conditioned = (pivot_min <= PIXELILC_PIVOT_RATIO_MIN_FLOAT * pivot_max);
+	STATS_COUNT(PILC_FACTORIZED, 1);
+	if (ill_conditioned) STATS_COUNT(PILC_ILL_CONDITIONED, 1);
+	// column j of the inverse solves L U x = P e_j
+	for(j=0;j<size;j++){
+		for(i=0;i<size;i++){
+			tmp = (perm[i] == (size_t) j) ? 1.0f : 0.0f;
+			for(k=0;k<i;k++) tmp -= gsl_matrix_float_get(matrix,i,k) * gsl_matrix_float_get(inv,k,j);
+			gsl_matrix_float_set(inv, i, j, tmp);
+		}
+		for(i=size-1;i>=0;i--){
+			tmp = gsl_matrix_float_get(inv,i,j);
+			for(k=i+1;k<size;k++) tmp -= gsl_matrix_float_get(matrix,i,k) * gsl_matrix_float_get(inv,k,j);
+			gsl_matrix_float_set(inv, i, j, tmp / gsl_matrix_float_get(matrix,i,i));
+		}
+	}
+	return ill_conditioned;
+}
+
+void pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField_float(long ipix,  int Nfreqs, float* TEBmaps, gsl_matrix_float *CovF,  int Nfreqs2){
+	int n,nn,c;
+	float vF;
+	c = 0;
+	for(n=0;n<Nfreqs;n++){
+		for(nn=n;nn<Nfreqs;nn++){
+			// TEBmaps is a numpy array with shape npix_per_window,Nfreqs2 = Nfreqs*(Nfreqs+1)/2
+			vF = TEBmaps[ipix*Nfreqs2 + c] ;
+			gsl_matrix_float_set(CovF, n, nn, vF );
+			if(n!=nn){
+				gsl_matrix_float_set(CovF, nn, n, vF );
+			}
+			c = c + 1;
+		}
+	}
+}
+
+PIXELILC_HOT void pixelILC_DefineCovMat_NILC_DiscPixels_SingleField_float(long ipix,  int Nfreqs, long npix_map, float* Covar_maps, float* Field_filtered_map, float* mask, long *disc_pixels, double *disc_weights, long ndisc, gsl_matrix_float *CovF,  int Nfreqs2, float *run, double *acc){
+	// the float version of pixelILC_DefineCovMat_NILC_DiscPixels_SingleField. run and acc have size Nfreqs2, the sums over
+	// PIXELILC_FLOAT_RUN pixels are done in float in run, and added in double to acc
+	int n,nn,c;
+	long ii, ii_end, ipix2;
+	float xm, w;
+	float *Covar_pix = &Covar_maps[ipix*Nfreqs2];
+	STATS_TIC(t_stats);
+	STATS_COUNT(PILC_DISC_PIXELS, ndisc);
+	for(c=0;c<Nfreqs2;c++) acc[c] = 0.0;
+	for(ii=0;ii<ndisc;ii=ii_end){
+		ii_end = (ii + PIXELILC_FLOAT_RUN < ndisc) ? ii + PIXELILC_FLOAT_RUN : ndisc;
+		for(c=0;c<Nfreqs2;c++) run[c] = 0.0f;
+		for(;ii<ii_end;ii++){
+			ipix2 = disc_pixels[ii];
+			w = (disc_weights != NULL) ? (float) disc_weights[ii] : mask[ipix2];
+			c = 0;
+			for(n=0;n<Nfreqs;n++){
+				xm = Field_filtered_map[n*npix_map + ipix2] * w;
+				for(nn=n;nn<Nfreqs;nn++){
+					run[c] += xm * Field_filtered_map[nn*npix_map + ipix2] ;
+					c += 1;
+				}
+			}
+		}
+		for(c=0;c<Nfreqs2;c++) acc[c] += run[c];
+	}
+	c = 0;
+	for(n=0;n<Nfreqs;n++){
+		for(nn=n;nn<Nfreqs;nn++){
+			Covar_pix[c] += (float) acc[c];
+			gsl_matrix_float_set(CovF, n, nn, Covar_pix[c] );
+			if(n!=nn){
+				gsl_matrix_float_set(CovF, nn, n, Covar_pix[c] );
+			}
+			c += 1;
+		}
+	}
+	STATS_LAP(PILC_COVARIANCE, t_stats);
+}
+
+PIXELILC_HOT void pixelILC_CalculateILCWeight_NILC_SingleField_float(double* a, gsl_matrix_float *CovFi, float* weights,  int Nfreqs,  long p){
+	double aCia_F=0.0, w;
+	int i,j;
+	for(i=0;i<Nfreqs;i++){
+		for(j=0;j<Nfreqs;j++){
+			aCia_F += a[i] * gsl_matrix_float_get(CovFi,i,j) * a[j] ;
+		}
+	}
+	for(i=0;i<Nfreqs;i++){
+		w = 0.0;
+		for(j=0;j<Nfreqs;j++) w += a[j] * gsl_matrix_float_get(CovFi,j,i);
+		weights[p*Nfreqs + i] += (float) (w / aCia_F) ;
+	}
+}
+
+PIXELILC_HOT void pixelILC_CalculateILCWeight_CNILC_SingleField_float(double* a, double* b, gsl_matrix_float *CovFi, float* weights,  int Nfreqs,  long p){
+	// eq. 19 in arXiv:2006.0862
+	double aCia_F=0.0,aCib_F=0.0,bCib_F=0.0;
+	double up,down,Ci ;
+	int i,j;
+	for(i=0;i<Nfreqs;i++){
+		for(j=0;j<Nfreqs;j++){
+			Ci = gsl_matrix_float_get(CovFi,i,j);
+			aCia_F += a[i] * Ci * a[j] ;
+			aCib_F += a[i] * Ci * b[j] ;
+			bCib_F += b[i] * Ci * b[j] ;
+		}
+	}
+	down = aCia_F * bCib_F - aCib_F*aCib_F ;
+	for(i=0;i<Nfreqs;i++){
+		up = 0.0;
+		for(j=0;j<Nfreqs;j++){
+			Ci = gsl_matrix_float_get(CovFi,j,i);
+			up += bCib_F*a[j]*Ci - aCib_F*b[j]*Ci ;
+		}
+		weights[p*Nfreqs + i] += (float) (up / down) ;
+	}
+}
+
+void pixelILC_Run_NILC_SHTSmoothing_float(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, float *TEBmaps, double *a, float *weights){
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlockFloat(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			STATS_TIC(t_stats);
+			pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField_float(ipix, Nfreqs, TEBmaps, arena->CovF_float, Nfreqs2);
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			pixelILC_InvertMatrixFloat(arena->CovF_float, arena->CovFi_float, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_NILC_SingleField_float(a, arena->CovFi_float, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+void pixelILC_Run_CNILC_SHTSmoothing_float(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, float *TEBmaps, double *a, double *b_sed, float *weights){
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlockFloat(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			STATS_TIC(t_stats);
+			pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField_float(ipix, Nfreqs, TEBmaps, arena->CovF_float, Nfreqs2);
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			pixelILC_InvertMatrixFloat(arena->CovF_float, arena->CovFi_float, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_CNILC_SingleField_float(a, b_sed, arena->CovFi_float, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+void pixelILC_Run_CNILC_ThermalDust_SHTSmoothing_float(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, float *TEBmaps, double *a, double *beta_dust_map, double *T_dust_map, double *freq_arr, double *thermo_2_rj, float *weights){
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlockFloat(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			STATS_TIC(t_stats);
+			pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField_float(ipix, Nfreqs, TEBmaps, arena->CovF_float, Nfreqs2);
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			pixelILC_InvertMatrixFloat(arena->CovF_float, arena->CovFi_float, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			// calculate the b vector with the Thermal dust SED
+			for(int nn=0;nn<Nfreqs;nn++){
+				double x_d_nu = H_PLANCK * freq_arr[nn] * 1.e9 / ( K_BOLTZ * T_dust_map[ipix] );
+				arena->b[nn] = pow(freq_arr[nn],beta_dust_map[ipix]+1.0)/(exp(x_d_nu)-1.0) / thermo_2_rj[nn]  ;
+			}
+			pixelILC_CalculateILCWeight_CNILC_SingleField_float(a, arena->b, arena->CovFi_float, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+void pixelILC_Run_NILC_CovarPixelSpace_float(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, float *Covar_maps, float *Field_filtered_map, float *mask, long *disc_start, long *disc_pixels, double *disc_weights, long npix_map, double *a, float *weights){
+	// like pixelILC_Run_NILC_CovarPixelSpace, the discs are queried when disc_start is NULL
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	long nipix;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlockFloat(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			if(disc_start == NULL){
+				STATS_TIC(t_query);
+				nipix = pixelILC_QueryDisc(arena, ipix, 0.5*fwhm, nside, nest);
+				STATS_LAP(PILC_QUERY_DISC, t_query);
+				long ii, nkeep = 0;
+				for(ii=0;ii<nipix;ii++){
+					if(mask[arena->pixel_buffer[ii]] != 0.0f) arena->pixel_buffer[nkeep++] = arena->pixel_buffer[ii];
+				}
+				pixelILC_DefineCovMat_NILC_DiscPixels_SingleField_float(ipix, Nfreqs, 12L*nside*nside, Covar_maps, Field_filtered_map, mask, arena->pixel_buffer, NULL, nkeep, arena->CovF_float, Nfreqs2, arena->run_float, arena->acc);
+			}
+			else{
+				pixelILC_DefineCovMat_NILC_DiscPixels_SingleField_float(ipix, Nfreqs, npix_map, Covar_maps, Field_filtered_map, mask, &disc_pixels[disc_start[p]], (disc_weights != NULL) ? &disc_weights[disc_start[p]] : NULL, disc_start[p+1] - disc_start[p], arena->CovF_float, Nfreqs2, arena->run_float, arena->acc);
+			}
+			STATS_TIC(t_stats);
+			pixelILC_InvertMatrixFloat(arena->CovF_float, arena->CovFi_float, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_NILC_SingleField_float(a, arena->CovFi_float, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
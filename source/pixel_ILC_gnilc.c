@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <gsl/gsl_matrix.h>
+#include <omp.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Generalized NILC (GNILC, Remazeilles et al. 2011, arXiv:1103.1166). The covariance R of every pixel is whitened by
+// the covariance R_N of the nuisance (CMB and noise), R_N = U^T U, and the eigenvalues of U^-T R U^-1 above one belong
+// to the foregrounds. Their number m is chosen by the Akaike information criterion
+//	A(m) = 2m + Nmodes sum_{i>m} (lambda_i - log lambda_i - 1)
+// over the eigenvalues in decreasing order, where Nmodes is the number of independent modes in the domain of the
+// covariance. With V_s the m leading eigenvectors, the foreground mixing matrix is F = U^T V_s, and its ILC
+// reconstruction in every channel, F (F^T R^-1 F)^-1 F^T R^-1, reduces to U^T V_s V_s^T U^-T.
+
+PIXELILC_HOT int pixelILC_JacobiEigen(double *A, double *V, double *lambda, int N){
+	// Eigenvalues and eigenvectors of the symmetric N x N matrix A, row major, by cyclic Jacobi rotations. A is destroyed,
+	// V gets the eigenvectors in its columns and lambda the eigenvalues, both in decreasing order of the eigenvalues.
+	// Returns the number of sweeps.
+	int i, j, k, sweep;
+	for(i=0;i<N;i++) for(j=0;j<N;j++) V[i*N + j] = (i == j) ? 1.0 : 0.0;
+	for(sweep=0;sweep<PIXELILC_JACOBI_MAX_SWEEPS;sweep++){
+		double off = 0.0, diag = 0.0;
+		for(i=0;i<N;i++){
+			diag += A[i*N + i]*A[i*N + i];
+			for(j=i+1;j<N;j++) off += A[i*N + j]*A[i*N + j];
+		}
+		if(off <= PIXELILC_JACOBI_TOL*PIXELILC_JACOBI_TOL*diag) break;
+		for(i=0;i<N-1;i++){
+			for(j=i+1;j<N;j++){
+				double aij = A[i*N + j];
+				if(aij == 0.0) continue;
+				// the rotation by t = tan(phi) which zeroes A_ij
+				double theta = (A[j*N + j] - A[i*N + i]) / (2.0*aij);
+				double t = ((theta >= 0.0) ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1.0));
+				double c = 1.0 / sqrt(t*t + 1.0), s = t*c;
+				for(k=0;k<N;k++){
+					double aki = A[k*N + i], akj = A[k*N + j];
+					A[k*N + i] = c*aki - s*akj;
+					A[k*N + j] = s*aki + c*akj;
+				}
+				for(k=0;k<N;k++){
+					double aik = A[i*N + k], ajk = A[j*N + k];
+					A[i*N + k] = c*aik - s*ajk;
+					A[j*N + k] = s*aik + c*ajk;
+				}
+				for(k=0;k<N;k++){
+					double vki = V[k*N + i], vkj = V[k*N + j];
+					V[k*N + i] = c*vki - s*vkj;
+					V[k*N + j] = s*vki + c*vkj;
+				}
+			}
+		}
+	}
+	for(i=0;i<N;i++) lambda[i] = A[i*N + i];
+	// selection sort, N is small
+	for(i=0;i<N-1;i++){
+		int imax = i;
+		for(j=i+1;j<N;j++) if(lambda[j] > lambda[imax]) imax = j;
+		if(imax == i) continue;
+		double tmp = lambda[i]; lambda[i] = lambda[imax]; lambda[imax] = tmp;
+		for(k=0;k<N;k++){
+			tmp = V[k*N + i]; V[k*N + i] = V[k*N + imax]; V[k*N + imax] = tmp;
+		}
+	}
+	return sweep;
+}
+
+int pixelILC_GNILC_AIC(double *lambda, int N, double Nmodes){
+	// the m minimizing the Akaike information criterion, lambda in decreasing order
+	int m, m_best = 0;
+	double tail = 0.0, A, A_best;
+	for(m=0;m<N;m++){
+		double l = (lambda[m] > 0.0) ? lambda[m] : DBL_MIN;
+		tail += l - log(l) - 1.0;
+	}
+	A_best = Nmodes*tail;
+	for(m=1;m<=N;m++){
+		double l = (lambda[m-1] > 0.0) ? lambda[m-1] : DBL_MIN;
+		tail -= l - log(l) - 1.0;
+		A = 2.0*m + Nmodes*tail;
+		if(A < A_best){
+			A_best = A;
+			m_best = m;
+		}
+	}
+	return m_best;
+}
+
+PIXELILC_HOT int pixelILC_CalculateGNILCWeight_SingleField(gsl_matrix *CovF, double *U, gsl_matrix *V, double *lambda, double Nmodes, double *weights, int Nfreqs, long p){
+	// CovF holds R and U the packed Cholesky factor of R_N, both are destroyed. weights[p] is the Nfreqs x Nfreqs
+	// matrix W, row major, so that the foregrounds in channel i are sum_j W_ij x_j. Returns the dimension m.
+	int i, j, k, m;
+	double *A = CovF->data, *V_ = V->data;
+	// U^-T R U^-1, R and the result are symmetric so both triangular solves go along rows
+	for(i=0;i<Nfreqs;i++) pixelILC_CholeskySolveLower(U, &A[i*Nfreqs], Nfreqs);
+	for(i=0;i<Nfreqs;i++){
+		for(j=i+1;j<Nfreqs;j++){
+			double tmp = A[i*Nfreqs + j]; A[i*Nfreqs + j] = A[j*Nfreqs + i]; A[j*Nfreqs + i] = tmp;
+		}
+	}
+	for(i=0;i<Nfreqs;i++) pixelILC_CholeskySolveLower(U, &A[i*Nfreqs], Nfreqs);
+	pixelILC_JacobiEigen(A, V_, lambda, Nfreqs);
+	m = pixelILC_GNILC_AIC(lambda, Nfreqs, Nmodes);
+	// P = V_s V_s^T in A, then U^-1 P along its rows, which gives P U^-T since P is symmetric
+	for(i=0;i<Nfreqs;i++){
+		for(j=0;j<Nfreqs;j++){
+			double s = 0.0;
+			for(k=0;k<m;k++) s += V_[i*Nfreqs + k] * V_[j*Nfreqs + k];
+			A[i*Nfreqs + j] = s;
+		}
+	}
+	for(i=0;i<Nfreqs;i++) pixelILC_CholeskySolveUpper(U, &A[i*Nfreqs], Nfreqs);
+	// W = U^T (P U^-T), U^T is lower triangular
+	double *W = &weights[p*Nfreqs*Nfreqs];
+	for(i=0;i<Nfreqs;i++){
+		for(j=0;j<Nfreqs;j++){
+			double s = 0.0;
+			for(k=0;k<=i;k++) s += U[PIXELILC_PACKED_INDEX(k,i,Nfreqs)] * A[k*Nfreqs + j];
+			W[i*Nfreqs + j] = s;
+		}
+	}
+	return m;
+}
+
+void pixelILC_Run_GNILC_SHTSmoothing(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, double *TEBmaps, double *NuisanceMaps, double Nmodes, double *weights, int *dims){
+	// NuisanceMaps has the layout of TEBmaps, with the covariance of the nuisance. weights is [Npixels][Nfreqs][Nfreqs]
+	// and dims[p] gets the dimension of the foreground subspace of ipix_arr[p]
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, Nfreqs*Nfreqs);
+			for(q=sched->block_start[block];q<sched->block_start[block+1];q++) dims[sched->order[q]] = -1;
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			STATS_TIC(t_stats);
+			pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs, TEBmaps, arena->CovF, Nfreqs2);
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			pixelILC_CholeskyPacked(&NuisanceMaps[ipix*Nfreqs2], arena->acc, Nfreqs);
+			STATS_LAP(PILC_INVERT, t_stats);
+			dims[p] = pixelILC_CalculateGNILCWeight_SingleField(arena->CovF, arena->acc, arena->CovFi, arena->work, Nmodes, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
@@ -0,0 +1,505 @@
+#define _POSIX_C_SOURCE 200809L	// pthreads with -std=c99
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#define NO_IMPORT_ARRAY
+#define PY_ARRAY_UNIQUE_SYMBOL PixelILC_ARRAY_API
+#include <numpy/ndarrayobject.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+#include <query_disc_wrapper.h>
+#include <omp.h>
+
+// PixelILC.LazyWeights(nside, Nfreqs, Nthreads, method, method_args, nest=0, fwhm=0.0, freq_arr=None, tile_nside=0,
+//                      cache_tiles=64, prefetch=1)
+// The weights of the weight method named method, with the arguments of the PixelILC.Plan method of that name in the
+// tuple method_args, computed only for the parts of the sky that are asked for. The sky is cut in tiles, the NEST
+// pixels of tile_nside, and a tile is computed the first time one of its pixels is asked for. The last cache_tiles
+// tiles used are kept, and after every call the neighbours of the tiles it used are computed in the background, by one
+// thread so that it leaves the cores to the calls.
+// tile_nside = 0 picks tiles of about PIXELILC_LAZY_TILE_PIXELS pixels. Only the double precision path, so the maps
+// must be float64, and the maps of method_args must not change while the object is alive.
+
+// The weight methods, with the names of the Plan methods
+enum { LAZY_NILC_SHT, LAZY_CNILC_SHT, LAZY_CNILC_DUST_SHT, LAZY_CNILC_DUST_SYN_SHT, LAZY_NILC_PIXEL, LAZY_NMETHODS };
+static const char *Lazy_method_names[LAZY_NMETHODS] = {"doNILC_SHTSmoothing", "doCNILC_SHTSmoothing", "doCNILC_ThermalDust_SHTSmoothing", "doCNILC_ThermalDust_Synchrotron_SHTSmoothing", "doNILC_CovarPixelSpace"};
+
+enum { LAZY_FREE, LAZY_COMPUTING, LAZY_READY };
+
+typedef struct {
+	PyObject_HEAD
+	int nside;
+	int Nfreqs;
+	int nest;
+	int Nthreads;
+	int method;
+	double fwhm;
+	int tile_nside;
+	long Ntiles;
+	long tile_pixels;		// pixels per tile, tile t holds the NEST pixels t*tile_pixels ... (t+1)*tile_pixels-1
+	int cache_tiles;
+	PyObject *method_args;		// holds the maps below
+	double *maps, *a, *b, *beta_dust_map, *T_dust_map, *beta_syn_map, *Field_filtered_map, *mask;
+	double *freq_arr;
+	double *thermo_2_rj;
+	// the cache, guarded by lock
+	int *slot_of_tile;		// the slot of every tile, -1 when it is not cached
+	long *slot_tile;		// the tile in every slot, -1 when free
+	char *slot_state;
+	int *slot_pins;			// readers copying from the slot, it is not evicted while they do
+	unsigned long *slot_used;	// when the slot was last used, for the LRU eviction
+	double *slot_weights;		// cache_tiles x tile_pixels x Nfreqs
+	unsigned long tick;
+	long hits, misses, prefetched;
+	pixelILC_arena *arenas;
+	// the prefetch thread, with its own arena and stats
+	int prefetch;
+	pixelILC_arena *arenas_prefetch;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_mutex_t call_lock;	// one call at a time in the foreground, as they share arenas
+	long *queue;			// tiles to prefetch, replaced at every call
+	int nqueue;
+	int stop;
+} pixelILC_LazyObject;
+
+static void Lazy_compute(pixelILC_LazyObject *lazy, pixelILC_arena *arenas, int nthreads, long tile, double *weights){
+	// the weights of all the pixels of tile, in NEST order, with nthreads threads, without the lock
+	long p, n = lazy->tile_pixels;
+	long *ipix = malloc(n*sizeof(long));
+	for(p=0;p<n;p++) ipix[p] = tile*n + p;
+	if(!lazy->nest){
+		long *ipix_ring = malloc(n*sizeof(long));
+		nest2ring_wrapper(ipix, n, lazy->nside, ipix_ring);
+		free(ipix);
+		ipix = ipix_ring;
+	}
+	memset(weights, 0, n*lazy->Nfreqs*sizeof(double));
+	pixelILC_schedule sched;
+	if(lazy->method == LAZY_NILC_PIXEL){
+		pixelILC_ScheduleInit(&sched, ipix, n, lazy->nside, 1, lazy->nest, nthreads);
+		pixelILC_ScheduleDiscCost(&sched, ipix, lazy->nside, lazy->nest, 0.5*lazy->fwhm);
+		// the driver adds the disc sums to the rows of Covar_maps, which may hold the sums of an evicted computation
+		int Nfreqs2 = lazy->Nfreqs*(lazy->Nfreqs+1)/2;
+		for(p=0;p<n;p++) memset(&lazy->maps[ipix[p]*Nfreqs2], 0, Nfreqs2*sizeof(double));
+	}
+	else pixelILC_ScheduleInit(&sched, ipix, n, lazy->nside, 0, 0, nthreads);
+	omp_set_num_threads(nthreads);
+	switch(lazy->method){
+		case LAZY_NILC_SHT:
+			pixelILC_Run_NILC_SHTSmoothing(&sched, arenas, ipix, lazy->Nfreqs, lazy->maps, lazy->a, weights);
+			break;
+		case LAZY_CNILC_SHT:
+			pixelILC_Run_CNILC_SHTSmoothing(&sched, arenas, ipix, lazy->Nfreqs, lazy->maps, lazy->a, lazy->b, weights);
+			break;
+		case LAZY_CNILC_DUST_SHT:
+			pixelILC_Run_CNILC_ThermalDust_SHTSmoothing(&sched, arenas, ipix, lazy->Nfreqs, lazy->maps, lazy->a, lazy->beta_dust_map, lazy->T_dust_map, lazy->freq_arr, lazy->thermo_2_rj, weights);
+			break;
+		case LAZY_CNILC_DUST_SYN_SHT:
+			pixelILC_Run_CNILC_ThermalDust_Synchrotron_SHTSmoothing(&sched, arenas, ipix, lazy->Nfreqs, lazy->maps, lazy->a, lazy->beta_dust_map, lazy->T_dust_map, lazy->beta_syn_map, lazy->freq_arr, lazy->thermo_2_rj, weights);
+			break;
+		case LAZY_NILC_PIXEL:
+			pixelILC_Run_NILC_CovarPixelSpace(&sched, arenas, ipix, lazy->Nfreqs, lazy->nside, lazy->nest, lazy->fwhm, lazy->maps, lazy->Field_filtered_map, lazy->mask, NULL, NULL, NULL, 12L*lazy->nside*lazy->nside, lazy->a, weights);
+			break;
+	}
+	pixelILC_ScheduleFree(&sched);
+	free(ipix);
+}
+
+static int Lazy_acquire(pixelILC_LazyObject *lazy, long tile, int foreground){
+	// Returns the slot holding tile, computed if needed, with one more pin when foreground is 1.
+	// Called and returns with the lock held, it is released while the tile is computed.
+	pixelILC_arena *arenas = foreground ? lazy->arenas : lazy->arenas_prefetch;
+	int s, k, nthreads = foreground ? lazy->Nthreads : 1;
+	for(;;){
+		s = lazy->slot_of_tile[tile];
+		if(s < 0) break;
+		if(lazy->slot_state[s] == LAZY_READY){
+			lazy->slot_used[s] = ++lazy->tick;
+			if(foreground){
+				lazy->slot_pins[s]++;
+				lazy->hits++;
+			}
+			return s;
+		}
+		// the other thread is computing it
+		pthread_cond_wait(&lazy->cond, &lazy->lock);
+	}
+	// a free slot, or the least recently used one nobody is reading or computing
+	s = -1;
+	for(k=0;k<lazy->cache_tiles;k++){
+		if(lazy->slot_state[k] == LAZY_FREE){
+			s = k;
+			break;
+		}
+		if(lazy->slot_state[k] == LAZY_READY && lazy->slot_pins[k] == 0 && (s < 0 || lazy->slot_used[k] < lazy->slot_used[s])) s = k;
+	}
+	if(lazy->slot_tile[s] >= 0) lazy->slot_of_tile[lazy->slot_tile[s]] = -1;
+	lazy->slot_tile[s] = tile;
+	lazy->slot_of_tile[tile] = s;
+	lazy->slot_state[s] = LAZY_COMPUTING;
+	pthread_mutex_unlock(&lazy->lock);
+	Lazy_compute(lazy, arenas, nthreads, tile, &lazy->slot_weights[s*lazy->tile_pixels*lazy->Nfreqs]);
+	pthread_mutex_lock(&lazy->lock);
+	lazy->slot_state[s] = LAZY_READY;
+	lazy->slot_used[s] = ++lazy->tick;
+	if(foreground){
+		lazy->slot_pins[s]++;
+		lazy->misses++;
+	}
+	else lazy->prefetched++;
+	pthread_cond_broadcast(&lazy->cond);
+	return s;
+}
+
+static void *Lazy_prefetch_thread(void *arg){
+	// a team of one runs on this thread, so its stats can be kept apart from those of the calls
+	pixelILC_LazyObject *lazy = arg;
+	pixelILC_thread_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	pixelILC_stats_private = &stats;
+	pthread_mutex_lock(&lazy->lock);
+	for(;;){
+		while(lazy->nqueue == 0 && !lazy->stop) pthread_cond_wait(&lazy->cond, &lazy->lock);
+		if(lazy->stop) break;
+		long tile = lazy->queue[--lazy->nqueue];
+		if(lazy->slot_of_tile[tile] < 0) Lazy_acquire(lazy, tile, 0);
+	}
+	pthread_mutex_unlock(&lazy->lock);
+	return NULL;
+}
+
+typedef struct {
+	long tile;
+	long row;
+	long p;
+} Lazy_item;
+
+static int Lazy_compare_items(const void *a, const void *b){
+	long ka = ((const Lazy_item*) a)->tile, kb = ((const Lazy_item*) b)->tile;
+	return (ka > kb) - (ka < kb);
+}
+
+static void Lazy_weights(pixelILC_LazyObject *lazy, long *ipix_arr, long Npixels, double *weights){
+	// weights[p] are the weights of ipix_arr[p], tile by tile, then queues the neighbours of those tiles for the
+	// prefetch thread. Runs without the GIL.
+	long p, q, k;
+	int Nfreqs = lazy->Nfreqs;
+	pthread_mutex_lock(&lazy->call_lock);
+	pixelILC_stats_reset(lazy->Nthreads);
+	Lazy_item *items = malloc((Npixels > 0 ? Npixels : 1)*sizeof(Lazy_item));
+	long *nest_pix = malloc((Npixels > 0 ? Npixels : 1)*sizeof(long));
+	if(lazy->nest) memcpy(nest_pix, ipix_arr, Npixels*sizeof(long));
+	else ring2nest_wrapper(ipix_arr, Npixels, lazy->nside, nest_pix);
+	for(p=0;p<Npixels;p++){
+		items[p].tile = nest_pix[p] / lazy->tile_pixels;
+		items[p].row = nest_pix[p] % lazy->tile_pixels;
+		items[p].p = p;
+	}
+	free(nest_pix);
+	qsort(items, Npixels, sizeof(Lazy_item), Lazy_compare_items);
+
+	long ntouched = 0;
+	pthread_mutex_lock(&lazy->lock);
+	for(q=0;q<Npixels;q=k){
+		long tile = items[q].tile;
+		int s = Lazy_acquire(lazy, tile, 1);
+		pthread_mutex_unlock(&lazy->lock);
+		double *w_tile = &lazy->slot_weights[s*lazy->tile_pixels*Nfreqs];
+		for(k=q;k<Npixels && items[k].tile == tile;k++) memcpy(&weights[items[k].p*Nfreqs], &w_tile[items[k].row*Nfreqs], Nfreqs*sizeof(double));
+		pthread_mutex_lock(&lazy->lock);
+		lazy->slot_pins[s]--;
+		items[ntouched++].tile = tile;	// only overwrites entries already visited
+	}
+	if(lazy->prefetch){
+		// the neighbours of the tiles just used, at most half the cache so they do not push those out
+		long neighbours[8];
+		int j, max_queue = lazy->cache_tiles/2;
+		lazy->nqueue = 0;
+		for(q=0;q<ntouched && lazy->nqueue<max_queue;q++){
+			neighbors_wrapper(items[q].tile, lazy->tile_nside, 1, neighbours);
+			for(j=0;j<8 && lazy->nqueue<max_queue;j++){
+				if(neighbours[j] >= 0 && lazy->slot_of_tile[neighbours[j]] < 0) lazy->queue[lazy->nqueue++] = neighbours[j];
+			}
+		}
+		pthread_cond_broadcast(&lazy->cond);
+	}
+	pthread_mutex_unlock(&lazy->lock);
+	pthread_mutex_unlock(&lazy->call_lock);
+	free(items);
+}
+
+static PyObject *Lazy_new(PyTypeObject *type, PyObject *args, PyObject *kwds){
+	PyObject *nside = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *Nthreads = NULL;
+	const char *method_name = NULL;
+	PyObject *method_args = NULL;
+	PyObject *nest = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *freq_arr = NULL;
+	PyObject *tile_nside = NULL;
+	PyObject *cache_tiles = NULL;
+	PyObject *prefetch = NULL;
+	PyObject *maps = NULL, *a = NULL, *b = NULL, *beta_dust_map = NULL, *T_dust_map = NULL, *beta_syn_map = NULL, *Field_filtered_map = NULL, *Mask = NULL;
+	if (!PyArg_ParseTuple(args, "OOOsO!|OOOOOO" , &nside, &Nfreqs, &Nthreads, &method_name, &PyTuple_Type, &method_args, &nest, &fwhm, &freq_arr, &tile_nside, &cache_tiles, &prefetch)) return NULL;
+	int method;
+	for(method=0;method<LAZY_NMETHODS;method++) if(strcmp(method_name, Lazy_method_names[method]) == 0) break;
+	switch(method){
+		case LAZY_NILC_SHT:
+			if (!PyArg_ParseTuple(method_args, "OO" , &maps, &a)) return NULL;
+			break;
+		case LAZY_CNILC_SHT:
+			if (!PyArg_ParseTuple(method_args, "OOO" , &maps, &a, &b)) return NULL;
+			break;
+		case LAZY_CNILC_DUST_SHT:
+			if (!PyArg_ParseTuple(method_args, "OOOO" , &maps, &a, &beta_dust_map, &T_dust_map)) return NULL;
+			break;
+		case LAZY_CNILC_DUST_SYN_SHT:
+			if (!PyArg_ParseTuple(method_args, "OOOOO" , &maps, &a, &beta_dust_map, &T_dust_map, &beta_syn_map)) return NULL;
+			break;
+		case LAZY_NILC_PIXEL:
+			if (!PyArg_ParseTuple(method_args, "OOOO" , &maps, &Field_filtered_map, &Mask, &a)) return NULL;
+			break;
+		default:
+			PyErr_Format(PyExc_ValueError, "unknown weight method %s", method_name);
+			return NULL;
+	}
+	if (!PyArray_Check(maps) || PyArray_TYPE((PyArrayObject *)maps) != NPY_DOUBLE){
+		PyErr_SetString(PyExc_TypeError, "LazyWeights needs float64 maps");
+		return NULL;
+	}
+	if ((method == LAZY_CNILC_DUST_SHT || method == LAZY_CNILC_DUST_SYN_SHT) && (freq_arr == NULL || freq_arr == Py_None)){
+		PyErr_SetString(PyExc_ValueError, "the dust constraints need freq_arr");
+		return NULL;
+	}
+	if (method == LAZY_NILC_PIXEL && (fwhm == NULL || PyFloat_AsDouble(fwhm) <= 0.0 || Mask == Py_None)){
+		if (!PyErr_Occurred()) PyErr_SetString(PyExc_ValueError, "doNILC_CovarPixelSpace needs fwhm > 0 and a Mask");
+		return NULL;
+	}
+
+	pixelILC_LazyObject *lazy = (pixelILC_LazyObject *) type->tp_alloc(type, 0);
+	if (lazy == NULL) return NULL;
+	lazy->nside = (int) PyLong_AsLong(nside);
+	lazy->Nfreqs = (int) PyLong_AsLong(Nfreqs);
+	lazy->Nthreads = (int) PyLong_AsLong(Nthreads);
+	lazy->method = method;
+	lazy->nest = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	lazy->fwhm = (fwhm == NULL) ? 0.0 : PyFloat_AsDouble(fwhm);
+	lazy->tile_nside = (tile_nside == NULL) ? 0 : (int) PyLong_AsLong(tile_nside);
+	lazy->cache_tiles = (cache_tiles == NULL) ? 64 : (int) PyLong_AsLong(cache_tiles);
+	lazy->prefetch = (prefetch == NULL) ? 1 : PyObject_IsTrue(prefetch);
+	if (PyErr_Occurred()){
+		Py_DECREF(lazy);
+		return NULL;
+	}
+	if (freq_arr != NULL && freq_arr != Py_None && (!PyArray_Check(freq_arr) || PyArray_TYPE((PyArrayObject *)freq_arr) != NPY_FLOAT64 || !PyArray_ISCARRAY_RO((PyArrayObject *)freq_arr) || PyArray_SIZE((PyArrayObject *)freq_arr) != lazy->Nfreqs)){
+		Py_DECREF(lazy);
+		PyErr_SetString(PyExc_TypeError, "freq_arr must be a contiguous float64 array of Nfreqs values");
+		return NULL;
+	}
+	if (lazy->Nthreads <= 0) lazy->Nthreads = omp_get_max_threads();
+	if (lazy->tile_nside <= 0){
+		lazy->tile_nside = 1;
+		while(lazy->tile_nside < lazy->nside && (lazy->nside/lazy->tile_nside)*(long)(lazy->nside/lazy->tile_nside) > PIXELILC_LAZY_TILE_PIXELS) lazy->tile_nside *= 2;
+	}
+	if (lazy->tile_nside > lazy->nside || lazy->nside % lazy->tile_nside != 0 || (lazy->tile_nside & (lazy->tile_nside - 1)) != 0){
+		Py_DECREF(lazy);
+		PyErr_SetString(PyExc_ValueError, "tile_nside must be a power of two not above nside");
+		return NULL;
+	}
+	// one slot pinned by a reader and one computed by the prefetch thread still leave room for a new tile
+	if (lazy->cache_tiles < 4) lazy->cache_tiles = 4;
+	lazy->Ntiles = 12L*lazy->tile_nside*lazy->tile_nside;
+	if (lazy->cache_tiles > lazy->Ntiles) lazy->cache_tiles = (int) lazy->Ntiles;
+	lazy->tile_pixels = 12L*lazy->nside*lazy->nside / lazy->Ntiles;
+
+	Py_INCREF(method_args);
+	lazy->method_args = method_args;
+	lazy->maps = PyArray_DATA(maps);
+	lazy->a = PyArray_DATA(a);
+	if (b != NULL) lazy->b = PyArray_DATA(b);
+	if (beta_dust_map != NULL) lazy->beta_dust_map = PyArray_DATA(beta_dust_map);
+	if (T_dust_map != NULL) lazy->T_dust_map = PyArray_DATA(T_dust_map);
+	if (beta_syn_map != NULL) lazy->beta_syn_map = PyArray_DATA(beta_syn_map);
+	if (Field_filtered_map != NULL) lazy->Field_filtered_map = PyArray_DATA(Field_filtered_map);
+	if (Mask != NULL) lazy->mask = PyArray_DATA(Mask);
+	if (freq_arr != NULL && freq_arr != Py_None){
+		lazy->freq_arr = malloc(lazy->Nfreqs*sizeof(double));
+		lazy->thermo_2_rj = malloc(lazy->Nfreqs*sizeof(double));
+		if (lazy->freq_arr == NULL || lazy->thermo_2_rj == NULL){
+			Py_DECREF(lazy);
+			return PyErr_NoMemory();
+		}
+		memcpy(lazy->freq_arr, PyArray_DATA(freq_arr), lazy->Nfreqs*sizeof(double));
+		pixelILC_Thermo2RJ(lazy->freq_arr, lazy->Nfreqs, lazy->thermo_2_rj);
+	}
+
+	long t;
+	int s;
+	lazy->slot_of_tile = malloc(lazy->Ntiles*sizeof(int));
+	for(t=0;t<lazy->Ntiles;t++) lazy->slot_of_tile[t] = -1;
+	lazy->slot_tile = malloc(lazy->cache_tiles*sizeof(long));
+	for(s=0;s<lazy->cache_tiles;s++) lazy->slot_tile[s] = -1;
+	lazy->slot_state = calloc(lazy->cache_tiles, sizeof(char));
+	lazy->slot_pins = calloc(lazy->cache_tiles, sizeof(int));
+	lazy->slot_used = calloc(lazy->cache_tiles, sizeof(unsigned long));
+	lazy->slot_weights = malloc(lazy->cache_tiles*lazy->tile_pixels*lazy->Nfreqs*sizeof(double));
+	lazy->queue = malloc((lazy->cache_tiles/2 + 1)*sizeof(long));
+	lazy->arenas = pixelILC_ArenasAlloc(lazy->Nthreads, lazy->Nfreqs);
+	pthread_mutex_init(&lazy->lock, NULL);
+	pthread_cond_init(&lazy->cond, NULL);
+	pthread_mutex_init(&lazy->call_lock, NULL);
+	if (lazy->prefetch){
+		lazy->arenas_prefetch = pixelILC_ArenasAlloc(1, lazy->Nfreqs);
+		pthread_create(&lazy->thread, NULL, Lazy_prefetch_thread, lazy);
+	}
+	return (PyObject *) lazy;
+}
+
+static void Lazy_dealloc(pixelILC_LazyObject *lazy){
+	if (lazy->arenas != NULL){
+		if (lazy->prefetch){
+			// waits for the tile the prefetch thread may be computing
+			Py_BEGIN_ALLOW_THREADS
+			pthread_mutex_lock(&lazy->lock);
+			lazy->stop = 1;
+			pthread_cond_broadcast(&lazy->cond);
+			pthread_mutex_unlock(&lazy->lock);
+			pthread_join(lazy->thread, NULL);
+			Py_END_ALLOW_THREADS
+			pixelILC_ArenasFree(lazy->arenas_prefetch, 1);
+		}
+		pixelILC_ArenasFree(lazy->arenas, lazy->Nthreads);
+		pthread_mutex_destroy(&lazy->lock);
+		pthread_cond_destroy(&lazy->cond);
+		pthread_mutex_destroy(&lazy->call_lock);
+	}
+	free(lazy->slot_of_tile);
+	free(lazy->slot_tile);
+	free(lazy->slot_state);
+	free(lazy->slot_pins);
+	free(lazy->slot_used);
+	free(lazy->slot_weights);
+	free(lazy->queue);
+	free(lazy->freq_arr);
+	free(lazy->thermo_2_rj);
+	Py_XDECREF(lazy->method_args);
+	Py_TYPE(lazy)->tp_free((PyObject *) lazy);
+}
+
+static PyArrayObject *Lazy_pixels(pixelILC_LazyObject *lazy, PyObject *ipix_arr){
+	// ipix_arr as a contiguous int64 array, checked against the size of the map
+	PyArrayObject *ipix = (PyArrayObject *) PyArray_FROM_OTF(ipix_arr, NPY_INT64, NPY_ARRAY_IN_ARRAY);
+	if (ipix == NULL) return NULL;
+	long p, npix_map = 12L*lazy->nside*lazy->nside, *ipix_ptr = PyArray_DATA(ipix);
+	for(p=0;p<PyArray_SIZE(ipix);p++){
+		if(ipix_ptr[p] < 0 || ipix_ptr[p] >= npix_map){
+			Py_DECREF(ipix);
+			PyErr_SetString(PyExc_IndexError, "pixel index out of the map");
+			return NULL;
+		}
+	}
+	return ipix;
+}
+
+static PyObject *Lazy_weights_method(pixelILC_LazyObject *lazy, PyObject *args){
+	// weights(ipix_arr), the [len(ipix_arr),Nfreqs] weights of the pixels of ipix_arr
+	PyObject *ipix_arr = NULL;
+	if (!PyArg_ParseTuple(args, "O" , &ipix_arr)) return NULL;
+	PyArrayObject *ipix = Lazy_pixels(lazy, ipix_arr);
+	if (ipix == NULL) return NULL;
+	long Npixels = (long) PyArray_SIZE(ipix);
+	double *weights = malloc((Npixels > 0 ? Npixels : 1)*lazy->Nfreqs*sizeof(double));
+	Py_BEGIN_ALLOW_THREADS
+	Lazy_weights(lazy, PyArray_DATA(ipix), Npixels, weights);
+	Py_END_ALLOW_THREADS
+	Py_DECREF(ipix);
+	npy_intp npy_shape[2] = {Npixels,lazy->Nfreqs};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	return(arr);
+}
+
+static PyObject *Lazy_values(pixelILC_LazyObject *lazy, PyObject *args){
+	// values(ipix_arr, maps), the ILC map sum_n w[p,n] maps[n,ipix_arr[p]] at the pixels of ipix_arr, maps being [Nfreqs,npix]
+	PyObject *ipix_arr = NULL;
+	PyObject *maps = NULL;
+	if (!PyArg_ParseTuple(args, "OO" , &ipix_arr, &maps)) return NULL;
+	PyArrayObject *ipix = Lazy_pixels(lazy, ipix_arr);
+	if (ipix == NULL) return NULL;
+	long p, Npixels = (long) PyArray_SIZE(ipix), npix_map = 12L*lazy->nside*lazy->nside;
+	long *ipix_ptr = PyArray_DATA(ipix);
+	PyArrayObject *maps_arr = (PyArrayObject *) PyArray_FROM_OTF(maps, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+	if (maps_arr == NULL){
+		Py_DECREF(ipix);
+		return NULL;
+	}
+	if (PyArray_SIZE(maps_arr) != lazy->Nfreqs*npix_map){
+		Py_DECREF(maps_arr);
+		Py_DECREF(ipix);
+		PyErr_SetString(PyExc_ValueError, "maps must have Nfreqs x 12*nside**2 values");
+		return NULL;
+	}
+	double *maps_ = PyArray_DATA(maps_arr);
+	double *weights = malloc((Npixels > 0 ? Npixels : 1)*lazy->Nfreqs*sizeof(double));
+	double *values = calloc(Npixels > 0 ? Npixels : 1, sizeof(double));
+	Py_BEGIN_ALLOW_THREADS
+	Lazy_weights(lazy, ipix_ptr, Npixels, weights);
+	for(p=0;p<Npixels;p++){
+		int n;
+		for(n=0;n<lazy->Nfreqs;n++) values[p] += weights[p*lazy->Nfreqs + n] * maps_[n*npix_map + ipix_ptr[p]];
+	}
+	Py_END_ALLOW_THREADS
+	free(weights);
+	Py_DECREF(maps_arr);
+	Py_DECREF(ipix);
+	npy_intp npy_shape[1] = {Npixels};
+	PyObject *arr 		= PyArray_SimpleNewFromData(1,npy_shape, NPY_DOUBLE, values);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	return(arr);
+}
+
+static PyObject *Lazy_cacheInfo(pixelILC_LazyObject *lazy, PyObject *args){
+	// cacheInfo(), a dict with the tiles found in the cache (hits), computed on demand (misses) and in the background
+	// (prefetched), and the number of tiles cached now
+	int s, cached = 0;
+	pthread_mutex_lock(&lazy->lock);
+	for(s=0;s<lazy->cache_tiles;s++) cached += (lazy->slot_state[s] == LAZY_READY);
+	PyObject *info = Py_BuildValue("{s:l,s:l,s:l,s:i}", "hits", lazy->hits, "misses", lazy->misses, "prefetched", lazy->prefetched, "cached", cached);
+	pthread_mutex_unlock(&lazy->lock);
+	return info;
+}
+
+static PyMethodDef Lazy_methods[] = {
+	{"weights", (PyCFunction) Lazy_weights_method, METH_VARARGS, NULL},
+	{"values", (PyCFunction) Lazy_values, METH_VARARGS, NULL},
+	{"cacheInfo", (PyCFunction) Lazy_cacheInfo, METH_NOARGS, NULL},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyMemberDef Lazy_members[] = {
+	{"nside", T_INT, offsetof(pixelILC_LazyObject, nside), READONLY, NULL},
+	{"Nfreqs", T_INT, offsetof(pixelILC_LazyObject, Nfreqs), READONLY, NULL},
+	{"nest", T_INT, offsetof(pixelILC_LazyObject, nest), READONLY, NULL},
+	{"Nthreads", T_INT, offsetof(pixelILC_LazyObject, Nthreads), READONLY, NULL},
+	{"tile_nside", T_INT, offsetof(pixelILC_LazyObject, tile_nside), READONLY, NULL},
+	{"cache_tiles", T_INT, offsetof(pixelILC_LazyObject, cache_tiles), READONLY, NULL},
+	{NULL}        /* Sentinel */
+};
+
+PyTypeObject pixelILC_LazyType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "PixelILC.LazyWeights",
+	.tp_basicsize = sizeof(pixelILC_LazyObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = Lazy_new,
+	.tp_dealloc = (destructor) Lazy_dealloc,
+	.tp_methods = Lazy_methods,
+	.tp_members = Lazy_members,
+};
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <omp.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Pixel-space NILC without the pixel itself in its covariance. The disc of a pixel holds the pixel, so its own
+// fluctuations enter the covariance its weights minimize, which biases the ILC low (the ILC bias). Here the disc sum is
+// factorized as usual, C = U^T U, and the contribution m_c x_c x_c^T of every pixel of the core, the pixel alone or the
+// pixels within core_radius, is taken out of the factor by a rank one downdate, so the bias-reduced weights cost one
+// packed Cholesky and a few O(Nfreqs^2) downdates instead of the LU inverse of the standard run.
+
+void pixelILC_Run_NILC_CovarPixelSpace_LeaveOut(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, double core_radius, double *Covar_maps, double *Field_filtered_map, double *mask, double *a, double *weights, long *refactorized){
+	// Covar_maps gets the full disc sums, as from pixelILC_Run_NILC_CovarPixelSpace, and weights the weights of the
+	// covariances without the core. When a downdate fails, because the disc without the core has too few pixels for a
+	// positive definite covariance, the core is subtracted from the sums and they are factorized again, and the pixel is
+	// counted in refactorized.
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	long npix_map = 12L*nside*nside;
+	long count = 0;
+	#pragma omp parallel reduction(+:count)
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	double *x = &arena->work[Nfreqs];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, Nfreqs);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			long ncore = 1, ii;
+			int n, failed = 0;
+			double *Covar_pix = &Covar_maps[ipix*Nfreqs2];
+			pixelILC_DefineCovMat_NILC_CovarPixelSpace_SingleField(ipix, Nfreqs, nside, nest, Covar_maps, Field_filtered_map, mask, arena, arena->CovF, Nfreqs2, fwhm);
+			STATS_TIC(t_stats);
+			// the disc pixels are summed, the buffer can take the core
+			if(core_radius > 0.0){
+				ncore = pixelILC_QueryDisc(arena, ipix, core_radius, nside, nest);
+				STATS_LAP(PILC_QUERY_DISC, t_stats);
+			}
+			else arena->pixel_buffer[0] = ipix;
+			pixelILC_CholeskyPacked(Covar_pix, arena->acc, Nfreqs);
+			for(ii=0;ii<ncore && !failed;ii++){
+				long ipix2 = arena->pixel_buffer[ii];
+				double w = mask[ipix2];
+				if(w <= 0.0) continue;
+				w = sqrt(w);
+				for(n=0;n<Nfreqs;n++) x[n] = w * Field_filtered_map[n*npix_map + ipix2];
+				failed = pixelILC_CholeskyRank1Downdate(arena->acc, x, Nfreqs);
+			}
+			if(failed){
+				int nn, c;
+				memcpy(arena->acc, Covar_pix, Nfreqs2*sizeof(double));
+				for(ii=0;ii<ncore;ii++){
+					long ipix2 = arena->pixel_buffer[ii];
+					double w = mask[ipix2];
+					if(w <= 0.0) continue;
+					c = 0;
+					for(n=0;n<Nfreqs;n++){
+						double xm = Field_filtered_map[n*npix_map + ipix2] * w;
+						for(nn=n;nn<Nfreqs;nn++){
+							arena->acc[c] -= xm * Field_filtered_map[nn*npix_map + ipix2];
+							c += 1;
+						}
+					}
+				}
+				pixelILC_CholeskyPacked(arena->acc, arena->acc, Nfreqs);
+				count += 1;
+			}
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_NILC_Factorized(a, arena->acc, weights, Nfreqs, p, arena->work);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+	*refactorized = count;
+}
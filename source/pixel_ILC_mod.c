@@ -3,8 +3,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#define PY_ARRAY_UNIQUE_SYMBOL PixelILC_ARRAY_API
 #include <numpy/ndarrayobject.h>
 #include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+#include <pixel_ILC_api.h>
+#include <query_disc_wrapper.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_linalg.h>
 #include <gsl/gsl_blas.h>
@@ -12,10 +16,47 @@
 #include <gsl/gsl_spline.h>
 #include <omp.h>
 
-#define H_PLANCK 6.6260755e-34
-#define K_BOLTZ 1.380658e-23
-#define T_CMB 2.72548
-#define PI 3.14159265358979323846
+// defined in pixel_ILC_plan.c and pixel_ILC_lazy.c
+extern PyTypeObject pixelILC_PlanType;
+extern PyTypeObject pixelILC_LazyType;
+
+// Progress of the running call, or of the last one. The module functions hold the GIL while their pixel loops run, so
+// the thread which called them polls from inside the loops: it checks for Ctrl-C, which raises KeyboardInterrupt and
+// stops the call, and calls the callback of setProgress, which stops it by returning True. cancel() stops it too, from
+// the callback or from a signal handler, and then the call returns NaN weights for the pixels it did not reach.
+static pixelILC_progress progress_state;
+static PyObject *progress_callback = NULL;
+static double progress_interval = PIXELILC_PROGRESS_INTERVAL;
+static int progress_running = 0;
+
+static int progress_poll(pixelILC_progress *progress){
+	// nonzero cancels the call, with a python exception set when it comes from Ctrl-C or the callback
+	if(progress->cancel) return 1;
+	if(PyErr_CheckSignals() < 0) return 1;
+	if(progress_callback != NULL){
+		PyObject *res = PyObject_CallFunction(progress_callback, "ll", progress->done, progress->total);
+		if(res == NULL) return 1;
+		int stop = PyObject_IsTrue(res);
+		Py_DECREF(res);
+		if(stop != 0) return 1;
+	}
+	return 0;
+}
+
+static void progress_start(pixelILC_schedule *sched, long total){
+	pixelILC_ProgressInit(&progress_state, total, progress_interval);
+	progress_state.poll = progress_poll;
+	progress_running = 1;
+	if(sched != NULL) sched->progress = &progress_state;
+}
+
+static int progress_stop(void){
+	// -1 when a python exception stopped the call, the caller frees its buffers and returns NULL. A cancelled call
+	// returns its results like a complete one.
+	progress_running = 0;
+	if(PyErr_Occurred()) return -1;
+	return 0;
+}
 
 static PyObject *doNILC_CovarPixelSpace_SingleField(PyObject *self, PyObject *args){
 	/* Getting the elements */
@@ -30,43 +71,569 @@ static PyObject *doNILC_CovarPixelSpace_SingleField(PyObject *self, PyObject *ar
 	PyObject *Nfreqs = NULL;
 	PyObject *ipix_arr=NULL;
 	PyObject *Npixels=NULL;
-	if (!PyArg_ParseTuple(args, "OOOOOOOOO" , &Covar_maps, &Field_filtered_map, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels)) return NULL;
+	PyObject *nest=NULL; // optional, 1 if the maps and ipix_arr are in NEST ordering, RING by default
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO|O" , &Covar_maps, &Field_filtered_map, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &nest)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *Covar_maps_ = PyArray_DATA(Covar_maps);
+	double *Field_filtered_map_ = PyArray_DATA(Field_filtered_map);
+	double *Mask_ = PyArray_DATA(Mask);
+	double *a_ = PyArray_DATA(a);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	// pixels are processed in blocks along the NEST curve, so that neighbouring iterations of a thread share most of their discs.
+	// Discs do not all cost the same, so the cost of every block is estimated from its disc size
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 1, nest_, omp_get_max_threads());
+	pixelILC_ScheduleDiscCost(&sched, ipix_ptr, nside_map, nest_, 0.5*fwhm_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_CovarPixelSpace(&sched, arenas, ipix_ptr, Nfreqs_, nside_map, nest_, fwhm_, Covar_maps_, Field_filtered_map_, Mask_, NULL, NULL, NULL, 12L*nside_map*nside_map, a_, weights);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+static PyObject *updateChannel_CovarPixelSpace_SingleField(PyObject *self, PyObject *args){
+	// updateChannel_CovarPixelSpace_SingleField(Covar_maps, Field_filtered_map, Mask, weights, nside, a, fwhm, Nfreqs, ipix_arr,
+	// Npixels, channel, nest=0) updates in place Covar_maps and the weights of doNILC_CovarPixelSpace_SingleField once the map
+	// of channel was replaced in Field_filtered_map, summing the discs for the entries of that channel only. Returns weights.
+	// A cancelled update leaves the pixels not reached as they were, calling it again completes it.
+	PyObject *Covar_maps = NULL;
+	PyObject *Field_filtered_map = NULL;
+	PyObject *Mask = NULL;
+	PyObject *weights = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *channel=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOOOOO|O" , &Covar_maps, &Field_filtered_map, &Mask, &weights, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &channel, &nest)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int channel_ = (int) PyLong_AsLong(channel);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	if (channel_ < 0 || channel_ >= Nfreqs_){
+		PyErr_SetString(PyExc_ValueError, "channel must be between 0 and Nfreqs-1");
+		return NULL;
+	}
+	pixelILC_stats_reset(omp_get_max_threads());
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 1, nest_, omp_get_max_threads());
+	pixelILC_ScheduleDiscCost(&sched, ipix_ptr, nside_map, nest_, 0.5*fwhm_);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_CovarPixelSpace_Channel(&sched, arenas, ipix_ptr, Nfreqs_, nside_map, nest_, fwhm_, PyArray_DATA(Covar_maps), PyArray_DATA(Field_filtered_map), PyArray_DATA(Mask), channel_, PyArray_DATA(a), PyArray_DATA(weights));
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0) return NULL;
+	Py_INCREF(weights);
+	return(weights);
+}
+
+static PyObject *updateMask_CovarPixelSpace_SingleField(PyObject *self, PyObject *args){
+	// updateMask_CovarPixelSpace_SingleField(Covar_maps, Field_filtered_map, Mask, weights, nside, a, fwhm, Nfreqs, ipix_arr,
+	// Npixels, edited_pixels, new_values, nest=0) sets Mask[edited_pixels] = new_values and updates in place Covar_maps and
+	// the weights of doNILC_CovarPixelSpace_SingleField, for the pixels within fwhm/2 of an edited pixel only. Returns the
+	// positions in ipix_arr of the updated pixels. A cancel stops the call only before anything changed, and it then
+	// returns no positions with getProgress()['cancelled'] set.
+	PyObject *Covar_maps = NULL;
+	PyObject *Field_filtered_map = NULL;
+	PyObject *Mask = NULL;
+	PyObject *weights = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *edited=NULL; // int64 pixel indices of the map
+	PyObject *new_values=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOOOOOO|O" , &Covar_maps, &Field_filtered_map, &Mask, &weights, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &edited, &new_values, &nest)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long Nedited = (long) PyArray_SIZE((PyArrayObject *) edited);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	pixelILC_stats_reset(omp_get_max_threads());
+	long *updated;
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	progress_start(NULL, Nedited);
+	long Nupdated = pixelILC_Run_NILC_CovarPixelSpace_MaskEdit(arenas, PyArray_DATA(ipix_arr), Npixels_, Nfreqs_, nside_map, nest_, fwhm_, PyArray_DATA(Covar_maps), PyArray_DATA(Field_filtered_map), PyArray_DATA(Mask), PyArray_DATA(edited), PyArray_DATA(new_values), Nedited, PyArray_DATA(a), PyArray_DATA(weights), &updated, &progress_state);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	if(progress_stop() < 0){
+		free(updated);
+		return NULL;
+	}
+	if(Nupdated < 0){
+		PyErr_SetString(PyExc_ValueError, "edited_pixels must be distinct pixels of the map, and ipix_arr must not repeat pixels");
+		return NULL;
+	}
+	npy_intp npy_shape[1] = {Nupdated};
+	PyObject *arr 		= PyArray_SimpleNewFromData(1,npy_shape, NPY_INT64, updated);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	return(arr);
+}
+
+static PyObject *doNILC_CovarPixelSpace_LeaveOut_SingleField(PyObject *self, PyObject *args){
+	// Same arguments as doNILC_CovarPixelSpace_SingleField, then core_radius=0 and nest=0. The weights of every pixel come
+	// from the covariance of its disc without the pixels within core_radius of it, the pixel alone for 0, which removes
+	// most of the ILC bias. Covar_maps gets the full disc sums. Returns (weights, refactorized), the second the number
+	// of pixels where the core could not be downdated from the factor and the covariance was factorized again.
+	PyObject *Covar_maps = NULL;
+	PyObject *Field_filtered_map = NULL;
+	PyObject *Mask = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *core_radius=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO|OO" , &Covar_maps, &Field_filtered_map, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &core_radius, &nest)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	double core_radius_ = (core_radius == NULL || core_radius == Py_None) ? 0.0 : PyFloat_AsDouble(core_radius);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	if (core_radius_ < 0.0 || core_radius_ >= 0.5*fwhm_){
+		PyErr_SetString(PyExc_ValueError, "core_radius must be between 0 and fwhm/2");
+		return NULL;
+	}
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	long refactorized;
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 1, nest_, omp_get_max_threads());
+	pixelILC_ScheduleDiscCost(&sched, ipix_ptr, nside_map, nest_, 0.5*fwhm_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_CovarPixelSpace_LeaveOut(&sched, arenas, ipix_ptr, Nfreqs_, nside_map, nest_, fwhm_, core_radius_, PyArray_DATA(Covar_maps), PyArray_DATA(Field_filtered_map), PyArray_DATA(Mask), PyArray_DATA(a), weights, &refactorized);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return Py_BuildValue("Nl", arr, refactorized);
+}
+
+static PyObject *doNILC_CovarPixelSpace_QU_SingleField(PyObject *self, PyObject *args){
+	// doNILC_CovarPixelSpace_QU_SingleField(Covar_maps, Qmaps, Umaps, Mask, nside, a, fwhm, Nfreqs, ipix, Npixels, nest=0)
+	// The polarization NILC on the Q and U maps of a needlet window, [Nfreqs,npix] each, instead of its E or B maps.
+	// Covar_maps has shape [npix, 2Nfreqs(2Nfreqs+1)/2] and gets the covariances of (Q, U) with the disc pixels rotated to
+	// the frame of the center. Returns weights of shape [Npixels, 2, 2*Nfreqs], the ILC maps at pixel ipix[p] are
+	// Q = weights[p,0] . x and U = weights[p,1] . x with x = (Qmaps[:,ipix[p]], Umaps[:,ipix[p]]).
+	PyObject *Covar_maps = NULL;
+	PyObject *Q_maps = NULL;
+	PyObject *U_maps = NULL;
+	PyObject *Mask = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOOOO|O" , &Covar_maps, &Q_maps, &U_maps, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &nest)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*4*Nfreqs_,sizeof(double));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 1, nest_, omp_get_max_threads());
+	pixelILC_ScheduleDiscCost(&sched, ipix_ptr, nside_map, nest_, 0.5*fwhm_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), 2*Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_CovarPixelSpace_QU(&sched, arenas, ipix_ptr, Nfreqs_, nside_map, nest_, fwhm_, PyArray_DATA(Covar_maps), PyArray_DATA(Q_maps), PyArray_DATA(U_maps), PyArray_DATA(Mask), PyArray_DATA(a), weights);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[3] = {Npixels_,2,2*Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(3,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doNILC_CovarPixelSpace_Degraded_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// Same inputs as doNILC_CovarPixelSpace_SingleField, plus an optional target_pixels before nest. The covariances are
+	// disc sums on the maps degraded to pixelILC_DegradedNside(nside, fwhm, target_pixels), PIXELILC_DEGRADE_TARGET_PIXELS
+	// by default, and the weights of a degraded pixel are used for all the requested pixels inside it.
+	// Meant for the wide windows, where a full resolution disc holds far more pixels than its covariance needs.
+	PyObject *Covar_maps = NULL; // Covar_maps will be a numpy array with the shape [npix,Nfreqs2], which is empty here and will be filled
+	PyObject *Field_filtered_map = NULL;
+	PyObject *Mask = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *target_pixels=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO|OO" , &Covar_maps, &Field_filtered_map, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &target_pixels, &nest)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *Covar_maps_ = PyArray_DATA(Covar_maps);
+	double *Field_filtered_map_ = PyArray_DATA(Field_filtered_map);
+	double *Mask_ = PyArray_DATA(Mask);
+	double *a_ = PyArray_DATA(a);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	long target_pixels_ = (target_pixels == NULL || target_pixels == Py_None) ? PIXELILC_DEGRADE_TARGET_PIXELS : PyLong_AsLong(target_pixels);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	int nside_lo = pixelILC_DegradedNside(nside_map, fwhm_, target_pixels_);
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	progress_start(NULL, Npixels_);
+	pixelILC_Run_NILC_CovarPixelSpace_Degraded(arenas, ipix_ptr, Npixels_, Nfreqs_, nside_map, nest_, nside_lo, fwhm_, Covar_maps_, Field_filtered_map_, Mask_, a_, weights, &progress_state);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *degradedNside(PyObject *self, PyObject *args){
+	// degradedNside(nside, fwhm, target_pixels), the resolution doNILC_CovarPixelSpace_Degraded_SingleField works at
+	PyObject *nside = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *target_pixels = NULL;
+	if (!PyArg_ParseTuple(args, "OO|O" , &nside, &fwhm, &target_pixels)) return NULL;
+	long target_pixels_ = (target_pixels == NULL || target_pixels == Py_None) ? PIXELILC_DEGRADE_TARGET_PIXELS : PyLong_AsLong(target_pixels);
+	return PyLong_FromLong(pixelILC_DegradedNside((int) PyLong_AsLong(nside), PyFloat_AsDouble(fwhm), target_pixels_));
+}
+
+static PyObject *planStrategies(PyObject *self, PyObject *args){
+	// planStrategies(nside, fwhm, Nfreqs, Npixels, fsky=1.0, memory_limit=None, calibrate=1)
+	// Estimated seconds and bytes of every way to get the pixel-space weights of Npixels pixels, with a fraction fsky of
+	// the sky unmasked, on omp_get_max_threads() threads. memory_limit is in bytes, PIXELILC_MEMORY_FRACTION of the
+	// physical memory by default. With calibrate the seconds per operation are measured on this machine first.
+	// Returns a dict with the list of strategies, the recommended one (the fastest feasible exact one, else the fastest
+	// feasible approximation, None if nothing fits), the memory limit and the rates used.
+	PyObject *nside = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *Npixels = NULL;
+	PyObject *fsky = NULL;
+	PyObject *memory_limit = NULL;
+	PyObject *calibrate = NULL;
+	if (!PyArg_ParseTuple(args, "OOOO|OOO" , &nside, &fwhm, &Nfreqs, &Npixels, &fsky, &memory_limit, &calibrate)) return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	double fsky_ = (fsky == NULL || fsky == Py_None) ? 1.0 : PyFloat_AsDouble(fsky);
+	double memory_limit_ = (memory_limit == NULL || memory_limit == Py_None) ? pixelILC_CostMemoryLimit() : PyFloat_AsDouble(memory_limit);
+	int calibrate_ = (calibrate == NULL) ? 1 : PyObject_IsTrue(calibrate);
+	if (PyErr_Occurred()) return NULL;
+
+	pixelILC_cost_rates rates;
+	pixelILC_strategy strategies[PIXELILC_NSTRATEGIES];
+	int s, best;
+	Py_BEGIN_ALLOW_THREADS
+	if (calibrate_) pixelILC_CostCalibrate(nside_map, fwhm_, Nfreqs_, &rates);
+	else pixelILC_CostDefaultRates(&rates);
+	best = pixelILC_CostPlan(nside_map, fwhm_, Nfreqs_, Npixels_, fsky_, omp_get_max_threads(), memory_limit_, &rates, strategies);
+	Py_END_ALLOW_THREADS
+	PyObject *list = PyList_New(PIXELILC_NSTRATEGIES);
+	for(s=0;s<PIXELILC_NSTRATEGIES;s++){
+		pixelILC_strategy *st = &strategies[s];
+		PyList_SET_ITEM(list, s, Py_BuildValue("{s:s,s:s,s:i,s:d,s:d,s:d,s:i}", "name", st->name, "function", st->function, "exact", st->exact, "setup_seconds", st->setup_seconds, "seconds", st->seconds, "bytes", st->bytes, "feasible", st->feasible));
+	}
+	PyObject *recommended = (best >= 0) ? PyUnicode_FromString(strategies[best].name) : (Py_INCREF(Py_None), Py_None);
+	return Py_BuildValue("{s:N,s:N,s:d,s:{s:d,s:d,s:d,s:d,s:d}}", "strategies", list, "recommended", recommended, "memory_limit", memory_limit_,
+		"rates", "query", rates.query, "madd", rates.madd, "solve", rates.solve, "flop", rates.flop, "ring_mode", rates.ring_mode);
+}
+
+static PyObject *doNILC_CovarPixelSpace_Subsampled_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// doNILC_CovarPixelSpace_Subsampled_SingleField(Covar_maps, Field_filtered_map, Mask, nside, a, fwhm, Nfreqs, ipix_arr, Npixels, lmax, oversampling=None, nest=0)
+	// Same inputs as doNILC_CovarPixelSpace_SingleField, plus the band-limit lmax of the window. The disc sums are
+	// estimated from one pixel per cell of pixelILC_SubsampleNside(nside, lmax, oversampling), and oversampling,
+	// PIXELILC_SUBSAMPLE_OVERSAMPLING by default, trades speed for accuracy. Returns the weights [Npixels,Nfreqs] and the
+	// estimated relative error of every covariance [Npixels].
+	PyObject *Covar_maps = NULL; // Covar_maps will be a numpy array with the shape [npix,Nfreqs2], which is empty here and will be filled
+	PyObject *Field_filtered_map = NULL;
+	PyObject *Mask = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *lmax=NULL;
+	PyObject *oversampling=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOOOO|OO" , &Covar_maps, &Field_filtered_map, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &lmax, &oversampling, &nest)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *Covar_maps_ = PyArray_DATA(Covar_maps);
+	double *Field_filtered_map_ = PyArray_DATA(Field_filtered_map);
+	double *Mask_ = PyArray_DATA(Mask);
+	double *a_ = PyArray_DATA(a);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	double oversampling_ = (oversampling == NULL || oversampling == Py_None) ? PIXELILC_SUBSAMPLE_OVERSAMPLING : PyFloat_AsDouble(oversampling);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	int nside_s = pixelILC_SubsampleNside(nside_map, (int) PyLong_AsLong(lmax), oversampling_);
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	double* rel_error = calloc(Npixels_,sizeof(double));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 1, nest_, omp_get_max_threads());
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_CovarPixelSpace_Subsampled(&sched, arenas, ipix_ptr, Nfreqs_, nside_map, nest_, nside_s, fwhm_, Covar_maps_, Field_filtered_map_, Mask_, a_, weights, rel_error);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		free(rel_error);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	PyObject *arr_error	= PyArray_SimpleNewFromData(1,npy_shape, NPY_DOUBLE, rel_error);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr_error, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return Py_BuildValue("NN", arr, arr_error);
+}
+
+static PyObject *subsampleNside(PyObject *self, PyObject *args){
+	// subsampleNside(nside, lmax, oversampling), the grid doNILC_CovarPixelSpace_Subsampled_SingleField samples the discs on
+	PyObject *nside = NULL;
+	PyObject *lmax = NULL;
+	PyObject *oversampling = NULL;
+	if (!PyArg_ParseTuple(args, "OO|O" , &nside, &lmax, &oversampling)) return NULL;
+	double oversampling_ = (oversampling == NULL || oversampling == Py_None) ? PIXELILC_SUBSAMPLE_OVERSAMPLING : PyFloat_AsDouble(oversampling);
+	return PyLong_FromLong(pixelILC_SubsampleNside((int) PyLong_AsLong(nside), (int) PyLong_AsLong(lmax), oversampling_));
+}
+
+static PyObject *doNILC_CovarPixelSpace_Batch_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// doNILC_CovarPixelSpace_Batch_SingleField(Field_filtered_maps, Mask, nside, a, fwhm, Nfreqs, ipix_arr, Npixels, Nreal, nest=0)
+	// The weights of doNILC_CovarPixelSpace_SingleField for Nreal realizations sharing the mask, with every disc queried
+	// once for all of them. Returns an array [Nreal,Npixels,Nfreqs], the covariances are not returned.
+	PyObject *Field_filtered_maps = NULL; // numpy array with shape [Nreal,Nfreqs,npix]
+	PyObject *Mask = NULL; // [npix], non-negative
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *Nreal=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO|O" , &Field_filtered_maps, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &Nreal, &nest)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int Nreal_ = (int) PyLong_AsLong(Nreal);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *Field_filtered_maps_ = PyArray_DATA(Field_filtered_maps);
+	double *Mask_ = PyArray_DATA(Mask);
+	double *a_ = PyArray_DATA(a);
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	long ipix, npix_map = 12L*nside_map*nside_map;
+	for(ipix=0;ipix<npix_map;ipix++){
+		if(Mask_[ipix] < 0.0){
+			PyErr_SetString(PyExc_ValueError, "doNILC_CovarPixelSpace_Batch_SingleField needs a non-negative mask");
+			return NULL;
+		}
+	}
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
+	double* weights = calloc((long) Nreal_*Npixels_*Nfreqs_,sizeof(double));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 1, nest_, omp_get_max_threads());
+	pixelILC_ScheduleDiscCost(&sched, ipix_ptr, nside_map, nest_, 0.5*fwhm_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_CovarPixelSpace_Batch(&sched, arenas, ipix_ptr, Npixels_, Nreal_, Nfreqs_, nside_map, nest_, fwhm_, Field_filtered_maps_, Mask_, a_, weights);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[3] = {Nreal_,Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(3,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doNILC_CovarRingFFT_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// Same inputs as doNILC_CovarPixelSpace_SingleField, but the local covariances are the masked products of the filtered maps
+	// smoothed with a gaussian of the same second moment as the disc of radius fwhm/2, using ring FFTs.
+	// The cost does not depend on fwhm, but every pixel of Covar_maps is filled, not only the ones in ipix_arr.
+	// Covar_maps holds kernel weighted means instead of disc sums, which only changes the covariances by a factor the weights do not see.
+	PyObject *Covar_maps = NULL; // Covar_maps will be a numpy array with the shape [npix,Nfreqs2], which will be filled
+	PyObject *Field_filtered_map = NULL; // this is a numpy array with shape [Nfreqs,npix] and contains the filtered map of field F (E or B) for window w
+	PyObject *Mask = NULL; // This is the mask, with size [npix]
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *nest=NULL; // optional, 1 if the maps and ipix_arr are in NEST ordering, RING by default
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO|O" , &Covar_maps, &Field_filtered_map, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &nest)) return NULL;
 
 	int nside_map = (int) PyLong_AsLong(nside);
 	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
 	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
 	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long npix_map = 12L*nside_map*nside_map;
 	long *ipix_ptr = PyArray_DATA(ipix_arr);
 	double *Covar_maps_ = PyArray_DATA(Covar_maps);
 	double *Field_filtered_map_ = PyArray_DATA(Field_filtered_map);
 	double *Mask_ = PyArray_DATA(Mask);
 	double *a_ = PyArray_DATA(a);
 	double fwhm_ = PyFloat_AsDouble(fwhm);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
 	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, omp_get_max_threads());
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	
-	#pragma omp parallel
-	{
-	gsl_matrix *CovF = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	gsl_matrix *CovFi = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	long* pixel_buffer = calloc(60000,sizeof(long)); // this is to hold the pixels inside the disc when I call query_disc
-	int p;
-	//printf("I am here, after allocating the pixel buffer\n");
-	#pragma omp for schedule(static)
-	for(p=0;p<Npixels_;p++){
-		long ipix = ipix_ptr[p];
-		gsl_matrix_set_zero(CovF);
-		gsl_matrix_set_zero(CovFi);
-		pixelILC_DefineCovMat_NILC_CovarPixelSpace_SingleField(ipix,Nfreqs_, nside_map, Covar_maps_, Field_filtered_map_, Mask_, pixel_buffer, CovF, Nfreqs2, fwhm_);
-		invert_a_matrix(CovF,CovFi,Nfreqs_);
-		pixelILC_CalculateILCWeight_NILC_SingleField(a_,CovFi,weights,Nfreqs_,p);
-	}
-	gsl_matrix_free(CovF);
-	gsl_matrix_free(CovFi);
-	free(pixel_buffer);
+	// the smoothing works on RING ordered maps, so with NEST inputs we go through n2r[ipix_nest] = ipix_ring
+	long *n2r = NULL;
+	if(nest_){
+		n2r = malloc(npix_map*sizeof(long));
+		for(long i=0;i<npix_map;i++) n2r[i] = i;
+		nest2ring_wrapper(n2r, npix_map, nside_map, n2r);
+	}
+	// one step per product map, then the pixels
+	progress_start(&sched, Nfreqs2 + Npixels_);
+	STATS_TIC(t_stats);
+	pixelILC_ringfft_plan plan;
+	pixelILC_RingFFTPlanInit(&plan, nside_map, fwhm_);
+	double *product_map = malloc(npix_map*sizeof(double));
+	double *smoothed_map = malloc(npix_map*sizeof(double));
+	double *coef = malloc(npix_map*sizeof(double));
+	int n,nn,c;
+	c = 0;
+	for(n=0;n<Nfreqs_ && !progress_state.cancel;n++){
+		for(nn=n;nn<Nfreqs_ && !progress_state.cancel;nn++){
+			long i;
+			#pragma omp parallel for schedule(static)
+			for(i=0;i<npix_map;i++){
+				long i_ring = nest_ ? n2r[i] : i;
+				product_map[i_ring] = Field_filtered_map_[n*npix_map + i] * Field_filtered_map_[nn*npix_map + i] * Mask_[i];
+			}
+			pixelILC_RingFFTSmooth(&plan, product_map, coef, smoothed_map);
+			#pragma omp parallel for schedule(static)
+			for(i=0;i<npix_map;i++){
+				Covar_maps_[i*Nfreqs2 + c] = smoothed_map[nest_ ? n2r[i] : i];
+			}
+			c += 1;
+			// polls on this thread, which checks for Ctrl-C too
+			pixelILC_ProgressBlock(&progress_state, 1);
+		}
+	}
+	free(product_map);
+	free(smoothed_map);
+	free(coef);
+	free(n2r);
+	pixelILC_RingFFTPlanFree(&plan);
+	STATS_LAP(PILC_COVARIANCE, t_stats);
+	
+	// now Covar_maps is laid out like TEBmaps, so the rest is the SHT smoothing path. After a cancel during the
+	// smoothing it skips every block and the weights are all NaN
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	pixelILC_Run_NILC_SHTSmoothing(&sched, arenas, ipix_ptr, Nfreqs_, Covar_maps_, a_, weights);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
 	}
+	STATS_START(t_marshal);
 	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
 	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
 	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	return(arr);
 }
 static PyObject *doNILC_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
@@ -80,187 +647,889 @@ static PyObject *doNILC_SHTSmoothing_SingleField(PyObject *self, PyObject *args)
 	PyObject *Nfreqs = NULL;
 	PyObject *ipix_arr=NULL;
 	PyObject *Npixels=NULL;
-	PyObject *rank=NULL;
-	PyObject *field=NULL;
+	PyObject *rank=NULL;
+	PyObject *field=NULL;
+	PyObject *Nthreads=NULL;
+	
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO" , &TEBmaps, &nside, &a, &Nfreqs, &ipix_arr, &Npixels, &rank, &field, &Nthreads))
+		return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int rank_ = (int) PyLong_AsLong(rank);
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	double *a_ = PyArray_DATA(a);
+	// We dont need the fwhm anymore, because it is implicit in the TEB2maps 
+	// This is for a single field
+	
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	// TEBmaps rows are read by increasing pixel index, whatever order ipix_arr comes in
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
+	omp_set_num_threads(Nthreads_);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_SHTSmoothing(&sched, arenas, ipix_ptr, Nfreqs_, TEBmaps_, a_, weights);
+	pixelILC_ArenasFree(arenas, Nthreads_);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doGNILC_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// doGNILC_SHTSmoothing_SingleField(TEBmaps, NuisanceMaps, nside, Nfreqs, ipix_arr, Npixels, Nmodes, Nthreads)
+	// TEBmaps and NuisanceMaps have the shape [npix,Nfreqs2], with the covariances of the data and of the nuisance (CMB
+	// and noise). Nmodes is the number of independent modes in the domain of the covariances, for the AIC.
+	// Returns the GNILC weights [Npixels,Nfreqs,Nfreqs], the foregrounds in channel i being sum_j W[p,i,j] x_j, and the
+	// dimension of the foreground subspace of every pixel [Npixels].
+	PyObject *TEBmaps = NULL;
+	PyObject *NuisanceMaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *Nmodes=NULL;
+	PyObject *Nthreads=NULL;
+
+	if (!PyArg_ParseTuple(args, "OOOOOOOO" , &TEBmaps, &NuisanceMaps, &nside, &Nfreqs, &ipix_arr, &Npixels, &Nmodes, &Nthreads))
+		return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	double Nmodes_ = PyFloat_AsDouble(Nmodes);
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	double *NuisanceMaps_ = PyArray_DATA(NuisanceMaps);
+
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_*Nfreqs_,sizeof(double));
+	int* dims = calloc(Npixels_,sizeof(int));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+
+	omp_set_num_threads(Nthreads_);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_GNILC_SHTSmoothing(&sched, arenas, ipix_ptr, Nfreqs_, TEBmaps_, NuisanceMaps_, Nmodes_, weights, dims);
+	pixelILC_ArenasFree(arenas, Nthreads_);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		free(dims);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[3] = {Npixels_,Nfreqs_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(3,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	PyObject *arr_dims	= PyArray_SimpleNewFromData(1,npy_shape, NPY_INT, dims);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr_dims, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return Py_BuildValue("NN", arr, arr_dims);
+}
+
+static PyObject *pixelILC_SHTSmoothing_Coarse(PyObject *TEBmaps, PyObject *nside, PyObject *a, PyObject *b, PyObject *Nfreqs, PyObject *ipix_arr, PyObject *Npixels, PyObject *nside_coarse, PyObject *Nthreads, PyObject *tol, PyObject *nest){
+	// the body of doNILC_SHTSmoothing_Coarse_SingleField and doCNILC_SHTSmoothing_Coarse_SingleField, b is NULL for the NILC
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int nside_c = (int) PyLong_AsLong(nside_coarse);
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	double tol_ = (tol == NULL) ? 0.0 : PyFloat_AsDouble(tol);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	double *a_ = PyArray_DATA(a);
+	double *b_ = (b == NULL) ? NULL : PyArray_DATA(b);
+	if (nside_c < 1 || nside_c > nside_map || (nside_c & (nside_c - 1)) != 0){
+		PyErr_SetString(PyExc_ValueError, "nside_coarse must be a power of two not above nside");
+		return NULL;
+	}
+
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	omp_set_num_threads(Nthreads_);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	// the total grows with the solves of every stage
+	progress_start(NULL, 0);
+	pixelILC_Run_SHTSmoothing_Coarse(arenas, Nthreads_, ipix_ptr, Npixels_, Nfreqs_, nside_map, nest_, nside_c, TEBmaps_, a_, b_, tol_, weights, &progress_state);
+	pixelILC_ArenasFree(arenas, Nthreads_);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doNILC_SHTSmoothing_Coarse_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// doNILC_SHTSmoothing_Coarse_SingleField(TEBmaps, nside, a, Nfreqs, ipix_arr, Npixels, nside_coarse, Nthreads, tol=0, nest=0)
+	// The NILC weights solved on the NEST grid of nside_coarse, see coarseNside, and interpolated to the pixels of
+	// ipix_arr, in RING unless nest is 1. With tol > 0 the cells of the coarse grid where the interpolation is off by
+	// more than tol, relative to the largest weight, are solved pixel by pixel. getStats() counts the solves as pixels.
+	// getProgress() counts the solves too. A cancel skips the tol check, and the pixels next to a coarse pixel which was
+	// not solved get NaN weights.
+	PyObject *TEBmaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *nside_coarse=NULL;
+	PyObject *Nthreads=NULL;
+	PyObject *tol=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOO|OO" , &TEBmaps, &nside, &a, &Nfreqs, &ipix_arr, &Npixels, &nside_coarse, &Nthreads, &tol, &nest)) return NULL;
+	return pixelILC_SHTSmoothing_Coarse(TEBmaps, nside, a, NULL, Nfreqs, ipix_arr, Npixels, nside_coarse, Nthreads, tol, nest);
+}
+
+static PyObject *doCNILC_SHTSmoothing_Coarse_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// doCNILC_SHTSmoothing_Coarse_SingleField(TEBmaps, nside, a, b, Nfreqs, ipix_arr, Npixels, nside_coarse, Nthreads, tol=0, nest=0)
+	// The CNILC version of doNILC_SHTSmoothing_Coarse_SingleField
+	PyObject *TEBmaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *b = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *nside_coarse=NULL;
+	PyObject *Nthreads=NULL;
+	PyObject *tol=NULL;
+	PyObject *nest=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO|OO" , &TEBmaps, &nside, &a, &b, &Nfreqs, &ipix_arr, &Npixels, &nside_coarse, &Nthreads, &tol, &nest)) return NULL;
+	return pixelILC_SHTSmoothing_Coarse(TEBmaps, nside, a, b, Nfreqs, ipix_arr, Npixels, nside_coarse, Nthreads, tol, nest);
+}
+
+static PyObject *coarseNside(PyObject *self, PyObject *args){
+	// coarseNside(nside, fwhm), the coarse grid for the windows of the given fwhm
+	PyObject *nside = NULL;
+	PyObject *fwhm = NULL;
+	if (!PyArg_ParseTuple(args, "OO" , &nside, &fwhm)) return NULL;
+	return PyLong_FromLong(pixelILC_CoarseNside((int) PyLong_AsLong(nside), PyFloat_AsDouble(fwhm)));
+}
+
+static PyObject *doNILC_SHTSmoothing_SingleField_pixpixcorr(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// CovarianceMaps will be a numpy array with the shape [npix,Nfreqs2]
+	// ipix_arr will be the array with all the pixel indices
+	// cbeta_arr will be 1000 values between -1 and 1, representing the cos(beta) where beta is the angular distance between 2 pixels
+	// Func will be a 2D array with shape [Nfreqs2,1000]
+	// vec_arr will be a 2D array with shape [3,12*nside**2] and it contains the unit vector pointing to all pixels in a map. We use it for cos(beta) = n1 dot n2
+	// a should be a vector with size Nfreqs*Npixels
+	PyObject *CovarianceMaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *cbeta_arr=NULL;
+	PyObject *Func=NULL;
+	PyObject *vec_arr=NULL;
+	PyObject *i_map=NULL;
+	PyObject *j_map=NULL;
+	
+	if (!PyArg_ParseTuple(args, "OOOOOOOOOOO" , &CovarianceMaps, &nside, &a, &Nfreqs, &ipix_arr, &Npixels, &cbeta_arr, &Func, &vec_arr, &i_map, &j_map))
+		return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long npix_map = 12L * nside_map * nside_map;
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *CovarianceMaps_ = PyArray_DATA(CovarianceMaps);
+	double *a_ = PyArray_DATA(a);
+	double *cbeta_arr_ = PyArray_DATA(cbeta_arr);
+	double *Func_ = PyArray_DATA(Func);
+	double *vec_arr_ = PyArray_DATA(vec_arr);
+	int *i_map_ = PyArray_DATA(i_map);
+	int *j_map_ = PyArray_DATA(j_map);
+	// This is for a single field
+	
+	// the dense matrices grow as Npixels^2, refuse before allocating them rather than run out of memory halfway
+	double memory_limit = pixelILC_CostMemoryLimit();
+	if (memory_limit > 0.0 && pixelILC_CostDenseBytes(Nfreqs_, Npixels_, nside_map) > memory_limit){
+		PyErr_Format(PyExc_MemoryError, "the dense covariance of %ld pixels needs %ld MB, more than the limit of %ld MB, see planStrategies", Npixels_, (long) (pixelILC_CostDenseBytes(Nfreqs_, Npixels_, nside_map)/1048576.0), (long) (memory_limit/1048576.0));
+		return NULL;
+	}
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
+	// the covariance matrix for the full map
+	gsl_matrix *Cov_matrix = gsl_matrix_calloc(Nfreqs_*Npixels_, Nfreqs_*Npixels_), *iCov_matrix = gsl_matrix_calloc(Nfreqs_*Npixels_, Nfreqs_*Npixels_) ;
+	gsl_matrix_set_zero(Cov_matrix);
+	gsl_matrix_set_zero(iCov_matrix);
+	
+	// the parallel block will parallelize over the combination of pixels 
+	STATS_TIC(t_stats);
+	long Npixels2 = Npixels_*(Npixels_+1)/2 ;
+	
+	// the progress counts one step per frequency pair filled, one for the inverse and one for the weights. The inverse
+	// is a single GSL call, so a cancel or Ctrl-C during it only takes effect once it is done.
+	progress_start(NULL, Nfreqs2 + 2);
+	int n,nn,c;
+	c = 0;
+	for(n=0;n<Nfreqs_;n++){
+		for(nn=n;nn<Nfreqs_;nn++){
+			if(progress_state.cancel){
+				c += 1;
+				continue;
+			}
+			#pragma omp parallel
+			{
+			long p;
+			long i_,j_ ;
+			double function[1000];
+			// do the interpolation for frequency pair n, nn
+			gsl_interp_accel *acc    = gsl_interp_accel_alloc ();
+			gsl_spline       *spline = gsl_spline_alloc(gsl_interp_cspline, 1000);
+			for(int mm=0;mm<1000;mm++) function[mm] = Func_[c * 1000 + mm];
+			gsl_spline_init (spline, cbeta_arr_, function, 1000);
+			
+			#pragma omp for schedule(static)
+			for(p=0;p<Npixels2;p++){
+				// p is a combination of 2 pixels being correlated p_i and p_j
+				i_ = i_map_[p];
+				j_ = j_map_[p];
+				long ipix_int_i = ipix_ptr[i_];
+				// if i=j, then we fill the diagonal term first
+				double vF;
+				if (i_ == j_){
+					// TEBmaps is a numpy array with shape npix_per_window,Nfreqs2 = Nfreqs*(Nfreqs+1)/2
+					vF = CovarianceMaps_[ipix_int_i*Nfreqs2 + c] ;
+					gsl_matrix_set(Cov_matrix, i_*Nfreqs_+n, j_*Nfreqs_+nn, vF );
+					if (n!=nn) gsl_matrix_set(Cov_matrix, i_*Nfreqs_+nn, j_*Nfreqs_+n, vF );
+				}
+				else{
+					// if not, then we should fill the other terms
+					long ipix_int_j = ipix_ptr[j_];
+					double cbeta_pair = 0.0;
+					for (int k=0;k<3;k++) cbeta_pair += vec_arr_[k*npix_map+ipix_int_i]*vec_arr_[k*npix_map+ipix_int_j];
+					// interpolate the value
+					vF = gsl_spline_eval(spline, cbeta_pair, acc);
+					gsl_matrix_set(Cov_matrix, i_*Nfreqs_+n, j_*Nfreqs_+nn, vF );
+					gsl_matrix_set(Cov_matrix, j_*Nfreqs_+n, i_*Nfreqs_+nn, vF );
+					gsl_matrix_set(Cov_matrix, i_*Nfreqs_+nn, j_*Nfreqs_+n, vF );
+					gsl_matrix_set(Cov_matrix, j_*Nfreqs_+nn, i_*Nfreqs_+n, vF );
+				}
+			}
+			gsl_spline_free (spline);
+			gsl_interp_accel_free (acc);
+			}
+			c += 1 ;
+			pixelILC_ProgressBlock(&progress_state, 1);
+		}
+	}
+	// the covariance matrix is filled, now I invert it
+	STATS_LAP(PILC_COVARIANCE, t_stats);
+	// a last look before the inverse, which takes most of the time
+	if(progress_poll(&progress_state)) progress_state.cancel = 1;
+	if(!progress_state.cancel){
+		invert_a_matrix(Cov_matrix, iCov_matrix, Nfreqs_*Npixels_ );
+		pixelILC_ProgressBlock(&progress_state, 1);
+	}
+	STATS_LAP(PILC_INVERT, t_stats);
+	// now calculate the weights
+	// shape of weights Npixels_*Nfreqs_
+	double aCia_F=0.0;
+	long i,j;
+	if(!progress_state.cancel){
+		for(i=0;i<Nfreqs_*Npixels_;i++){
+			for(j=0;j<Nfreqs_*Npixels_;j++){
+				aCia_F += a_[i] * gsl_matrix_get(iCov_matrix,i,j) * a_[j] ;
+			}
+		}
+		for(i=0;i<Nfreqs_*Npixels_;i++){
+			for(j=0;j<Nfreqs_*Npixels_;j++){
+				// This is the F weight
+				weights[i] += a_[j] * gsl_matrix_get(iCov_matrix,j,i) / aCia_F ;
+			}
+		}
+		pixelILC_ProgressBlock(&progress_state, 1);
+	}
+	// the weights need the whole inverse, a cancelled call has none
+	else for(i=0;i<Nfreqs_*Npixels_;i++) weights[i] = NAN;
+	// after this weights will have the calculated weights.
+	STATS_LAP(PILC_WEIGHTS, t_stats);
+	STATS_COUNT(PILC_PIXELS, Npixels_);
+	gsl_matrix_free(Cov_matrix);
+	gsl_matrix_free(iCov_matrix);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[1] = {Npixels_*Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(1,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doCNILC_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// TEB2maps will be a numpy array with the shape [Nfreqs2,npix]
+	// ipix_arr will be the array with all the pixel indices
+	//a will be an array with shape [Nfreqs] which contains the CMB SED (in RJ units)
+	//b will be an array with shape [Nfreqs] which contains the dust SED (in RJ units)
+	PyObject *TEBmaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *b = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *rank=NULL;
+	PyObject *field=NULL;
+	PyObject *Nthreads=NULL;
+	
+	if (!PyArg_ParseTuple(args, "OOOOOOOOOO" , &TEBmaps, &nside, &a, &b, &Nfreqs, &ipix_arr, &Npixels, &rank, &field, &Nthreads))
+		return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int rank_ = (int) PyLong_AsLong(rank);
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	double *a_ = PyArray_DATA(a);
+	double *b_ = PyArray_DATA(b);
+	// This is for a single field
+	
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	// TEBmaps rows are read by increasing pixel index, whatever order ipix_arr comes in
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
+	omp_set_num_threads(Nthreads_);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_CNILC_SHTSmoothing(&sched, arenas, ipix_ptr, Nfreqs_, TEBmaps_, a_, b_, weights);
+	pixelILC_ArenasFree(arenas, Nthreads_);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doCNILC_ThermalDust_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// TEB2maps will be a numpy array with the shape [Nfreqs2,npix]
+	// ipix_arr will be the array with all the pixel indices
+	//a will be an array with shape [Nfreqs] which contains the CMB SED (in thermo units)
+	//beta_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
+	//T_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
+	PyObject *TEBmaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *beta_dust_map = NULL;
+	PyObject *T_dust_map = NULL;
+	PyObject *freq_arr = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *rank=NULL;
+	PyObject *field=NULL;
+	PyObject *Nthreads=NULL;
+	
+	if (!PyArg_ParseTuple(args, "OOOOOOOOOOOO" , &TEBmaps, &nside, &a, &beta_dust_map, &T_dust_map, &freq_arr, &Nfreqs, &ipix_arr, &Npixels, &rank, &field, &Nthreads))
+		return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	double *freq_arr_ = PyArray_DATA(freq_arr);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int rank_ = (int) PyLong_AsLong(rank);
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	double *a_ = PyArray_DATA(a);
+	double *beta_dust_map_ = PyArray_DATA(beta_dust_map);
+	double *T_dust_map_ = PyArray_DATA(T_dust_map);
+	// This is for a single field
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	
+	double* thermo_2_rj = calloc(Nfreqs_,sizeof(double));
+	pixelILC_Thermo2RJ(freq_arr_, Nfreqs_, thermo_2_rj);
+	// TEBmaps rows are read by increasing pixel index, whatever order ipix_arr comes in
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
+	omp_set_num_threads(Nthreads_);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_CNILC_ThermalDust_SHTSmoothing(&sched, arenas, ipix_ptr, Nfreqs_, TEBmaps_, a_, beta_dust_map_, T_dust_map_, freq_arr_, thermo_2_rj, weights);
+	pixelILC_ArenasFree(arenas, Nthreads_);
+	free(thermo_2_rj);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doCNILC_ThermalDust_Synchrotron_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// TEB2maps will be a numpy array with the shape [Nfreqs2,npix]
+	// ipix_arr will be the array with all the pixel indices
+	//a will be an array with shape [Nfreqs] which contains the CMB SED (in thermo units)
+	//beta_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
+	//T_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
+	PyObject *TEBmaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *a = NULL;
+	PyObject *beta_dust_map = NULL;
+	PyObject *T_dust_map = NULL;
+	PyObject *beta_syn_map = NULL;
+	PyObject *freq_arr = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *rank=NULL;
+	PyObject *field=NULL;
+	PyObject *Nthreads=NULL;
+	
+	if (!PyArg_ParseTuple(args, "OOOOOOOOOOOOO" , &TEBmaps, &nside, &a, &beta_dust_map, &T_dust_map, &beta_syn_map, &freq_arr, &Nfreqs, &ipix_arr, &Npixels, &rank, &field, &Nthreads))
+		return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	double *freq_arr_ = PyArray_DATA(freq_arr);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int rank_ = (int) PyLong_AsLong(rank);
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	double *a_ = PyArray_DATA(a);
+	double *beta_dust_map_ = PyArray_DATA(beta_dust_map);
+	double *T_dust_map_ = PyArray_DATA(T_dust_map);
+	double *beta_syn_map_ = PyArray_DATA(beta_syn_map);
+	// This is for a single field
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	
+	double* thermo_2_rj = calloc(Nfreqs_,sizeof(double));
+	pixelILC_Thermo2RJ(freq_arr_, Nfreqs_, thermo_2_rj);
+	// TEBmaps rows are read by increasing pixel index, whatever order ipix_arr comes in
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	omp_set_num_threads(Nthreads_);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_CNILC_ThermalDust_Synchrotron_SHTSmoothing(&sched, arenas, ipix_ptr, Nfreqs_, TEBmaps_, a_, beta_dust_map_, T_dust_map_, beta_syn_map_, freq_arr_, thermo_2_rj, weights);
+	pixelILC_ArenasFree(arenas, Nthreads_);
+	free(thermo_2_rj);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+static PyObject *factorizeCovariance_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// Computes the Cholesky factor of the covariance of every pixel in ipix_arr once, so that the doNILC_Factorized_SingleField,
+	// doCNILC_Factorized_SingleField and doCNILC_ThermalDust_Factorized_SingleField calls that follow only do triangular solves.
+	// TEBmaps will be a numpy array with the shape [npix,Nfreqs2]
+	// The factors are returned as an array with shape [Npixels,Nfreqs2], row p belongs to ipix_arr[p] and is packed like a row of TEBmaps.
+	// factors is optional, a float64 array with that shape to fill instead of allocating one, e.g. a numpy.lib.format.open_memmap
+	// to keep the cache on disk. It can also be TEBmaps itself when ipix_arr is every pixel in order, to factorize in place.
+	// When the call is cancelled the rows not reached are NaN, or still the covariances when factorizing in place.
+	PyObject *TEBmaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *Nthreads=NULL;
+	PyObject *factors=NULL;
+	
+	if (!PyArg_ParseTuple(args, "OOOOOO|O" , &TEBmaps, &nside, &Nfreqs, &ipix_arr, &Npixels, &Nthreads, &factors))
+		return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double *U = (factors == NULL) ? malloc(Npixels_*Nfreqs2*sizeof(double)) : PyArray_DATA(factors);
+	// TEBmaps rows are read by increasing pixel index, whatever order ipix_arr comes in
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
+	omp_set_num_threads(Nthreads_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_Factorize(&sched, ipix_ptr, Nfreqs_, TEBmaps_, U);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		if(factors == NULL) free(U);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	PyObject *arr;
+	if(factors == NULL){
+		npy_intp npy_shape[2] = {Npixels_,Nfreqs2};
+		arr = PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, U);
+		PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	}
+	else{
+		Py_INCREF(factors);
+		arr = factors;
+	}
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *updateFactors_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+	// updateFactors_SHTSmoothing_SingleField(factors, TEBmaps, nside, Nfreqs, ipix_arr, Npixels, channel, Nthreads) updates
+	// in place the factors of factorizeCovariance_SHTSmoothing_SingleField after the entries of one channel changed in
+	// TEBmaps, by a rank 2 update of every factor. Returns the number of pixels which had to be factorized from scratch.
+	// A cancelled update leaves the factors not reached as they were, calling it again completes it.
+	PyObject *factors = NULL;
+	PyObject *TEBmaps = NULL;
+	PyObject *nside = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
+	PyObject *channel=NULL;
+	PyObject *Nthreads=NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOOO" , &factors, &TEBmaps, &nside, &Nfreqs, &ipix_arr, &Npixels, &channel, &Nthreads))
+		return NULL;
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	int channel_ = (int) PyLong_AsLong(channel);
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	long *ipix_ptr = PyArray_DATA(ipix_arr);
+	if (channel_ < 0 || channel_ >= Nfreqs_){
+		PyErr_SetString(PyExc_ValueError, "channel must be between 0 and Nfreqs-1");
+		return NULL;
+	}
+
+	pixelILC_stats_reset(Nthreads_);
+	long refactorized;
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	omp_set_num_threads(Nthreads_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_UpdateFactors_Channel(&sched, ipix_ptr, Nfreqs_, PyArray_DATA(TEBmaps), channel_, PyArray_DATA(factors), &refactorized);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0) return NULL;
+	return PyLong_FromLong(refactorized);
+}
+
+static PyObject *doNILC_Factorized_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// Same weights as doNILC_SHTSmoothing_SingleField, from the factors of factorizeCovariance_SHTSmoothing_SingleField
+	//a will be an array with shape [Nfreqs] which contains the CMB SED (in RJ units)
+	PyObject *factors = NULL;
+	PyObject *a = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *Npixels=NULL;
+	PyObject *Nthreads=NULL;
+	
+	if (!PyArg_ParseTuple(args, "OOOOO" , &factors, &a, &Nfreqs, &Npixels, &Nthreads))
+		return NULL;
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long Nblocks = (Npixels_ + PIXELILC_BLOCK_SIZE_MAX - 1) / PIXELILC_BLOCK_SIZE_MAX;
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	double *U = PyArray_DATA(factors);
+	double *a_ = PyArray_DATA(a);
+	
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
+	omp_set_num_threads(Nthreads_);
+	progress_start(NULL, Npixels_);
+	#pragma omp parallel
+	{
+	double *work = malloc(Nfreqs_*sizeof(double));
+	long blk, p;
+	// the factors are stored by p, so every thread streams through a contiguous part of them, a block at a time
+	#pragma omp for schedule(static)
+	for(blk=0;blk<Nblocks;blk++){
+		long end = (blk+1)*PIXELILC_BLOCK_SIZE_MAX < Npixels_ ? (blk+1)*PIXELILC_BLOCK_SIZE_MAX : Npixels_;
+		if(progress_state.cancel){
+			for(p=blk*PIXELILC_BLOCK_SIZE_MAX*Nfreqs_;p<end*Nfreqs_;p++) weights[p] = NAN;
+			continue;
+		}
+		for(p=blk*PIXELILC_BLOCK_SIZE_MAX;p<end;p++){
+			STATS_TIC(t_stats);
+			pixelILC_CalculateILCWeight_NILC_Factorized(a_,&U[p*Nfreqs2],weights,Nfreqs_,p,work);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		pixelILC_ProgressBlock(&progress_state, end - blk*PIXELILC_BLOCK_SIZE_MAX);
+	}
+	free(work);
+	}
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doCNILC_Factorized_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// Same weights as doCNILC_SHTSmoothing_SingleField, from the factors of factorizeCovariance_SHTSmoothing_SingleField
+	//a will be an array with shape [Nfreqs] which contains the CMB SED (in RJ units)
+	//b will be an array with shape [Nfreqs] which contains the dust SED (in RJ units)
+	PyObject *factors = NULL;
+	PyObject *a = NULL;
+	PyObject *b = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *Npixels=NULL;
+	PyObject *Nthreads=NULL;
+	
+	if (!PyArg_ParseTuple(args, "OOOOOO" , &factors, &a, &b, &Nfreqs, &Npixels, &Nthreads))
+		return NULL;
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long Nblocks = (Npixels_ + PIXELILC_BLOCK_SIZE_MAX - 1) / PIXELILC_BLOCK_SIZE_MAX;
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
+	double *U = PyArray_DATA(factors);
+	double *a_ = PyArray_DATA(a);
+	double *b_ = PyArray_DATA(b);
+	
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
+	omp_set_num_threads(Nthreads_);
+	progress_start(NULL, Npixels_);
+	#pragma omp parallel
+	{
+	double *work = malloc(2*Nfreqs_*sizeof(double));
+	long blk, p;
+	#pragma omp for schedule(static)
+	for(blk=0;blk<Nblocks;blk++){
+		long end = (blk+1)*PIXELILC_BLOCK_SIZE_MAX < Npixels_ ? (blk+1)*PIXELILC_BLOCK_SIZE_MAX : Npixels_;
+		if(progress_state.cancel){
+			for(p=blk*PIXELILC_BLOCK_SIZE_MAX*Nfreqs_;p<end*Nfreqs_;p++) weights[p] = NAN;
+			continue;
+		}
+		for(p=blk*PIXELILC_BLOCK_SIZE_MAX;p<end;p++){
+			STATS_TIC(t_stats);
+			pixelILC_CalculateILCWeight_CNILC_Factorized(a_,b_,&U[p*Nfreqs2],weights,Nfreqs_,p,work);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		pixelILC_ProgressBlock(&progress_state, end - blk*PIXELILC_BLOCK_SIZE_MAX);
+	}
+	free(work);
+	}
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *doCNILC_ThermalDust_Factorized_SingleField(PyObject *self, PyObject *args){
+	/* Getting the elements */
+	// Same weights as doCNILC_ThermalDust_SHTSmoothing_SingleField, from the factors of factorizeCovariance_SHTSmoothing_SingleField
+	// ipix_arr must be the one the factors were computed with, it is only used to read the dust maps
+	//a will be an array with shape [Nfreqs] which contains the CMB SED (in thermo units)
+	//beta_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
+	//T_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
+	PyObject *factors = NULL;
+	PyObject *a = NULL;
+	PyObject *beta_dust_map = NULL;
+	PyObject *T_dust_map = NULL;
+	PyObject *freq_arr = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr=NULL;
+	PyObject *Npixels=NULL;
 	PyObject *Nthreads=NULL;
 	
-	if (!PyArg_ParseTuple(args, "OOOOOOOOO" , &TEBmaps, &nside, &a, &Nfreqs, &ipix_arr, &Npixels, &rank, &field, &Nthreads))
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO" , &factors, &a, &beta_dust_map, &T_dust_map, &freq_arr, &Nfreqs, &ipix_arr, &Npixels, &Nthreads))
 		return NULL;
-	int nside_map = (int) PyLong_AsLong(nside);
+	double *freq_arr_ = PyArray_DATA(freq_arr);
 	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
 	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
 	long Npixels_ = (long) PyLong_AsLong(Npixels);
-	int rank_ = (int) PyLong_AsLong(rank);
+	long Nblocks = (Npixels_ + PIXELILC_BLOCK_SIZE_MAX - 1) / PIXELILC_BLOCK_SIZE_MAX;
 	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
 	long *ipix_ptr = PyArray_DATA(ipix_arr);
-	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	double *U = PyArray_DATA(factors);
 	double *a_ = PyArray_DATA(a);
-	// We dont need the fwhm anymore, because it is implicit in the TEB2maps 
-	// This is for a single field
-	
+	double *beta_dust_map_ = PyArray_DATA(beta_dust_map);
+	double *T_dust_map_ = PyArray_DATA(T_dust_map);
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
 	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
 	
+	double* thermo_2_rj = calloc(Nfreqs_,sizeof(double));
+	pixelILC_Thermo2RJ(freq_arr_, Nfreqs_, thermo_2_rj);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	
 	omp_set_num_threads(Nthreads_);
+	progress_start(NULL, Npixels_);
 	#pragma omp parallel
 	{
-	gsl_matrix *CovF = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	gsl_matrix *CovFi = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	int p;
+	double *work = malloc(2*Nfreqs_*sizeof(double));
+	double* b_ = calloc(Nfreqs_,sizeof(double));
+	long blk, p;
 	#pragma omp for schedule(static)
-	for(p=0;p<Npixels_;p++){
-		if(p%1000000==0){
-			// print only every 1 million pixels
-			//printf("Rank %i is working on pixel number %i of %i\n",rank_,p,Npixels_);
+	for(blk=0;blk<Nblocks;blk++){
+		long end = (blk+1)*PIXELILC_BLOCK_SIZE_MAX < Npixels_ ? (blk+1)*PIXELILC_BLOCK_SIZE_MAX : Npixels_;
+		if(progress_state.cancel){
+			for(p=blk*PIXELILC_BLOCK_SIZE_MAX*Nfreqs_;p<end*Nfreqs_;p++) weights[p] = NAN;
+			continue;
 		}
-		// This is the index of the pixel to process
-		long ipix = ipix_ptr[p];
-		//printf("Working on pixel %i\n",ipix);
-		// Cov is a gsl_matrix and has shape [Nfreqs,Nfreqs] with indices n,nn
-		// I need 3 of them, for T,E,B
-		// I need to make sure to empty their content from the previous iteration
-		gsl_matrix_set_zero(CovF);
-		gsl_matrix_set_zero(CovFi);
-		pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs_, TEBmaps_, CovF, Nfreqs2);
-		// Now we need to invert the Cov matrices
-		invert_a_matrix(CovF,CovFi,Nfreqs_);
-		pixelILC_CalculateILCWeight_NILC_SingleField(a_,CovFi,weights,Nfreqs_,p);
-	}
-	gsl_matrix_free(CovF);
-	gsl_matrix_free(CovFi);
+		for(p=blk*PIXELILC_BLOCK_SIZE_MAX;p<end;p++){
+			long ipix = ipix_ptr[p];
+			STATS_TIC(t_stats);
+			// calculate the b vector with the Thermal dust SED
+			for(int nn=0;nn<Nfreqs_;nn++){
+				double x_d_nu = H_PLANCK * freq_arr_[nn] * 1.e9 / ( K_BOLTZ * T_dust_map_[ipix] );
+				b_[nn] = pow(freq_arr_[nn],beta_dust_map_[ipix]+1.0)/(exp(x_d_nu)-1.0) / thermo_2_rj[nn]  ;
+			}
+			pixelILC_CalculateILCWeight_CNILC_Factorized(a_,b_,&U[p*Nfreqs2],weights,Nfreqs_,p,work);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		pixelILC_ProgressBlock(&progress_state, end - blk*PIXELILC_BLOCK_SIZE_MAX);
+	}
+	free(work);
+	free(b_);
 	}
+	free(thermo_2_rj);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
 	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
 	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
 	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	return(arr);
 }
-
-static PyObject *doNILC_SHTSmoothing_SingleField_pixpixcorr(PyObject *self, PyObject *args){
+static PyObject *doNILC_SHTSmoothing_SingleField_float(PyObject *self, PyObject *args){
 	/* Getting the elements */
-	// CovarianceMaps will be a numpy array with the shape [npix,Nfreqs2]
-	// ipix_arr will be the array with all the pixel indices
-	// cbeta_arr will be 1000 values between -1 and 1, representing the cos(beta) where beta is the angular distance between 2 pixels
-	// Func will be a 2D array with shape [Nfreqs2,1000]
-	// vec_arr will be a 2D array with shape [3,12*nside**2] and it contains the unit vector pointing to all pixels in a map. We use it for cos(beta) = n1 dot n2
-	// a should be a vector with size Nfreqs*Npixels
-	PyObject *CovarianceMaps = NULL;
+	// Same arguments as doNILC_SHTSmoothing_SingleField, with TEBmaps a float32 array. The weights are float32
+	PyObject *TEBmaps = NULL;
 	PyObject *nside = NULL;
 	PyObject *a = NULL;
 	PyObject *Nfreqs = NULL;
 	PyObject *ipix_arr=NULL;
 	PyObject *Npixels=NULL;
-	PyObject *cbeta_arr=NULL;
-	PyObject *Func=NULL;
-	PyObject *vec_arr=NULL;
-	PyObject *i_map=NULL;
-	PyObject *j_map=NULL;
+	PyObject *rank=NULL;
+	PyObject *field=NULL;
+	PyObject *Nthreads=NULL;
 	
-	if (!PyArg_ParseTuple(args, "OOOOOOOOOOO" , &CovarianceMaps, &nside, &a, &Nfreqs, &ipix_arr, &Npixels, &cbeta_arr, &Func, &vec_arr, &i_map, &j_map))
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO" , &TEBmaps, &nside, &a, &Nfreqs, &ipix_arr, &Npixels, &rank, &field, &Nthreads))
 		return NULL;
 	int nside_map = (int) PyLong_AsLong(nside);
 	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
-	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
 	long Npixels_ = (long) PyLong_AsLong(Npixels);
-	int npix_map = 12 * nside_map * nside_map;
+	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
 	long *ipix_ptr = PyArray_DATA(ipix_arr);
-	double *CovarianceMaps_ = PyArray_DATA(CovarianceMaps);
+	float *TEBmaps_ = PyArray_DATA(TEBmaps);
 	double *a_ = PyArray_DATA(a);
-	double *cbeta_arr_ = PyArray_DATA(cbeta_arr);
-	double *Func_ = PyArray_DATA(Func);
-	double *vec_arr_ = PyArray_DATA(vec_arr);
-	int *i_map_ = PyArray_DATA(i_map);
-	int *j_map_ = PyArray_DATA(j_map);
-	// This is for a single field
-	
-	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
-	
-	// the covariance matrix for the full map
-	gsl_matrix *Cov_matrix = gsl_matrix_calloc(Nfreqs_*Npixels_, Nfreqs_*Npixels_), *iCov_matrix = gsl_matrix_calloc(Nfreqs_*Npixels_, Nfreqs_*Npixels_) ;
-	gsl_matrix_set_zero(Cov_matrix);
-	gsl_matrix_set_zero(iCov_matrix);
 	
-	// the parallel block will parallelize over the combination of pixels 
-	long Npixels2 = Npixels_*(Npixels_+1)/2 ;
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	float* weights = calloc(Npixels_*Nfreqs_,sizeof(float));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	
-	int n,nn,c;
-	c = 0;
-	for(n=0;n<Nfreqs_;n++){
-		for(nn=n;nn<Nfreqs_;nn++){
-			#pragma omp parallel
-			{
-			long p;
-			int i_,j_ ;
-			double function[1000];
-			// do the interpolation for frequency pair n, nn
-			gsl_interp_accel *acc    = gsl_interp_accel_alloc ();
-			gsl_spline       *spline = gsl_spline_alloc(gsl_interp_cspline, 1000);
-			for(int mm=0;mm<1000;mm++) function[mm] = Func_[c * 1000 + mm];
-			gsl_spline_init (spline, cbeta_arr_, function, 1000);
-			
-			#pragma omp for schedule(static)
-			for(p=0;p<Npixels2;p++){
-				// p is a combination of 2 pixels being correlated p_i and p_j
-				i_ = i_map_[p];
-				j_ = j_map_[p];
-				int ipix_int_i = (int) ipix_ptr[i_];
-				// if i=j, then we fill the diagonal term first
-				double vF;
-				if (i_ == j_){
-					// TEBmaps is a numpy array with shape npix_per_window,Nfreqs2 = Nfreqs*(Nfreqs+1)/2
-					vF = CovarianceMaps_[ipix_int_i*Nfreqs2 + c] ;
-					gsl_matrix_set(Cov_matrix, i_*Nfreqs_+n, j_*Nfreqs_+nn, vF );
-					if (n!=nn) gsl_matrix_set(Cov_matrix, i_*Nfreqs_+nn, j_*Nfreqs_+n, vF );
-				}
-				else{
-					// if not, then we should fill the other terms
-					int ipix_int_j = (int) ipix_ptr[j_];
-					double cbeta_pair = 0.0;
-					for (int k=0;k<3;k++) cbeta_pair += vec_arr_[k*npix_map+ipix_int_i]*vec_arr_[k*npix_map+ipix_int_j];
-					// interpolate the value
-					vF = gsl_spline_eval(spline, cbeta_pair, acc);
-					gsl_matrix_set(Cov_matrix, i_*Nfreqs_+n, j_*Nfreqs_+nn, vF );
-					gsl_matrix_set(Cov_matrix, j_*Nfreqs_+n, i_*Nfreqs_+nn, vF );
-					gsl_matrix_set(Cov_matrix, i_*Nfreqs_+nn, j_*Nfreqs_+n, vF );
-					gsl_matrix_set(Cov_matrix, j_*Nfreqs_+nn, i_*Nfreqs_+n, vF );
-				}
-			}
-			gsl_spline_free (spline);
-			gsl_interp_accel_free (acc);
-			}
-			c += 1 ;
-		}
-	}
-	// the covariance matrix is filled, now I invert it
-	invert_a_matrix(Cov_matrix, iCov_matrix, Nfreqs_*Npixels_ );
-	// now calculate the weights
-	// shape of weights Npixels_*Nfreqs_
-	double aCia_F=0.0;
-	int i,j;
-	for(i=0;i<Nfreqs_*Npixels_;i++){
-		for(j=0;j<Nfreqs_*Npixels_;j++){
-			aCia_F += a_[i] * gsl_matrix_get(iCov_matrix,i,j) * a_[j] ;
-		}
-	}
-	for(i=0;i<Nfreqs_*Npixels_;i++){
-		for(j=0;j<Nfreqs_*Npixels_;j++){
-			// This is the F weight
-			weights[i] += a_[j] * gsl_matrix_get(iCov_matrix,j,i) / aCia_F ;
-		}
+	omp_set_num_threads(Nthreads_);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_SHTSmoothing_float(&sched, arenas, ipix_ptr, Nfreqs_, TEBmaps_, a_, weights);
+	pixelILC_ArenasFree(arenas, Nthreads_);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
 	}
-	// after this weights will have the calculated weights.
-	gsl_matrix_free(Cov_matrix);
-	gsl_matrix_free(iCov_matrix);
-	npy_intp npy_shape[1] = {Npixels_*Nfreqs_};
-	PyObject *arr 		= PyArray_SimpleNewFromData(1,npy_shape, NPY_DOUBLE, weights);
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_FLOAT32, weights);
 	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	return(arr);
 }
 
-static PyObject *doCNILC_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+static PyObject *doCNILC_SHTSmoothing_SingleField_float(PyObject *self, PyObject *args){
 	/* Getting the elements */
-	// TEB2maps will be a numpy array with the shape [Nfreqs2,npix]
-	// ipix_arr will be the array with all the pixel indices
-	//a will be an array with shape [Nfreqs] which contains the CMB SED (in RJ units)
-	//b will be an array with shape [Nfreqs] which contains the dust SED (in RJ units)
+	// Same arguments as doCNILC_SHTSmoothing_SingleField, with TEBmaps a float32 array. The weights are float32
 	PyObject *TEBmaps = NULL;
 	PyObject *nside = NULL;
 	PyObject *a = NULL;
@@ -276,60 +1545,41 @@ static PyObject *doCNILC_SHTSmoothing_SingleField(PyObject *self, PyObject *args
 		return NULL;
 	int nside_map = (int) PyLong_AsLong(nside);
 	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
-	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
 	long Npixels_ = (long) PyLong_AsLong(Npixels);
-	int rank_ = (int) PyLong_AsLong(rank);
 	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
 	long *ipix_ptr = PyArray_DATA(ipix_arr);
-	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	float *TEBmaps_ = PyArray_DATA(TEBmaps);
 	double *a_ = PyArray_DATA(a);
 	double *b_ = PyArray_DATA(b);
-	// This is for a single field
 	
-	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	float* weights = calloc(Npixels_*Nfreqs_,sizeof(float));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	
 	omp_set_num_threads(Nthreads_);
-	#pragma omp parallel
-	{
-	gsl_matrix *CovF = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	gsl_matrix *CovFi = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	int p;
-	#pragma omp for schedule(static)
-	for(p=0;p<Npixels_;p++){
-		if(p%1000000==0){
-			// print only every 1 million pixels
-			//printf("Rank %i is working on pixel number %i of %i\n",rank_,p,Npixels_);
-		}
-		// This is the index of the pixel to process
-		long ipix = ipix_ptr[p];
-		//printf("Working on pixel %i\n",ipix);
-		// Cov is a gsl_matrix and has shape [Nfreqs,Nfreqs] with indices n,nn
-		// I need 3 of them, for T,E,B
-		// I need to make sure to empty their content from the previous iteration
-		gsl_matrix_set_zero(CovF);
-		gsl_matrix_set_zero(CovFi);
-		pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs_, TEBmaps_, CovF, Nfreqs2);
-		// Now we need to invert the Cov matrices
-		invert_a_matrix(CovF,CovFi,Nfreqs_);
-		//pixelILC_CalculateILCWeight_NILC_SingleField(a_,CovFi,weights,Nfreqs_,p);
-		pixelILC_CalculateILCWeight_CNILC_SingleField(a_,b_,CovFi,weights,Nfreqs_,p);
-	}
-	gsl_matrix_free(CovF);
-	gsl_matrix_free(CovFi);
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_CNILC_SHTSmoothing_float(&sched, arenas, ipix_ptr, Nfreqs_, TEBmaps_, a_, b_, weights);
+	pixelILC_ArenasFree(arenas, Nthreads_);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
 	}
+	STATS_START(t_marshal);
 	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
-	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_FLOAT32, weights);
 	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	return(arr);
 }
 
-static PyObject *doCNILC_ThermalDust_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+static PyObject *doCNILC_ThermalDust_SHTSmoothing_SingleField_float(PyObject *self, PyObject *args){
 	/* Getting the elements */
-	// TEB2maps will be a numpy array with the shape [Nfreqs2,npix]
-	// ipix_arr will be the array with all the pixel indices
-	//a will be an array with shape [Nfreqs] which contains the CMB SED (in thermo units)
-	//beta_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
-	//T_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
+	// Same arguments as doCNILC_ThermalDust_SHTSmoothing_SingleField, with TEBmaps a float32 array. The weights are float32
 	PyObject *TEBmaps = NULL;
 	PyObject *nside = NULL;
 	PyObject *a = NULL;
@@ -348,183 +1598,321 @@ static PyObject *doCNILC_ThermalDust_SHTSmoothing_SingleField(PyObject *self, Py
 	int nside_map = (int) PyLong_AsLong(nside);
 	double *freq_arr_ = PyArray_DATA(freq_arr);
 	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
-	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
 	long Npixels_ = (long) PyLong_AsLong(Npixels);
-	int rank_ = (int) PyLong_AsLong(rank);
 	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
 	long *ipix_ptr = PyArray_DATA(ipix_arr);
-	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	float *TEBmaps_ = PyArray_DATA(TEBmaps);
 	double *a_ = PyArray_DATA(a);
 	double *beta_dust_map_ = PyArray_DATA(beta_dust_map);
 	double *T_dust_map_ = PyArray_DATA(T_dust_map);
-	// This is for a single field
-	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
-	
+	pixelILC_stats_reset(Nthreads_);
+	STATS_TIC(t_marshal);
+	float* weights = calloc(Npixels_*Nfreqs_,sizeof(float));
 	double* thermo_2_rj = calloc(Nfreqs_,sizeof(double));
-	for(int n=0;n<Nfreqs_;n++){
-		double x_cmb = H_PLANCK * freq_arr_[n] * 1.0e9 / (K_BOLTZ*T_CMB) ;
-		thermo_2_rj[n] = pow(x_cmb,2) * exp(x_cmb) / pow(exp(x_cmb) - 1.0,2) ; // multiplying by this factor transform thermo 2 RJ units, divide for the reverse conversion
-	}
+	pixelILC_Thermo2RJ(freq_arr_, Nfreqs_, thermo_2_rj);
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 0, 0, Nthreads_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	
 	omp_set_num_threads(Nthreads_);
-	#pragma omp parallel
-	{
-	gsl_matrix *CovF = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	gsl_matrix *CovFi = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	double* b_ = calloc(Nfreqs_,sizeof(double));
-	int p;
-	#pragma omp for schedule(static)
-	for(p=0;p<Npixels_;p++){
-		if(p%1000000==0){
-			// print only every 1 million pixels
-			//printf("Rank %i is working on pixel number %i of %i\n",rank_,p,Npixels_);
-		}
-		// This is the index of the pixel to process
-		long ipix = ipix_ptr[p];
-		// Cov is a gsl_matrix and has shape [Nfreqs,Nfreqs] with indices n,nn
-		// I need 3 of them, for T,E,B
-		// I need to make sure to empty their content from the previous iteration
-		gsl_matrix_set_zero(CovF);
-		gsl_matrix_set_zero(CovFi);
-		pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs_, TEBmaps_, CovF, Nfreqs2);
-		// Now we need to invert the Cov matrices
-		invert_a_matrix(CovF,CovFi,Nfreqs_);
-		// calculate the b vector with the Thermal dust SED
-		for(int nn=0;nn<Nfreqs_;nn++){
-			double x_d_nu = H_PLANCK * freq_arr_[nn] * 1.e9 / ( K_BOLTZ * T_dust_map_[ipix] );
-			b_[nn] = pow(freq_arr_[nn],beta_dust_map_[ipix]+1.0)/(exp(x_d_nu)-1.0) / thermo_2_rj[nn]  ;
-		}
-		pixelILC_CalculateILCWeight_CNILC_SingleField(a_,b_,CovFi,weights,Nfreqs_,p);
-	}
-	gsl_matrix_free(CovF);
-	gsl_matrix_free(CovFi);
-	free(b_);
-	}
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(Nthreads_, Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_CNILC_ThermalDust_SHTSmoothing_float(&sched, arenas, ipix_ptr, Nfreqs_, TEBmaps_, a_, beta_dust_map_, T_dust_map_, freq_arr_, thermo_2_rj, weights);
+	pixelILC_ArenasFree(arenas, Nthreads_);
 	free(thermo_2_rj);
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
+	}
+	STATS_START(t_marshal);
 	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
-	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_FLOAT32, weights);
 	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	return(arr);
 }
 
-static PyObject *doCNILC_ThermalDust_Synchrotron_SHTSmoothing_SingleField(PyObject *self, PyObject *args){
+static PyObject *doNILC_CovarPixelSpace_SingleField_float(PyObject *self, PyObject *args){
 	/* Getting the elements */
-	// TEB2maps will be a numpy array with the shape [Nfreqs2,npix]
-	// ipix_arr will be the array with all the pixel indices
-	//a will be an array with shape [Nfreqs] which contains the CMB SED (in thermo units)
-	//beta_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
-	//T_dust_map is the map of beta_dust, in the same pixelization as TEB2maps
-	PyObject *TEBmaps = NULL;
+	// Same arguments as doNILC_CovarPixelSpace_SingleField, with Covar_maps, Field_filtered_map and Mask float32 arrays.
+	// The weights are float32
+	PyObject *Covar_maps = NULL;
+	PyObject *Field_filtered_map = NULL;
+	PyObject *Mask = NULL;
 	PyObject *nside = NULL;
 	PyObject *a = NULL;
-	PyObject *beta_dust_map = NULL;
-	PyObject *T_dust_map = NULL;
-	PyObject *beta_syn_map = NULL;
-	PyObject *freq_arr = NULL;
+	PyObject *fwhm = NULL;
 	PyObject *Nfreqs = NULL;
 	PyObject *ipix_arr=NULL;
 	PyObject *Npixels=NULL;
-	PyObject *rank=NULL;
-	PyObject *field=NULL;
-	PyObject *Nthreads=NULL;
-	
-	if (!PyArg_ParseTuple(args, "OOOOOOOOOOOOO" , &TEBmaps, &nside, &a, &beta_dust_map, &T_dust_map, &beta_syn_map, &freq_arr, &Nfreqs, &ipix_arr, &Npixels, &rank, &field, &Nthreads))
-		return NULL;
+	PyObject *nest=NULL; // optional, 1 if the maps and ipix_arr are in NEST ordering, RING by default
+	if (!PyArg_ParseTuple(args, "OOOOOOOOO|O" , &Covar_maps, &Field_filtered_map, &Mask, &nside, &a, &fwhm, &Nfreqs, &ipix_arr, &Npixels, &nest)) return NULL;
+
 	int nside_map = (int) PyLong_AsLong(nside);
-	double *freq_arr_ = PyArray_DATA(freq_arr);
 	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
-	int Nfreqs2 = (int) Nfreqs_*(Nfreqs_+1)/2;
 	long Npixels_ = (long) PyLong_AsLong(Npixels);
-	int rank_ = (int) PyLong_AsLong(rank);
-	int Nthreads_ = (int) PyLong_AsLong(Nthreads);
 	long *ipix_ptr = PyArray_DATA(ipix_arr);
-	double *TEBmaps_ = PyArray_DATA(TEBmaps);
+	float *Covar_maps_ = PyArray_DATA(Covar_maps);
+	float *Field_filtered_map_ = PyArray_DATA(Field_filtered_map);
+	float *Mask_ = PyArray_DATA(Mask);
 	double *a_ = PyArray_DATA(a);
-	double *beta_dust_map_ = PyArray_DATA(beta_dust_map);
-	double *T_dust_map_ = PyArray_DATA(T_dust_map);
-	double *beta_syn_map_ = PyArray_DATA(beta_syn_map);
-	// This is for a single field
-	double* weights = calloc(Npixels_*Nfreqs_,sizeof(double));
+	double fwhm_ = PyFloat_AsDouble(fwhm);
+	int nest_ = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	pixelILC_stats_reset(omp_get_max_threads());
+	STATS_TIC(t_marshal);
+	float* weights = calloc(Npixels_*Nfreqs_,sizeof(float));
+	pixelILC_schedule sched;
+	pixelILC_ScheduleInit(&sched, ipix_ptr, Npixels_, nside_map, 1, nest_, omp_get_max_threads());
+	pixelILC_ScheduleDiscCost(&sched, ipix_ptr, nside_map, nest_, 0.5*fwhm_);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
 	
-	double* thermo_2_rj = calloc(Nfreqs_,sizeof(double));
-	for(int n=0;n<Nfreqs_;n++){
-		double x_cmb = H_PLANCK * freq_arr_[n] * 1.0e9 / (K_BOLTZ*T_CMB) ;
-		thermo_2_rj[n] = pow(x_cmb,2) * exp(x_cmb) / pow(exp(x_cmb) - 1.0,2) ; // multiplying by this factor transform thermo 2 RJ units, divide for the reverse conversion
+	pixelILC_arena *arenas = pixelILC_ArenasAlloc(omp_get_max_threads(), Nfreqs_);
+	progress_start(&sched, Npixels_);
+	pixelILC_Run_NILC_CovarPixelSpace_float(&sched, arenas, ipix_ptr, Nfreqs_, nside_map, nest_, fwhm_, Covar_maps_, Field_filtered_map_, Mask_, NULL, NULL, NULL, 12L*nside_map*nside_map, a_, weights);
+	pixelILC_ArenasFree(arenas, omp_get_max_threads());
+	pixelILC_ScheduleFree(&sched);
+	if(progress_stop() < 0){
+		free(weights);
+		return NULL;
 	}
-	// this follows the nomencleture of arxiv:2006.0862
-	omp_set_num_threads(Nthreads_);
-	#pragma omp parallel
-	{
-	gsl_matrix *CovF = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	gsl_matrix *CovFi = gsl_matrix_calloc(Nfreqs_, Nfreqs_);
-	gsl_matrix *A = gsl_matrix_calloc(Nfreqs_, 3); // the 3 is because we do CMB, dust, syn
-	gsl_matrix *first = gsl_matrix_calloc(Nfreqs_, 3), *second=gsl_matrix_calloc(3, 3), *second_i=gsl_matrix_calloc(3, 3), *third=gsl_matrix_calloc(3, Nfreqs_), *fourth=gsl_matrix_calloc(3, Nfreqs_), *fifth=gsl_matrix_calloc(1, Nfreqs_) ;
-	gsl_matrix *e_t = gsl_matrix_calloc(1,3);
-	gsl_matrix_set(e_t,0,0,1.0); gsl_matrix_set(e_t,0,1,0.0); gsl_matrix_set(e_t,0,2,0.0);
-	//double* b_ = calloc(Nfreqs_,sizeof(double));
-	int p;
-	#pragma omp for schedule(static)
-	for(p=0;p<Npixels_;p++){
-		if(p%1000000==0){
-			// print only every 1 million pixels
-			//printf("Rank %i is working on pixel number %i of %i\n",rank_,p,Npixels_);
-		}
-		// This is the index of the pixel to process
-		long ipix = ipix_ptr[p];
-		// Cov is a gsl_matrix and has shape [Nfreqs,Nfreqs] with indices n,nn
-		// I need 3 of them, for T,E,B
-		// I need to make sure to empty their content from the previous iteration
-		//gsl_matrix_set_zero(CovF); gsl_matrix_set_zero(CovFi); 
-		pixelILC_DefineCovMat_NILC_SHTSmoothing_SingleField(ipix, Nfreqs_, TEBmaps_, CovF, Nfreqs2);
-		// we need to fill the A matrix
-		for(int nn=0;nn<Nfreqs_;nn++){
-			gsl_matrix_set(A,nn,0,1.0) ;
-			double x_d_nu = H_PLANCK * freq_arr_[nn] * 1.e9 / ( K_BOLTZ * T_dust_map_[ipix] );
-			gsl_matrix_set(A,nn,1,pow(freq_arr_[nn],beta_dust_map_[ipix]+1.0)/(exp(x_d_nu)-1.0) / thermo_2_rj[nn]) ; // this is dust
-			gsl_matrix_set(A,nn,2,pow(freq_arr_[nn],beta_syn_map_[ipix])/thermo_2_rj[nn] ) ; // this is syn
-		}
-		// Now we need to invert the Cov matrices
-		invert_a_matrix(CovF,CovFi,Nfreqs_);
-		// multiply C^-1 with A, which is a Nfreqs x 3 size matrix. this is called first
-		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, CovFi, A, 0.0, first);
-		// now multiply A_t and first, which is size (3,3), this is second
-		gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, A, first, 0.0, second);
-		// now we need to invert the matrix second
-		invert_a_matrix(second,second_i,3);
-		// we need to multiply A_t with C^-1, which is size (3,Nfreq) and we call it third
-		gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, A, CovFi, 0.0, third);
-		//for(int nn=0;nn<Nfreqs_;nn++) printf("third %.4f %.4f %.4f \n",gsl_matrix_get(third,0,nn),gsl_matrix_get(third,1,nn),gsl_matrix_get(third,2,nn)) ;
-		// we need to multiply second_i and third, which is size (3,Nfreq) and we call it fourth
-		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, second_i, third, 0.0, fourth);
-		// we need to multiply e_t and fourth, which is size (1,Nfreq) and we call it fifth
-		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, e_t, fourth, 0.0, fifth);
-		// fifth is a matrix that contains the weights
-		for(int nn=0;nn<Nfreqs_;nn++){
-			weights[p*Nfreqs_ + nn] = gsl_matrix_get(fifth,0,nn);
-			//printf("weight for freq %i = %.2f \n",nn,weights[p*Nfreqs_ + nn]);
-		} 
-	}
-	gsl_matrix_free(CovF);
-	gsl_matrix_free(CovFi);
-	gsl_matrix_free(first);gsl_matrix_free(second);gsl_matrix_free(second_i);gsl_matrix_free(third);gsl_matrix_free(fourth);gsl_matrix_free(fifth);
-	gsl_matrix_free(A);gsl_matrix_free(e_t);
-	//free(b_);
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_FLOAT32, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+static PyObject *applyWeights(PyObject *self, PyObject *args){
+	// applyWeights(weights, maps, nside, Nfreqs, ipix_arr, Npixels) returns the ILC map at the ipix_arr pixels,
+	// sum_n weights[p,n] maps[n,ipix_arr[p]], through pixelilc_apply_weights of the C API
+	PyObject *weights = NULL; // the [Npixels,Nfreqs] weights returned by the other functions
+	PyObject *maps = NULL; // the [Nfreqs,npix] filtered maps
+	PyObject *nside = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr = NULL;
+	PyObject *Npixels = NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOO" , &weights, &maps, &nside, &Nfreqs, &ipix_arr, &Npixels)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	double *out = calloc(Npixels_ > 0 ? Npixels_ : 1, sizeof(double));
+	pixelilc_context *ctx = pixelilc_context_new(Nfreqs_, 0);
+	int status = pixelilc_apply_weights(ctx, PyArray_DATA(weights), PyArray_DATA(ipix_arr), Npixels_, PyArray_DATA(maps), 12L*nside_map*nside_map, out);
+	pixelilc_context_free(ctx);
+	if(status != 0){
+		free(out);
+		PyErr_SetString(PyExc_ValueError, "applyWeights: invalid arguments");
+		return NULL;
+	}
+	npy_intp npy_shape[1] = {Npixels_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(1,npy_shape, NPY_DOUBLE, out);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	return(arr);
+}
+static PyObject *quantizeWeights(PyObject *self, PyObject *args){
+	// quantizeWeights(weights, Nfreqs, Npixels, block_pixels=64) returns (q, scales), the [Npixels,Nfreqs] int16 weights
+	// and the [Nblocks,Nfreqs] float32 scales of every block of block_pixels pixels, see pixel_ILC_quant.c
+	PyObject *weights = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *Npixels = NULL;
+	PyObject *block_pixels = NULL;
+	if (!PyArg_ParseTuple(args, "OOO|O" , &weights, &Nfreqs, &Npixels, &block_pixels)) return NULL;
+
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long block_pixels_ = (block_pixels == NULL || block_pixels == Py_None) ? PIXELILC_QUANT_BLOCK : PyLong_AsLong(block_pixels);
+	long Nblocks = (block_pixels_ > 0) ? (Npixels_ + block_pixels_ - 1) / block_pixels_ : 0;
+	short *q = calloc(Npixels_ > 0 ? Npixels_*Nfreqs_ : 1, sizeof(short));
+	float *scales = calloc(Nblocks > 0 ? Nblocks*Nfreqs_ : 1, sizeof(float));
+	pixelilc_context *ctx = pixelilc_context_new(Nfreqs_, 0);
+	int status = pixelilc_quantize_weights(ctx, PyArray_DATA(weights), Npixels_, block_pixels_, q, scales);
+	pixelilc_context_free(ctx);
+	if(status != 0){
+		free(q);
+		free(scales);
+		PyErr_SetString(PyExc_ValueError, "quantizeWeights: invalid arguments");
+		return NULL;
+	}
+	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
+	PyObject *arr_q 	= PyArray_SimpleNewFromData(2,npy_shape, NPY_INT16, q);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr_q, NPY_OWNDATA);
+	npy_shape[0] = Nblocks;
+	PyObject *arr_scales	= PyArray_SimpleNewFromData(2,npy_shape, NPY_FLOAT32, scales);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr_scales, NPY_OWNDATA);
+	return Py_BuildValue("NN", arr_q, arr_scales);
+}
+
+static PyObject *dequantizeWeights(PyObject *self, PyObject *args){
+	// dequantizeWeights(q, scales, Nfreqs, Npixels, block_pixels=64) returns the [Npixels,Nfreqs] float64 weights
+	PyObject *q = NULL;
+	PyObject *scales = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *Npixels = NULL;
+	PyObject *block_pixels = NULL;
+	if (!PyArg_ParseTuple(args, "OOOO|O" , &q, &scales, &Nfreqs, &Npixels, &block_pixels)) return NULL;
+
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long block_pixels_ = (block_pixels == NULL || block_pixels == Py_None) ? PIXELILC_QUANT_BLOCK : PyLong_AsLong(block_pixels);
+	double *weights = calloc(Npixels_ > 0 ? Npixels_*Nfreqs_ : 1, sizeof(double));
+	pixelilc_context *ctx = pixelilc_context_new(Nfreqs_, 0);
+	int status = pixelilc_dequantize_weights(ctx, PyArray_DATA(q), PyArray_DATA(scales), Npixels_, block_pixels_, weights);
+	pixelilc_context_free(ctx);
+	if(status != 0){
+		free(weights);
+		PyErr_SetString(PyExc_ValueError, "dequantizeWeights: invalid arguments");
+		return NULL;
 	}
-	free(thermo_2_rj);
 	npy_intp npy_shape[2] = {Npixels_,Nfreqs_};
 	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, weights);
 	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
 	return(arr);
 }
 
+static PyObject *applyQuantizedWeights(PyObject *self, PyObject *args){
+	// applyQuantizedWeights(q, scales, maps, nside, Nfreqs, ipix_arr, Npixels, block_pixels=64) is applyWeights with the
+	// weights of quantizeWeights, which are decoded as they are applied
+	PyObject *q = NULL;
+	PyObject *scales = NULL;
+	PyObject *maps = NULL; // the [Nfreqs,npix] filtered maps
+	PyObject *nside = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *ipix_arr = NULL;
+	PyObject *Npixels = NULL;
+	PyObject *block_pixels = NULL;
+	if (!PyArg_ParseTuple(args, "OOOOOOO|O" , &q, &scales, &maps, &nside, &Nfreqs, &ipix_arr, &Npixels, &block_pixels)) return NULL;
+
+	int nside_map = (int) PyLong_AsLong(nside);
+	int Nfreqs_ = (int) PyLong_AsLong(Nfreqs);
+	long Npixels_ = (long) PyLong_AsLong(Npixels);
+	long block_pixels_ = (block_pixels == NULL || block_pixels == Py_None) ? PIXELILC_QUANT_BLOCK : PyLong_AsLong(block_pixels);
+	double *out = calloc(Npixels_ > 0 ? Npixels_ : 1, sizeof(double));
+	pixelilc_context *ctx = pixelilc_context_new(Nfreqs_, 0);
+	int status = pixelilc_apply_quantized_weights(ctx, PyArray_DATA(q), PyArray_DATA(scales), block_pixels_, PyArray_DATA(ipix_arr), Npixels_, PyArray_DATA(maps), 12L*nside_map*nside_map, out);
+	pixelilc_context_free(ctx);
+	if(status != 0){
+		free(out);
+		PyErr_SetString(PyExc_ValueError, "applyQuantizedWeights: invalid arguments");
+		return NULL;
+	}
+	npy_intp npy_shape[1] = {Npixels_};
+	PyObject *arr 		= PyArray_SimpleNewFromData(1,npy_shape, NPY_DOUBLE, out);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	return(arr);
+}
+
+static PyObject *cpuFeatures(PyObject *self, PyObject *args){
+	// Returns a dict with the version of the hot kernels running on this CPU ("x86-64-v4", "x86-64-v3", "default",
+	// or "build flags" when they were compiled only once) and whether the build has several versions to pick from
+	PyObject *features = PyDict_New();
+	PyObject *value = PyUnicode_FromString(pixelILC_DispatchLevel());
+	PyDict_SetItemString(features, "kernels", value);
+	Py_DECREF(value);
+	PyDict_SetItemString(features, "target_clones", PIXELILC_TARGET_CLONES ? Py_True : Py_False);
+	return features;
+}
+
+static PyObject *setProgress(PyObject *self, PyObject *args){
+	// setProgress(callback=None, interval=1.0): callback(done, total) is called every interval seconds while a module
+	// function runs, and cancels it by returning True. The interval also sets how often Ctrl-C is checked.
+	PyObject *callback = NULL;
+	PyObject *interval = NULL;
+	if (!PyArg_ParseTuple(args, "|OO" , &callback, &interval)) return NULL;
+	if (callback != NULL && callback != Py_None && !PyCallable_Check(callback)){
+		PyErr_SetString(PyExc_TypeError, "the progress callback must be callable or None");
+		return NULL;
+	}
+	Py_XDECREF(progress_callback);
+	progress_callback = (callback == NULL || callback == Py_None) ? NULL : callback;
+	Py_XINCREF(progress_callback);
+	progress_interval = (interval == NULL || interval == Py_None) ? PIXELILC_PROGRESS_INTERVAL : PyFloat_AsDouble(interval);
+	if (PyErr_Occurred()) return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *cancel(PyObject *self, PyObject *args){
+	// stops the running call at its next block, does nothing when no call is running
+	if(progress_running) progress_state.cancel = 1;
+	Py_RETURN_NONE;
+}
+
+static PyObject *getProgress(PyObject *self, PyObject *args){
+	// the pixels done and the total of the running call, or of the last one, and whether it was cancelled
+	return Py_BuildValue("{s:l,s:l,s:O,s:O}", "done", progress_state.done, "total", progress_state.total,
+		"running", progress_running ? Py_True : Py_False, "cancelled", progress_state.cancel ? Py_True : Py_False);
+}
+
+static PyObject *getStats(PyObject *self, PyObject *args){
+	// Returns the per-thread wall times (in seconds) and counters of the last call, as a dict of lists with one entry per thread
+	PyObject *stats = PyDict_New();
+	PyObject *value;
+	int nthreads = pixelILC_stats_nthreads;
+#ifdef PIXELILC_STATS
+	PyDict_SetItemString(stats, "enabled", Py_True);
+#else
+	PyDict_SetItemString(stats, "enabled", Py_False);
+#endif
+	value = PyLong_FromLong(nthreads);
+	PyDict_SetItemString(stats, "nthreads", value);
+	Py_DECREF(value);
+	for(int k=0;k<PILC_NPHASES;k++){
+		value = PyList_New(nthreads);
+		for(int t=0;t<nthreads;t++) PyList_SET_ITEM(value, t, PyFloat_FromDouble(pixelILC_stats[t].time[k]));
+		PyDict_SetItemString(stats, pixelILC_phase_names[k], value);
+		Py_DECREF(value);
+	}
+	for(int k=0;k<PILC_NCOUNTERS;k++){
+		value = PyList_New(nthreads);
+		for(int t=0;t<nthreads;t++) PyList_SET_ITEM(value, t, PyLong_FromLong(pixelILC_stats[t].count[k]));
+		PyDict_SetItemString(stats, pixelILC_counter_names[k], value);
+		Py_DECREF(value);
+	}
+	return(stats);
+}
+
 
 static PyMethodDef PixelILCMethods[] = {
 	{"doNILC_CovarPixelSpace_SingleField", doNILC_CovarPixelSpace_SingleField, METH_VARARGS,NULL},
+	{"doNILC_CovarRingFFT_SingleField", doNILC_CovarRingFFT_SingleField, METH_VARARGS,NULL},
+	{"doNILC_CovarPixelSpace_LeaveOut_SingleField", doNILC_CovarPixelSpace_LeaveOut_SingleField, METH_VARARGS,NULL},
+	{"doNILC_CovarPixelSpace_QU_SingleField", doNILC_CovarPixelSpace_QU_SingleField, METH_VARARGS,NULL},
+	{"doNILC_CovarPixelSpace_Degraded_SingleField", doNILC_CovarPixelSpace_Degraded_SingleField, METH_VARARGS,NULL},
+	{"degradedNside", degradedNside, METH_VARARGS,NULL},
+	{"planStrategies", planStrategies, METH_VARARGS,NULL},
+	{"doGNILC_SHTSmoothing_SingleField", doGNILC_SHTSmoothing_SingleField, METH_VARARGS,NULL},
+	{"doNILC_CovarPixelSpace_Subsampled_SingleField", doNILC_CovarPixelSpace_Subsampled_SingleField, METH_VARARGS,NULL},
+	{"subsampleNside", subsampleNside, METH_VARARGS,NULL},
+	{"doNILC_CovarPixelSpace_Batch_SingleField", doNILC_CovarPixelSpace_Batch_SingleField, METH_VARARGS,NULL},
+	{"doNILC_SHTSmoothing_Coarse_SingleField", doNILC_SHTSmoothing_Coarse_SingleField, METH_VARARGS,NULL},
+	{"doCNILC_SHTSmoothing_Coarse_SingleField", doCNILC_SHTSmoothing_Coarse_SingleField, METH_VARARGS,NULL},
+	{"coarseNside", coarseNside, METH_VARARGS,NULL},
 	{"doNILC_SHTSmoothing_SingleField", doNILC_SHTSmoothing_SingleField,METH_VARARGS,NULL},
 	{"doCNILC_SHTSmoothing_SingleField",doCNILC_SHTSmoothing_SingleField,METH_VARARGS,NULL},
   {"doCNILC_ThermalDust_SHTSmoothing_SingleField",doCNILC_ThermalDust_SHTSmoothing_SingleField,METH_VARARGS,NULL},
   {"doCNILC_ThermalDust_Synchrotron_SHTSmoothing_SingleField",doCNILC_ThermalDust_Synchrotron_SHTSmoothing_SingleField,METH_VARARGS,NULL},
 	{"doNILC_SHTSmoothing_SingleField_pixpixcorr",doNILC_SHTSmoothing_SingleField_pixpixcorr,METH_VARARGS,NULL},
+	{"doNILC_SHTSmoothing_SingleField_float",doNILC_SHTSmoothing_SingleField_float,METH_VARARGS,NULL},
+	{"doCNILC_SHTSmoothing_SingleField_float",doCNILC_SHTSmoothing_SingleField_float,METH_VARARGS,NULL},
+	{"doCNILC_ThermalDust_SHTSmoothing_SingleField_float",doCNILC_ThermalDust_SHTSmoothing_SingleField_float,METH_VARARGS,NULL},
+	{"doNILC_CovarPixelSpace_SingleField_float",doNILC_CovarPixelSpace_SingleField_float,METH_VARARGS,NULL},
+	{"factorizeCovariance_SHTSmoothing_SingleField",factorizeCovariance_SHTSmoothing_SingleField,METH_VARARGS,NULL},
+	{"doNILC_Factorized_SingleField",doNILC_Factorized_SingleField,METH_VARARGS,NULL},
+	{"doCNILC_Factorized_SingleField",doCNILC_Factorized_SingleField,METH_VARARGS,NULL},
+	{"doCNILC_ThermalDust_Factorized_SingleField",doCNILC_ThermalDust_Factorized_SingleField,METH_VARARGS,NULL},
+ {"getStats",getStats,METH_NOARGS,NULL},
+ {"setProgress",setProgress,METH_VARARGS,NULL},
+ {"cancel",cancel,METH_NOARGS,NULL},
+ {"getProgress",getProgress,METH_NOARGS,NULL},
+ {"cpuFeatures",cpuFeatures,METH_NOARGS,NULL},
+	{"applyWeights",applyWeights,METH_VARARGS,NULL},
+	{"updateFactors_SHTSmoothing_SingleField",updateFactors_SHTSmoothing_SingleField,METH_VARARGS,NULL},
+	{"updateChannel_CovarPixelSpace_SingleField",updateChannel_CovarPixelSpace_SingleField,METH_VARARGS,NULL},
+	{"updateMask_CovarPixelSpace_SingleField",updateMask_CovarPixelSpace_SingleField,METH_VARARGS,NULL},
+	{"quantizeWeights",quantizeWeights,METH_VARARGS,NULL},
+	{"dequantizeWeights",dequantizeWeights,METH_VARARGS,NULL},
+	{"applyQuantizedWeights",applyQuantizedWeights,METH_VARARGS,NULL},
  {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -541,5 +1929,11 @@ PyMODINIT_FUNC PyInit_PixelILC(void){
   PyObject *m;
   m = PyModule_Create(&PixelILC_module);
   import_array();  // This is important for using the numpy_array api, otherwise segfaults!
+  if (PyType_Ready(&pixelILC_PlanType) < 0) return NULL;
+  Py_INCREF(&pixelILC_PlanType);
+  PyModule_AddObject(m, "Plan", (PyObject *) &pixelILC_PlanType);
+  if (PyType_Ready(&pixelILC_LazyType) < 0) return NULL;
+  Py_INCREF(&pixelILC_LazyType);
+  PyModule_AddObject(m, "LazyWeights", (PyObject *) &pixelILC_LazyType);
   return(m);
 }
\ No newline at end of file
@@ -0,0 +1,567 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#define NO_IMPORT_ARRAY
+#define PY_ARRAY_UNIQUE_SYMBOL PixelILC_ARRAY_API
+#include <numpy/ndarrayobject.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+#include <pixel_ILC_writer.h>
+#include <omp.h>
+
+// PixelILC.Plan(nside, ipix_arr, Nfreqs, Nthreads, nest=0, fwhm=0.0, freq_arr=None, compact=0)
+// Everything the module functions derive at every call is derived once here: the pixel schedules, the discs of the
+// pixel-space covariance when fwhm > 0, the unit conversions when freq_arr is given, and the scratch of every thread.
+// The methods take only the maps and SEDs, and return the same weights as the module functions of the same name.
+// Nthreads = 0 uses all the threads OpenMP would use. The methods run the single precision path, and return float32
+// weights, when the covariances (TEBmaps or Covar_maps) are float32.
+// runToFile runs any of them chunk by chunk into a file instead of memory, and resumes interrupted runs.
+// With compact=1 the per-pixel arrays (TEBmaps, Covar_maps, beta_dust_map, T_dust_map, beta_syn_map) have one row per
+// pixel of ipix_arr, in its order, instead of one per pixel of the sky. The maps read around the pixels in the
+// pixel-space covariance (Field_filtered_map, Mask) then only cover the pixels of their discs, the support() of the
+// plan, so the memory follows the size of the region instead of the sky.
+
+typedef struct {
+	PyObject_HEAD
+	int nside;
+	int Nfreqs;
+	int Nfreqs2;
+	int nest;
+	int Nthreads;
+	long Npixels;
+	double fwhm;
+	long *ipix;			// copy of ipix_arr
+	pixelILC_schedule sched;	// by increasing pixel index, for the TEBmaps methods
+	pixelILC_schedule sched_disc;	// along the NEST curve with disc costs, only when fwhm > 0
+	long *disc_start;		// the disc of ipix[p] is disc_pixels[disc_start[p]] ... disc_pixels[disc_start[p+1]-1]
+	long *disc_pixels;
+	long *mask_start;		// the discs without the pixels outside the mask, after compressMask
+	long *mask_pixels;
+	double *mask_weights;		// the mask value of every pixel of mask_pixels
+	double *freq_arr;		// only when freq_arr was given
+	double *thermo_2_rj;
+	pixelILC_arena *arenas;		// one per thread
+	int compact;
+	long *positions;		// 0 ... Npixels-1, the rows of the compact per-pixel arrays
+	long *support;			// the pixels of the discs, sorted, when compact and fwhm > 0
+	long Nsupport;			// the number of pixels of the maps the discs index
+} pixelILC_PlanObject;
+
+static int Plan_compare_longs(const void *a, const void *b){
+	long ka = *(const long*) a, kb = *(const long*) b;
+	return (ka > kb) - (ka < kb);
+}
+
+static int pixelILC_PlanSupport(pixelILC_PlanObject *plan){
+	// the sorted union of the discs, and the discs as positions in it. Returns -1 if it could not be allocated
+	long ii, ndisc = plan->disc_start[plan->Npixels];
+	plan->support = malloc((ndisc > 0 ? ndisc : 1)*sizeof(long));
+	if(plan->support == NULL) return -1;
+	memcpy(plan->support, plan->disc_pixels, ndisc*sizeof(long));
+	qsort(plan->support, ndisc, sizeof(long), Plan_compare_longs);
+	plan->Nsupport = 0;
+	for(ii=0;ii<ndisc;ii++) if(plan->Nsupport == 0 || plan->support[ii] != plan->support[plan->Nsupport-1]) plan->support[plan->Nsupport++] = plan->support[ii];
+	plan->support = realloc(plan->support, (plan->Nsupport > 0 ? plan->Nsupport : 1)*sizeof(long));
+	#pragma omp parallel for schedule(static)
+	for(ii=0;ii<ndisc;ii++){
+		long *found = bsearch(&plan->disc_pixels[ii], plan->support, plan->Nsupport, sizeof(long), Plan_compare_longs);
+		plan->disc_pixels[ii] = found - plan->support;
+	}
+	return 0;
+}
+
+static int pixelILC_PlanDiscs(pixelILC_PlanObject *plan){
+	// A first pass counts the pixels of every disc, the second one queries them again and copies them to their place.
+	// A disc whose query fails is left empty. Returns -1 if the discs could not be allocated, or if a query gave another
+	// size the second time
+	long p;
+	int mismatch = 0;
+	plan->disc_start = malloc((plan->Npixels + 1)*sizeof(long));
+	if(plan->disc_start == NULL) return -1;
+	plan->disc_start[0] = 0;
+	omp_set_num_threads(plan->Nthreads);
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &plan->arenas[omp_get_thread_num()];
+	#pragma omp for schedule(dynamic,64)
+	for(p=0;p<plan->Npixels;p++){
+		plan->disc_start[p+1] = pixelILC_QueryDisc(arena, plan->ipix[p], 0.5*plan->fwhm, plan->nside, plan->nest);
+	}
+	}
+	for(p=0;p<plan->Npixels;p++) plan->disc_start[p+1] += plan->disc_start[p];
+	plan->disc_pixels = malloc((plan->disc_start[plan->Npixels] > 0 ? plan->disc_start[plan->Npixels] : 1)*sizeof(long));
+	if(plan->disc_pixels == NULL) return -1;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &plan->arenas[omp_get_thread_num()];
+	long nipix;
+	#pragma omp for schedule(dynamic,64)
+	for(p=0;p<plan->Npixels;p++){
+		nipix = pixelILC_QueryDisc(arena, plan->ipix[p], 0.5*plan->fwhm, plan->nside, plan->nest);
+		if(nipix != plan->disc_start[p+1] - plan->disc_start[p]){
+			#pragma omp atomic write
+			mismatch = 1;
+			continue;
+		}
+		memcpy(&plan->disc_pixels[plan->disc_start[p]], arena->pixel_buffer, nipix*sizeof(long));
+	}
+	}
+	return mismatch ? -1 : 0;
+}
+
+static PyObject *Plan_new(PyTypeObject *type, PyObject *args, PyObject *kwds){
+	PyObject *nside = NULL;
+	PyObject *ipix_arr = NULL;
+	PyObject *Nfreqs = NULL;
+	PyObject *Nthreads = NULL;
+	PyObject *nest = NULL;
+	PyObject *fwhm = NULL;
+	PyObject *freq_arr = NULL;
+	PyObject *compact = NULL;
+	if (!PyArg_ParseTuple(args, "OOOO|OOOO" , &nside, &ipix_arr, &Nfreqs, &Nthreads, &nest, &fwhm, &freq_arr, &compact)) return NULL;
+	if (!PyArray_Check(ipix_arr) || PyArray_TYPE((PyArrayObject *)ipix_arr) != NPY_INT64 || !PyArray_ISCARRAY_RO((PyArrayObject *)ipix_arr)){
+		PyErr_SetString(PyExc_TypeError, "ipix_arr must be a contiguous int64 array");
+		return NULL;
+	}
+	pixelILC_PlanObject *plan = (pixelILC_PlanObject *) type->tp_alloc(type, 0);
+	if (plan == NULL) return NULL;
+	plan->nside = (int) PyLong_AsLong(nside);
+	plan->Nfreqs = (int) PyLong_AsLong(Nfreqs);
+	plan->Nfreqs2 = plan->Nfreqs*(plan->Nfreqs+1)/2;
+	plan->Nthreads = (int) PyLong_AsLong(Nthreads);
+	plan->nest = (nest == NULL) ? 0 : (int) PyLong_AsLong(nest);
+	plan->fwhm = (fwhm == NULL) ? 0.0 : PyFloat_AsDouble(fwhm);
+	plan->compact = (compact == NULL) ? 0 : PyObject_IsTrue(compact);
+	if (PyErr_Occurred()){
+		Py_DECREF(plan);
+		return NULL;
+	}
+	if (freq_arr != NULL && freq_arr != Py_None && (!PyArray_Check(freq_arr) || PyArray_TYPE((PyArrayObject *)freq_arr) != NPY_FLOAT64 || !PyArray_ISCARRAY_RO((PyArrayObject *)freq_arr) || PyArray_SIZE((PyArrayObject *)freq_arr) != plan->Nfreqs)){
+		PyErr_SetString(PyExc_TypeError, "freq_arr must be a contiguous float64 array of Nfreqs values");
+		Py_DECREF(plan);
+		return NULL;
+	}
+	if (plan->Nthreads <= 0) plan->Nthreads = omp_get_max_threads();
+	plan->Npixels = (long) PyArray_SIZE((PyArrayObject *)ipix_arr);
+	double memory_limit = pixelILC_CostMemoryLimit();
+	if (plan->fwhm > 0.0 && memory_limit > 0.0 && plan->Npixels*pixelILC_CostDiscPixels(plan->nside, plan->fwhm)*sizeof(long) > memory_limit){
+		// the discs of all the pixels are kept, refuse before querying them
+		PyErr_Format(PyExc_MemoryError, "the discs of %ld pixels need about %ld MB, more than the limit of %ld MB, see planStrategies", plan->Npixels, (long) (plan->Npixels*pixelILC_CostDiscPixels(plan->nside, plan->fwhm)*sizeof(long)/1048576.0), (long) (memory_limit/1048576.0));
+		Py_DECREF(plan);
+		return NULL;
+	}
+	plan->ipix = malloc((plan->Npixels > 0 ? plan->Npixels : 1)*sizeof(long));
+	if (plan->ipix == NULL){
+		Py_DECREF(plan);
+		return PyErr_NoMemory();
+	}
+	memcpy(plan->ipix, PyArray_DATA(ipix_arr), plan->Npixels*sizeof(long));
+
+	if (plan->compact){
+		long p;
+		plan->positions = malloc((plan->Npixels > 0 ? plan->Npixels : 1)*sizeof(long));
+		if (plan->positions == NULL){
+			Py_DECREF(plan);
+			return PyErr_NoMemory();
+		}
+		for(p=0;p<plan->Npixels;p++) plan->positions[p] = p;
+	}
+	// TEBmaps rows are read by increasing pixel index, whatever order ipix_arr comes in, and in order when compact
+	pixelILC_ScheduleInit(&plan->sched, plan->compact ? plan->positions : plan->ipix, plan->Npixels, plan->nside, 0, 0, plan->Nthreads);
+	if (plan->fwhm > 0.0){
+		pixelILC_ScheduleInit(&plan->sched_disc, plan->ipix, plan->Npixels, plan->nside, 1, plan->nest, plan->Nthreads);
+		pixelILC_ScheduleDiscCost(&plan->sched_disc, plan->ipix, plan->nside, plan->nest, 0.5*plan->fwhm);
+	}
+	// the disc queries below grow the pixel buffers of the arenas
+	plan->arenas = pixelILC_ArenasAlloc(plan->Nthreads, plan->Nfreqs);
+	if (plan->fwhm > 0.0){
+		if (pixelILC_PlanDiscs(plan) != 0){
+			if (plan->disc_pixels == NULL) PyErr_NoMemory();
+			else PyErr_SetString(PyExc_RuntimeError, "a disc query gave two different sizes");
+			Py_DECREF(plan);
+			return NULL;
+		}
+		if (plan->compact && pixelILC_PlanSupport(plan) != 0){
+			Py_DECREF(plan);
+			return PyErr_NoMemory();
+		}
+	}
+	if (!(plan->compact && plan->fwhm > 0.0)) plan->Nsupport = 12L*plan->nside*plan->nside;
+	if (freq_arr != NULL && freq_arr != Py_None){
+		plan->freq_arr = malloc(plan->Nfreqs*sizeof(double));
+		plan->thermo_2_rj = malloc(plan->Nfreqs*sizeof(double));
+		if (plan->freq_arr == NULL || plan->thermo_2_rj == NULL){
+			Py_DECREF(plan);
+			return PyErr_NoMemory();
+		}
+		memcpy(plan->freq_arr, PyArray_DATA(freq_arr), plan->Nfreqs*sizeof(double));
+		pixelILC_Thermo2RJ(plan->freq_arr, plan->Nfreqs, plan->thermo_2_rj);
+	}
+	return (PyObject *) plan;
+}
+
+static void Plan_dealloc(pixelILC_PlanObject *plan){
+	if (plan->ipix != NULL){
+		pixelILC_ScheduleFree(&plan->sched);
+		if (plan->fwhm > 0.0) pixelILC_ScheduleFree(&plan->sched_disc);
+		if (plan->arenas != NULL) pixelILC_ArenasFree(plan->arenas, plan->Nthreads);
+	}
+	free(plan->ipix);
+	free(plan->disc_start);
+	free(plan->disc_pixels);
+	free(plan->mask_start);
+	free(plan->mask_pixels);
+	free(plan->mask_weights);
+	free(plan->freq_arr);
+	free(plan->thermo_2_rj);
+	free(plan->positions);
+	free(plan->support);
+	Py_TYPE(plan)->tp_free((PyObject *) plan);
+}
+
+static int Plan_is_float(PyObject *maps){
+	return PyArray_Check(maps) && PyArray_TYPE((PyArrayObject *)maps) == NPY_FLOAT32;
+}
+
+// The weight methods, in the order of Plan_method_names
+enum { PLAN_NILC_SHT, PLAN_CNILC_SHT, PLAN_CNILC_DUST_SHT, PLAN_CNILC_DUST_SYN_SHT, PLAN_NILC_PIXEL, PLAN_NMETHODS };
+static const char *Plan_method_names[PLAN_NMETHODS] = {"doNILC_SHTSmoothing", "doCNILC_SHTSmoothing", "doCNILC_ThermalDust_SHTSmoothing", "doCNILC_ThermalDust_Synchrotron_SHTSmoothing", "doNILC_CovarPixelSpace"};
+
+// The arguments of a weight method. maps is TEBmaps, or Covar_maps for the pixel-space covariance
+typedef struct {
+	int method;
+	int is_float;
+	PyObject *maps, *a, *b, *beta_dust_map, *T_dust_map, *beta_syn_map, *Field_filtered_map, *Mask;
+} Plan_args;
+
+static int Plan_parse(pixelILC_PlanObject *plan, int method, PyObject *args, Plan_args *pa){
+	// returns 0, or -1 with the python error set
+	memset(pa, 0, sizeof(Plan_args));
+	pa->method = method;
+	switch(method){
+		case PLAN_NILC_SHT:
+			if (!PyArg_ParseTuple(args, "OO" , &pa->maps, &pa->a)) return -1;
+			break;
+		case PLAN_CNILC_SHT:
+			if (!PyArg_ParseTuple(args, "OOO" , &pa->maps, &pa->a, &pa->b)) return -1;
+			break;
+		case PLAN_CNILC_DUST_SHT:
+			if (!PyArg_ParseTuple(args, "OOOO" , &pa->maps, &pa->a, &pa->beta_dust_map, &pa->T_dust_map)) return -1;
+			break;
+		case PLAN_CNILC_DUST_SYN_SHT:
+			if (!PyArg_ParseTuple(args, "OOOOO" , &pa->maps, &pa->a, &pa->beta_dust_map, &pa->T_dust_map, &pa->beta_syn_map)) return -1;
+			break;
+		case PLAN_NILC_PIXEL:
+			if (!PyArg_ParseTuple(args, "OOOO" , &pa->maps, &pa->Field_filtered_map, &pa->Mask, &pa->a)) return -1;
+			break;
+	}
+	if ((method == PLAN_CNILC_DUST_SHT || method == PLAN_CNILC_DUST_SYN_SHT) && plan->freq_arr == NULL){
+		PyErr_SetString(PyExc_ValueError, "the plan was created without freq_arr");
+		return -1;
+	}
+	if (method == PLAN_NILC_PIXEL && plan->fwhm <= 0.0){
+		PyErr_SetString(PyExc_ValueError, "the plan was created without fwhm");
+		return -1;
+	}
+	if (method == PLAN_NILC_PIXEL && pa->Mask == Py_None && plan->mask_start == NULL){
+		PyErr_SetString(PyExc_ValueError, "Mask is None but compressMask was not called");
+		return -1;
+	}
+	if (method == PLAN_NILC_PIXEL && (!PyArray_Check(pa->Field_filtered_map) || PyArray_SIZE((PyArrayObject *)pa->Field_filtered_map) != plan->Nfreqs*plan->Nsupport || (pa->Mask != Py_None && (!PyArray_Check(pa->Mask) || PyArray_SIZE((PyArrayObject *)pa->Mask) != plan->Nsupport)))){
+		PyErr_SetString(PyExc_ValueError, plan->compact ? "Field_filtered_map and Mask must cover the len(support()) pixels of a compact plan" : "Field_filtered_map and Mask must cover the 12*nside**2 pixels");
+		return -1;
+	}
+	// there is no single precision path for the dust and synchrotron constraints
+	pa->is_float = (method != PLAN_CNILC_DUST_SYN_SHT) && Plan_is_float(pa->maps);
+	return 0;
+}
+
+static void Plan_run(pixelILC_PlanObject *plan, Plan_args *pa, pixelILC_schedule *sched, long start, void *weights){
+	// runs the pixels of sched, a schedule of ipix_arr[start:] (all of ipix_arr for start = 0)
+	// In a compact plan the drivers get the positions in ipix_arr, the rows of the per-pixel arrays, instead of the
+	// pixels. The pixel-space covariances then never query a disc, they only read the discs of the plan.
+	long *ipix = (plan->compact ? plan->positions : plan->ipix) + start;
+	// the compressed discs stand for the mask when Mask is None
+	int masked = (pa->method == PLAN_NILC_PIXEL && pa->Mask == Py_None);
+	long *disc_start = masked ? plan->mask_start + start : ((plan->disc_start != NULL) ? plan->disc_start + start : NULL);
+	long *disc_pixels = masked ? plan->mask_pixels : plan->disc_pixels;
+	double *disc_weights = masked ? plan->mask_weights : NULL;
+	void *mask = (pa->method == PLAN_NILC_PIXEL && !masked) ? PyArray_DATA(pa->Mask) : NULL;
+	omp_set_num_threads(plan->Nthreads);
+	switch(pa->method){
+		case PLAN_NILC_SHT:
+			if(pa->is_float) pixelILC_Run_NILC_SHTSmoothing_float(sched, plan->arenas, ipix, plan->Nfreqs, PyArray_DATA(pa->maps), PyArray_DATA(pa->a), weights);
+			else pixelILC_Run_NILC_SHTSmoothing(sched, plan->arenas, ipix, plan->Nfreqs, PyArray_DATA(pa->maps), PyArray_DATA(pa->a), weights);
+			break;
+		case PLAN_CNILC_SHT:
+			if(pa->is_float) pixelILC_Run_CNILC_SHTSmoothing_float(sched, plan->arenas, ipix, plan->Nfreqs, PyArray_DATA(pa->maps), PyArray_DATA(pa->a), PyArray_DATA(pa->b), weights);
+			else pixelILC_Run_CNILC_SHTSmoothing(sched, plan->arenas, ipix, plan->Nfreqs, PyArray_DATA(pa->maps), PyArray_DATA(pa->a), PyArray_DATA(pa->b), weights);
+			break;
+		case PLAN_CNILC_DUST_SHT:
+			if(pa->is_float) pixelILC_Run_CNILC_ThermalDust_SHTSmoothing_float(sched, plan->arenas, ipix, plan->Nfreqs, PyArray_DATA(pa->maps), PyArray_DATA(pa->a), PyArray_DATA(pa->beta_dust_map), PyArray_DATA(pa->T_dust_map), plan->freq_arr, plan->thermo_2_rj, weights);
+			else pixelILC_Run_CNILC_ThermalDust_SHTSmoothing(sched, plan->arenas, ipix, plan->Nfreqs, PyArray_DATA(pa->maps), PyArray_DATA(pa->a), PyArray_DATA(pa->beta_dust_map), PyArray_DATA(pa->T_dust_map), plan->freq_arr, plan->thermo_2_rj, weights);
+			break;
+		case PLAN_CNILC_DUST_SYN_SHT:
+			pixelILC_Run_CNILC_ThermalDust_Synchrotron_SHTSmoothing(sched, plan->arenas, ipix, plan->Nfreqs, PyArray_DATA(pa->maps), PyArray_DATA(pa->a), PyArray_DATA(pa->beta_dust_map), PyArray_DATA(pa->T_dust_map), PyArray_DATA(pa->beta_syn_map), plan->freq_arr, plan->thermo_2_rj, weights);
+			break;
+		case PLAN_NILC_PIXEL:
+			if(pa->is_float) pixelILC_Run_NILC_CovarPixelSpace_float(sched, plan->arenas, ipix, plan->Nfreqs, plan->nside, plan->nest, plan->fwhm, PyArray_DATA(pa->maps), PyArray_DATA(pa->Field_filtered_map), mask, disc_start, disc_pixels, disc_weights, plan->Nsupport, PyArray_DATA(pa->a), weights);
+			else pixelILC_Run_NILC_CovarPixelSpace(sched, plan->arenas, ipix, plan->Nfreqs, plan->nside, plan->nest, plan->fwhm, PyArray_DATA(pa->maps), PyArray_DATA(pa->Field_filtered_map), mask, disc_start, disc_pixels, disc_weights, plan->Nsupport, PyArray_DATA(pa->a), weights);
+			break;
+	}
+}
+
+static PyObject *Plan_do(pixelILC_PlanObject *plan, int method, PyObject *args){
+	Plan_args pa;
+	if (Plan_parse(plan, method, args, &pa) != 0) return NULL;
+	pixelILC_stats_reset(plan->Nthreads);
+	STATS_TIC(t_marshal);
+	void* weights = calloc(plan->Npixels*plan->Nfreqs, pa.is_float ? sizeof(float) : sizeof(double));
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	Plan_run(plan, &pa, (method == PLAN_NILC_PIXEL) ? &plan->sched_disc : &plan->sched, 0, weights);
+	STATS_START(t_marshal);
+	npy_intp npy_shape[2] = {plan->Npixels,plan->Nfreqs};
+	PyObject *arr 		= PyArray_SimpleNewFromData(2,npy_shape, pa.is_float ? NPY_FLOAT32 : NPY_DOUBLE, weights);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyObject *Plan_doNILC_SHTSmoothing(pixelILC_PlanObject *plan, PyObject *args){
+	// doNILC_SHTSmoothing(TEBmaps, a)
+	return Plan_do(plan, PLAN_NILC_SHT, args);
+}
+
+static PyObject *Plan_doCNILC_SHTSmoothing(pixelILC_PlanObject *plan, PyObject *args){
+	// doCNILC_SHTSmoothing(TEBmaps, a, b)
+	return Plan_do(plan, PLAN_CNILC_SHT, args);
+}
+
+static PyObject *Plan_doCNILC_ThermalDust_SHTSmoothing(pixelILC_PlanObject *plan, PyObject *args){
+	// doCNILC_ThermalDust_SHTSmoothing(TEBmaps, a, beta_dust_map, T_dust_map), needs freq_arr in the plan
+	return Plan_do(plan, PLAN_CNILC_DUST_SHT, args);
+}
+
+static PyObject *Plan_doCNILC_ThermalDust_Synchrotron_SHTSmoothing(pixelILC_PlanObject *plan, PyObject *args){
+	// doCNILC_ThermalDust_Synchrotron_SHTSmoothing(TEBmaps, a, beta_dust_map, T_dust_map, beta_syn_map), needs freq_arr in the plan
+	return Plan_do(plan, PLAN_CNILC_DUST_SYN_SHT, args);
+}
+
+static PyObject *Plan_doNILC_CovarPixelSpace(pixelILC_PlanObject *plan, PyObject *args){
+	// doNILC_CovarPixelSpace(Covar_maps, Field_filtered_map, Mask, a), needs fwhm > 0 in the plan.
+	// Mask = None uses the mask given to compressMask
+	return Plan_do(plan, PLAN_NILC_PIXEL, args);
+}
+
+static PyObject *Plan_compressMask(pixelILC_PlanObject *plan, PyObject *args){
+	// compressMask(Mask), needs fwhm > 0 in the plan
+	// Keeps, for doNILC_CovarPixelSpace with Mask = None, only the disc pixels where Mask is not zero together with
+	// their Mask values, so binary and apodized masks both work and the maps are never read outside the mask.
+	// Returns the number of disc pixels kept.
+	PyObject *Mask = NULL;
+	if (!PyArg_ParseTuple(args, "O" , &Mask)) return NULL;
+	if (plan->fwhm <= 0.0){
+		PyErr_SetString(PyExc_ValueError, "the plan was created without fwhm");
+		return NULL;
+	}
+	PyArrayObject *mask_arr = (PyArrayObject *) PyArray_FROM_OTF(Mask, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+	if (mask_arr == NULL) return NULL;
+	if (PyArray_SIZE(mask_arr) != plan->Nsupport){
+		Py_DECREF(mask_arr);
+		PyErr_SetString(PyExc_ValueError, plan->compact ? "Mask must cover the len(support()) pixels of a compact plan" : "Mask must have 12*nside**2 pixels");
+		return NULL;
+	}
+	long ndisc = plan->disc_start[plan->Npixels];
+	free(plan->mask_start);
+	free(plan->mask_pixels);
+	free(plan->mask_weights);
+	plan->mask_start = malloc((plan->Npixels + 1)*sizeof(long));
+	plan->mask_pixels = malloc((ndisc > 0 ? ndisc : 1)*sizeof(long));
+	plan->mask_weights = malloc((ndisc > 0 ? ndisc : 1)*sizeof(double));
+	omp_set_num_threads(plan->Nthreads);
+	long nkeep = pixelILC_MaskDiscs(plan->Npixels, plan->disc_start, plan->disc_pixels, PyArray_DATA(mask_arr), plan->mask_start, plan->mask_pixels, plan->mask_weights);
+	Py_DECREF(mask_arr);
+	// give back what the mask removed
+	plan->mask_pixels = realloc(plan->mask_pixels, (nkeep > 0 ? nkeep : 1)*sizeof(long));
+	plan->mask_weights = realloc(plan->mask_weights, (nkeep > 0 ? nkeep : 1)*sizeof(double));
+	return PyLong_FromLong(nkeep);
+}
+
+static PyObject *Plan_support(pixelILC_PlanObject *plan, PyObject *args){
+	// support(), the pixels of the maps in a compact plan with fwhm > 0, Field_filtered_map[:,support()] and
+	// Mask[support()] of the full sky maps. All the pixels of the sky otherwise.
+	long p;
+	npy_intp npy_shape[1] = {plan->Nsupport};
+	long *support = malloc((plan->Nsupport > 0 ? plan->Nsupport : 1)*sizeof(long));
+	if (plan->support != NULL) memcpy(support, plan->support, plan->Nsupport*sizeof(long));
+	else for(p=0;p<plan->Nsupport;p++) support[p] = p;
+	PyObject *arr 		= PyArray_SimpleNewFromData(1,npy_shape, NPY_INT64, support);
+	PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	return(arr);
+}
+
+static int Plan_checksum(pixelILC_PlanObject *plan, int method, PyObject *method_args, Plan_args *pa, char *tag, size_t tag_size){
+	// The tag of the manifest header of runToFile: the method, the geometry of the plan and a checksum of ipix_arr,
+	// freq_arr, the compressed mask when Mask is None and the arrays of method_args with their dtypes and shapes.
+	// Returns 0, or -1 with the python error set
+	uint64_t hash = PIXELILC_WRITER_CHECKSUM_INIT;
+	Py_ssize_t k;
+	hash = pixelILC_WriterChecksum(hash, plan->ipix, plan->Npixels*sizeof(long));
+	if (plan->freq_arr != NULL) hash = pixelILC_WriterChecksum(hash, plan->freq_arr, plan->Nfreqs*sizeof(double));
+	if (method == PLAN_NILC_PIXEL && pa->Mask == Py_None){
+		hash = pixelILC_WriterChecksum(hash, plan->mask_start, (plan->Npixels + 1)*sizeof(long));
+		hash = pixelILC_WriterChecksum(hash, plan->mask_pixels, plan->mask_start[plan->Npixels]*sizeof(long));
+		hash = pixelILC_WriterChecksum(hash, plan->mask_weights, plan->mask_start[plan->Npixels]*sizeof(double));
+	}
+	for(k=0;k<PyTuple_GET_SIZE(method_args);k++){
+		PyObject *item = PyTuple_GET_ITEM(method_args, k);
+		if (!PyArray_Check(item)){
+			hash = pixelILC_WriterChecksum(hash, &k, sizeof(k));
+			continue;
+		}
+		PyArrayObject *arr = (PyArrayObject *) PyArray_GETCONTIGUOUS((PyArrayObject *) item);
+		if (arr == NULL) return -1;
+		int type = PyArray_TYPE(arr);
+		hash = pixelILC_WriterChecksum(hash, &type, sizeof(type));
+		hash = pixelILC_WriterChecksum(hash, PyArray_DIMS(arr), PyArray_NDIM(arr)*sizeof(npy_intp));
+		hash = pixelILC_WriterChecksum(hash, PyArray_DATA(arr), PyArray_NBYTES(arr));
+		Py_DECREF(arr);
+	}
+	snprintf(tag, tag_size, "%s nside %d nest %d fwhm %.17g inputs %016llx", Plan_method_names[method], plan->nside, plan->nest, plan->fwhm, (unsigned long long) hash);
+	return 0;
+}
+
+static PyObject *Plan_runToFile(pixelILC_PlanObject *plan, PyObject *args){
+	// runToFile(path, method, method_args, chunk_pixels=65536)
+	// Runs the weight method named method (e.g. "doNILC_SHTSmoothing") with the tuple method_args, chunk_pixels pixels
+	// of ipix_arr at a time, and writes the weights of every chunk to path while the next one is computed, so only two
+	// chunks are ever in memory. The weights end in path as a raw Npixels x Nfreqs float64 array (float32 for the single
+	// precision path), see pixel_ILC_writer.h for the manifest. Calling it again after an interrupted run with the same
+	// arguments computes only the missing chunks. The manifest header holds nside, nest, fwhm and a checksum of the
+	// pixels and of the arrays of method_args, so a run with other inputs starts from scratch. Returns the number of
+	// chunks computed by this call.
+	const char *path = NULL;
+	const char *method_name = NULL;
+	PyObject *method_args = NULL;
+	long chunk_pixels = 65536;
+	if (!PyArg_ParseTuple(args, "ssO!|l" , &path, &method_name, &PyTuple_Type, &method_args, &chunk_pixels)) return NULL;
+	int method;
+	for(method=0;method<PLAN_NMETHODS;method++) if(strcmp(method_name, Plan_method_names[method]) == 0) break;
+	if (method == PLAN_NMETHODS){
+		PyErr_Format(PyExc_ValueError, "unknown weight method %s", method_name);
+		return NULL;
+	}
+	if (chunk_pixels <= 0){
+		PyErr_SetString(PyExc_ValueError, "chunk_pixels must be positive");
+		return NULL;
+	}
+	Plan_args pa;
+	if (Plan_parse(plan, method, method_args, &pa) != 0) return NULL;
+	size_t value_size = pa.is_float ? sizeof(float) : sizeof(double);
+	char tag[256];
+	if (Plan_checksum(plan, method, method_args, &pa, tag, sizeof(tag)) != 0) return NULL;
+	pixelILC_writer writer;
+	int error = pixelILC_WriterOpen(&writer, path, plan->Npixels, plan->Nfreqs, value_size, chunk_pixels, tag);
+	if (error != 0){
+		errno = error;
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+	}
+
+	pixelILC_stats_reset(plan->Nthreads);
+	void *buffers[2];
+	buffers[0] = malloc(chunk_pixels*plan->Nfreqs*value_size);
+	buffers[1] = malloc(chunk_pixels*plan->Nfreqs*value_size);
+	long c, computed = 0;
+	for(c=0;c<writer.Nchunks;c++){
+		if(writer.done[c]) continue;
+		long start = c*chunk_pixels;
+		long npix = (plan->Npixels - start < chunk_pixels) ? plan->Npixels - start : chunk_pixels;
+		void *weights = buffers[computed % 2];
+		memset(weights, 0, npix*plan->Nfreqs*value_size);
+		// the schedule of the chunk is built like the one of the whole plan
+		pixelILC_schedule sched;
+		if (method == PLAN_NILC_PIXEL){
+			pixelILC_ScheduleInit(&sched, plan->ipix + start, npix, plan->nside, 1, plan->nest, plan->Nthreads);
+			pixelILC_ScheduleDiscCost(&sched, plan->ipix + start, plan->nside, plan->nest, 0.5*plan->fwhm);
+		}
+		else pixelILC_ScheduleInit(&sched, (plan->compact ? plan->positions : plan->ipix) + start, npix, plan->nside, 0, 0, plan->Nthreads);
+		Plan_run(plan, &pa, &sched, start, weights);
+		pixelILC_ScheduleFree(&sched);
+		pixelILC_WriterSubmit(&writer, c, weights);
+		computed++;
+	}
+	error = pixelILC_WriterClose(&writer);
+	free(buffers[0]);
+	free(buffers[1]);
+	if (error != 0){
+		errno = error;
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+	}
+	return PyLong_FromLong(computed);
+}
+
+static PyObject *Plan_factorizeCovariance(pixelILC_PlanObject *plan, PyObject *args){
+	// factorizeCovariance(TEBmaps, factors=None), see factorizeCovariance_SHTSmoothing_SingleField
+	PyObject *TEBmaps = NULL;
+	PyObject *factors = NULL;
+	if (!PyArg_ParseTuple(args, "O|O" , &TEBmaps, &factors)) return NULL;
+	pixelILC_stats_reset(plan->Nthreads);
+	STATS_TIC(t_marshal);
+	double *U = (factors == NULL) ? malloc(plan->Npixels*plan->Nfreqs2*sizeof(double)) : PyArray_DATA(factors);
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	omp_set_num_threads(plan->Nthreads);
+	pixelILC_Run_Factorize(&plan->sched, plan->compact ? plan->positions : plan->ipix, plan->Nfreqs, PyArray_DATA(TEBmaps), U);
+	STATS_START(t_marshal);
+	PyObject *arr;
+	if(factors == NULL){
+		npy_intp npy_shape[2] = {plan->Npixels,plan->Nfreqs2};
+		arr = PyArray_SimpleNewFromData(2,npy_shape, NPY_DOUBLE, U);
+		PyArray_ENABLEFLAGS((PyArrayObject *)arr, NPY_OWNDATA);
+	}
+	else{
+		Py_INCREF(factors);
+		arr = factors;
+	}
+	STATS_LAP(PILC_MARSHAL, t_marshal);
+	return(arr);
+}
+
+static PyMethodDef Plan_methods[] = {
+	{"doNILC_SHTSmoothing", (PyCFunction) Plan_doNILC_SHTSmoothing, METH_VARARGS, NULL},
+	{"doCNILC_SHTSmoothing", (PyCFunction) Plan_doCNILC_SHTSmoothing, METH_VARARGS, NULL},
+	{"doCNILC_ThermalDust_SHTSmoothing", (PyCFunction) Plan_doCNILC_ThermalDust_SHTSmoothing, METH_VARARGS, NULL},
+	{"doCNILC_ThermalDust_Synchrotron_SHTSmoothing", (PyCFunction) Plan_doCNILC_ThermalDust_Synchrotron_SHTSmoothing, METH_VARARGS, NULL},
+	{"doNILC_CovarPixelSpace", (PyCFunction) Plan_doNILC_CovarPixelSpace, METH_VARARGS, NULL},
+	{"factorizeCovariance", (PyCFunction) Plan_factorizeCovariance, METH_VARARGS, NULL},
+	{"runToFile", (PyCFunction) Plan_runToFile, METH_VARARGS, NULL},
+	{"compressMask", (PyCFunction) Plan_compressMask, METH_VARARGS, NULL},
+	{"support", (PyCFunction) Plan_support, METH_NOARGS, NULL},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyMemberDef Plan_members[] = {
+	{"nside", T_INT, offsetof(pixelILC_PlanObject, nside), READONLY, NULL},
+	{"Nfreqs", T_INT, offsetof(pixelILC_PlanObject, Nfreqs), READONLY, NULL},
+	{"Npixels", T_LONG, offsetof(pixelILC_PlanObject, Npixels), READONLY, NULL},
+	{"nest", T_INT, offsetof(pixelILC_PlanObject, nest), READONLY, NULL},
+	{"Nthreads", T_INT, offsetof(pixelILC_PlanObject, Nthreads), READONLY, NULL},
+	{"fwhm", T_DOUBLE, offsetof(pixelILC_PlanObject, fwhm), READONLY, NULL},
+	{"compact", T_INT, offsetof(pixelILC_PlanObject, compact), READONLY, NULL},
+	{NULL}        /* Sentinel */
+};
+
+PyTypeObject pixelILC_PlanType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "PixelILC.Plan",
+	.tp_basicsize = sizeof(pixelILC_PlanObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = Plan_new,
+	.tp_dealloc = (destructor) Plan_dealloc,
+	.tp_methods = Plan_methods,
+	.tp_members = Plan_members,
+};
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <omp.h>
+#include <query_disc_wrapper.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Pixel-space NILC of the polarization straight from the Q and U maps of the needlet window, without the full sky E/B
+// transforms. Q and U of a pixel are given in its own (e_theta, e_phi) frame, so the Q and U of the disc pixels are first
+// rotated to the frame of the center by parallel transport along the great circle, Q + iU -> (Q + iU) e^{2i psi}. The
+// covariance of every pixel is then the 2 Nfreqs x 2 Nfreqs disc sum of x x^T, x = (Q_1..Q_Nfreqs, U_1..U_Nfreqs) in the
+// center frame, and the weights are the 2 x 2 Nfreqs matrix W = (A^T C^-1 A)^-1 A^T C^-1, A = (a 0; 0 a), which keeps
+// the Q and U of the component with SED a and mixes Q and U of the channels to minimize the variance of both.
+// The output of pixel p is (Q, U) = W_p x_p, x_p in its own frame, so it needs no rotation back.
+
+PIXELILC_HOT static void pixelILC_CalculateILCWeight_QU_Factorized(double *a, double *U, double *weights, int Nfreqs, long p, double *work){
+	// U is the packed factor of the 2 Nfreqs covariance and work has size 4*Nfreqs. The rows of W go to
+	// weights[p][0][:] and weights[p][1][:], for the output Q and U
+	int M = 2*Nfreqs, i;
+	double *z1 = work, *z2 = &work[M];
+	double g11 = 0.0, g12 = 0.0, g22 = 0.0, det;
+	for(i=0;i<Nfreqs;i++){
+		z1[i] = a[i];
+		z1[Nfreqs + i] = 0.0;
+		z2[i] = 0.0;
+		z2[Nfreqs + i] = a[i];
+	}
+	// A^T C^-1 A = Z^T Z with Z = U^-T A
+	pixelILC_CholeskySolveLower(U, z1, M);
+	pixelILC_CholeskySolveLower(U, z2, M);
+	for(i=0;i<M;i++){
+		g11 += z1[i] * z1[i];
+		g12 += z1[i] * z2[i];
+		g22 += z2[i] * z2[i];
+	}
+	pixelILC_CholeskySolveUpper(U, z1, M);
+	pixelILC_CholeskySolveUpper(U, z2, M);
+	det = g11*g22 - g12*g12;
+	for(i=0;i<M;i++){
+		weights[p*2*M + i] = (g22*z1[i] - g12*z2[i]) / det;
+		weights[p*2*M + M + i] = (g11*z2[i] - g12*z1[i]) / det;
+	}
+}
+
+void pixelILC_Run_NILC_CovarPixelSpace_QU(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, double *Covar_maps, double *Q_maps, double *U_maps, double *mask, double *a, double *weights){
+	// arenas are allocated for 2*Nfreqs. Covar_maps has 2Nfreqs(2Nfreqs+1)/2 entries per map pixel, the packed covariance
+	// of (Q, U), and weights 4*Nfreqs per pixel, see pixelILC_CalculateILCWeight_QU_Factorized
+	int M = 2*Nfreqs;
+	int M2 = M*(M+1)/2;
+	long npix_map = 12L*nside*nside;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	double *x = arena->work;
+	double *rot = NULL;	// cos 2psi, sin 2psi of the disc pixels, grows with the buffer
+	long rot_size = 0;
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, 2*M);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			long nipix, ii, nkeep = 0;
+			int n, nn, c;
+			double *Covar_pix = &Covar_maps[ipix*M2];
+			STATS_TIC(t_stats);
+			nipix = pixelILC_QueryDisc(arena, ipix, 0.5*fwhm, nside, nest);
+			for(ii=0;ii<nipix;ii++){
+				if(mask[arena->pixel_buffer[ii]] != 0.0) arena->pixel_buffer[nkeep++] = arena->pixel_buffer[ii];
+			}
+			if(nkeep > rot_size){
+				rot_size = nkeep;
+				rot = realloc(rot, 2*rot_size*sizeof(double));
+			}
+			transport_wrapper(ipix, arena->pixel_buffer, nkeep, nside, nest, rot);
+			STATS_LAP(PILC_QUERY_DISC, t_stats);
+			STATS_COUNT(PILC_DISC_PIXELS, nkeep);
+			for(ii=0;ii<nkeep;ii++){
+				long ipix2 = arena->pixel_buffer[ii];
+				double w = mask[ipix2], cr = rot[2*ii], sr = rot[2*ii + 1];
+				for(n=0;n<Nfreqs;n++){
+					double Q = Q_maps[n*npix_map + ipix2], U = U_maps[n*npix_map + ipix2];
+					x[n] = Q*cr - U*sr;
+					x[Nfreqs + n] = Q*sr + U*cr;
+				}
+				c = 0;
+				for(n=0;n<M;n++){
+					double xm = x[n] * w;
+					for(nn=n;nn<M;nn++){
+						Covar_pix[c] += xm * x[nn];
+						c += 1;
+					}
+				}
+			}
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			pixelILC_CholeskyPacked(Covar_pix, arena->acc, M);
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_QU_Factorized(a, arena->acc, weights, Nfreqs, p, arena->work);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	free(rot);
+	}
+}
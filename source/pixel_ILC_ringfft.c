@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <gsl/gsl_fft_real.h>
+#include <gsl/gsl_fft_halfcomplex.h>
+#include <gsl/gsl_sf_bessel.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Smoothing of RING ordered maps with a gaussian on the sphere, done ring by ring without any Legendre transform.
+// The kernel is exp(-(1-cos d)/sigma^2), which is the gaussian exp(-d^2/2sigma^2) for small d. With
+// cos d = cos(theta)cos(theta') + sin(theta)sin(theta')cos(dphi) it splits into a factor that only depends on the two
+// rings and exp(a cos(dphi)), whose Fourier coefficients along the ring are the modified Bessel functions I_m(a).
+// So every output ring is a sum over the neighbouring rings of their Fourier coefficients times I_m(a), resampled to
+// the output ring. This is exact on the whole sphere, poles included, and since only the modes the kernel does not
+// suppress are touched the cost per ring does not grow with the width of the kernel, the whole map costs
+// O(npix log npix).
+
+void pixelILC_RingInfo(int nside, pixelILC_ring *rings){
+	// rings[i] describes ring i+1 counted from the north pole, there are 4*nside-1 of them
+	long npix = 12L*nside*nside, ncap = 2L*nside*(nside-1);
+	long i, ii;
+	double z;
+	for(i=1;i<4L*nside;i++){
+		pixelILC_ring *ring = &rings[i-1];
+		if(i < nside){
+			ring->nphi = 4*i;
+			ring->start = 2*i*(i-1);
+			z = 1.0 - (double) (i*i) / (3.0*nside*nside);
+			ring->phi0 = PI / (4.0*i);
+		}
+		else if(i <= 3L*nside){
+			ring->nphi = 4L*nside;
+			ring->start = ncap + (i-nside)*4L*nside;
+			z = (2.0*nside - i) * 2.0 / (3.0*nside);
+			ring->phi0 = ((i+nside) & 1) ? 0.0 : PI / (4.0*nside);
+		}
+		else{
+			ii = 4L*nside - i;
+			ring->nphi = 4*ii;
+			ring->start = npix - 2*ii*(ii+1);
+			z = -1.0 + (double) (ii*ii) / (3.0*nside*nside);
+			ring->phi0 = PI / (4.0*ii);
+		}
+		ring->theta = acos(z);
+	}
+}
+
+static void pixelILC_RingFFTAddRing(pixelILC_ringfft_plan *plan, double *coef, long r, long rr, double *bessel, double *acc){
+	// adds the contribution of ring rr to the halfcomplex array acc of ring r. Mode M of the kernel takes mode M mod n2
+	// of ring rr to mode M mod n of ring r, so short rings near the poles alias exactly like the pixel sums do.
+	pixelILC_ring *ring = &plan->rings[r], *ring2 = &plan->rings[rr];
+	long n = ring->nphi, n2 = ring2->nphi, M, mkernel, t, s;
+	double *c = &coef[ring2->start];
+	double inv_sigma2 = 1.0 / (plan->sigma*plan->sigma);
+	double a = sin(ring->theta) * sin(ring2->theta) * inv_sigma2;
+	// exp(-(1-cos(theta-theta'))/sigma^2) exp(-a) I_M(a), written with the scaled Bessel functions so nothing overflows
+	double w = exp(-(1.0 - cos(ring->theta - ring2->theta)) * inv_sigma2) * (double) n;
+	double dphi0 = ring->phi0 - ring2->phi0, c_re, c_im, p_re, p_im;
+	// I_M(a)/I_0(a) ~ exp(-M^2/2a), the modes above sqrt(2a log(1/EPS)) are below EPS
+	mkernel = (long) ceil(sqrt(-2.0*a*log(PIXELILC_RINGFFT_EPS))) + 1;
+	gsl_sf_bessel_In_scaled_array(0, (int) mkernel, a, bessel);
+	for(M=-mkernel;M<=mkernel;M++){
+		// only the modes 0..n/2 of the output ring are stored, the others are their complex conjugates
+		t = ((M % n) + n) % n;
+		if(t > n/2) continue;
+		s = ((M % n2) + n2) % n2;
+		if(s == 0){ c_re = c[0]; c_im = 0.0; }
+		else if(2*s == n2){ c_re = c[n2-1]; c_im = 0.0; }
+		else if(2*s < n2){ c_re = c[2*s-1]; c_im = c[2*s]; }
+		else{ c_re = c[2*(n2-s)-1]; c_im = -c[2*(n2-s)]; }
+		p_re = w * bessel[labs(M)] * cos(M*dphi0);
+		p_im = w * bessel[labs(M)] * sin(M*dphi0);
+		if(t == 0) acc[0] += c_re*p_re - c_im*p_im;
+		else if(2*t == n) acc[n-1] += c_re*p_re - c_im*p_im;
+		else{
+			acc[2*t-1] += c_re*p_re - c_im*p_im;
+			acc[2*t] += c_re*p_im + c_im*p_re;
+		}
+	}
+}
+
+static void pixelILC_RingFFTConvolve(pixelILC_ringfft_plan *plan, double *map, double *coef, double *map_out){
+	// map_out is the kernel weighted sum of map around every pixel
+	long r;
+	double cut = PIXELILC_RINGFFT_NSIGMA * plan->sigma;
+	// first the Fourier coefficients of every ring
+	#pragma omp parallel for schedule(dynamic,16)
+	for(r=0;r<plan->nrings;r++){
+		pixelILC_ring *ring = &plan->rings[r];
+		long n = ring->nphi, m;
+		double *c = &coef[ring->start];
+		gsl_fft_real_wavetable *wavetable = gsl_fft_real_wavetable_alloc(n);
+		gsl_fft_real_workspace *workspace = gsl_fft_real_workspace_alloc(n);
+		for(m=0;m<n;m++) c[m] = map[ring->start + m];
+		gsl_fft_real_transform(c, 1, n, wavetable, workspace);
+		gsl_fft_real_wavetable_free(wavetable);
+		gsl_fft_real_workspace_free(workspace);
+	}
+	// then every output ring sums the rings within cut in theta
+	#pragma omp parallel for schedule(dynamic,16)
+	for(r=0;r<plan->nrings;r++){
+		pixelILC_ring *ring = &plan->rings[r];
+		long n = ring->nphi, rr, m;
+		double *acc = calloc(n, sizeof(double));
+		// a <= sin(theta)/sigma^2, which bounds mkernel in pixelILC_RingFFTAddRing
+		double *bessel = malloc((long) (ceil(sqrt(-2.0*log(PIXELILC_RINGFFT_EPS)*sin(ring->theta))/plan->sigma) + 2)*sizeof(double));
+		gsl_fft_halfcomplex_wavetable *wavetable = gsl_fft_halfcomplex_wavetable_alloc(n);
+		gsl_fft_real_workspace *workspace = gsl_fft_real_workspace_alloc(n);
+		for(rr=r;rr>=0 && ring->theta - plan->rings[rr].theta < cut;rr--){
+			pixelILC_RingFFTAddRing(plan, coef, r, rr, bessel, acc);
+		}
+		for(rr=r+1;rr<plan->nrings && plan->rings[rr].theta - ring->theta < cut;rr++){
+			pixelILC_RingFFTAddRing(plan, coef, r, rr, bessel, acc);
+		}
+		gsl_fft_halfcomplex_inverse(acc, 1, n, wavetable, workspace);
+		for(m=0;m<n;m++) map_out[ring->start + m] = acc[m];
+		gsl_fft_halfcomplex_wavetable_free(wavetable);
+		gsl_fft_real_workspace_free(workspace);
+		free(bessel);
+		free(acc);
+	}
+}
+
+void pixelILC_RingFFTPlanInit(pixelILC_ringfft_plan *plan, int nside, double fwhm){
+	// fwhm is the diameter of the top-hat disc of doNILC_CovarPixelSpace_SingleField, the gaussian has the same second
+	// moment as that disc, which is sigma = fwhm/4
+	long i, npix = 12L*nside*nside;
+	double *ones, *coef;
+	plan->nside = nside;
+	plan->nrings = 4L*nside - 1;
+	plan->sigma = 0.25*fwhm;
+	plan->rings = malloc(plan->nrings*sizeof(pixelILC_ring));
+	plan->norm = malloc(npix*sizeof(double));
+	pixelILC_RingInfo(nside, plan->rings);
+	// the kernel summed over the pixels around every pixel, it is the same for all the maps we smooth
+	ones = malloc(npix*sizeof(double));
+	coef = malloc(npix*sizeof(double));
+	for(i=0;i<npix;i++) ones[i] = 1.0;
+	pixelILC_RingFFTConvolve(plan, ones, coef, plan->norm);
+	free(ones);
+	free(coef);
+}
+
+void pixelILC_RingFFTPlanFree(pixelILC_ringfft_plan *plan){
+	free(plan->rings);
+	free(plan->norm);
+}
+
+void pixelILC_RingFFTSmooth(pixelILC_ringfft_plan *plan, double *map, double *coef, double *map_out){
+	// map and map_out are RING ordered, coef is a work array with the size of a map.
+	// map_out is the kernel weighted mean of map around every pixel.
+	long i, npix = 12L*plan->nside*plan->nside;
+	pixelILC_RingFFTConvolve(plan, map, coef, map_out);
+	for(i=0;i<npix;i++) map_out[i] /= plan->norm[i];
+}
@@ -0,0 +1,16 @@
+#include <string.h>
+#include <pixel_ILC_stats.h>
+
+pixelILC_thread_stats pixelILC_stats[PIXELILC_MAX_THREADS];
+int pixelILC_stats_nthreads = 0;
+__thread pixelILC_thread_stats *pixelILC_stats_private = NULL;
+
+const char *pixelILC_phase_names[PILC_NPHASES] = {"query_disc", "covariance", "invert", "weights", "marshal"};
+const char *pixelILC_counter_names[PILC_NCOUNTERS] = {"pixels", "disc_pixels", "factorized", "ill_conditioned"};
+
+void pixelILC_stats_reset(int nthreads){
+	// called at the start of every entry point, so the stats always describe the last call
+	memset(pixelILC_stats, 0, sizeof(pixelILC_stats));
+	if(nthreads > PIXELILC_MAX_THREADS) nthreads = PIXELILC_MAX_THREADS;
+	pixelILC_stats_nthreads = nthreads;
+}
@@ -0,0 +1,56 @@
+#ifndef PIXEL_ILC_STATS_H
+#define PIXEL_ILC_STATS_H
+#include <omp.h>
+
+// Per-thread wall time and counters for the phases of the pixel loops.
+// Build with -DPIXELILC_STATS to enable them, otherwise the STATS_* macros expand to nothing
+// and the hot loops are exactly as without instrumentation.
+#define PIXELILC_MAX_THREADS 256
+
+enum pixelILC_phase {
+	PILC_QUERY_DISC,	// query_disc_wrapper calls
+	PILC_COVARIANCE,	// filling the Nfreqs x Nfreqs covariance (disc sums or reading TEBmaps)
+	PILC_INVERT,		// invert_a_matrix
+	PILC_WEIGHTS,		// forming the ILC weights from the inverse
+	PILC_MARSHAL,		// allocating and handing the results back to python
+	PILC_NPHASES
+};
+
+enum pixelILC_counter {
+	PILC_PIXELS,		// pixels processed
+	PILC_DISC_PIXELS,	// disc pixels visited when accumulating covariances
+	PILC_FACTORIZED,	// matrices factorized
+	PILC_ILL_CONDITIONED,	// factorized matrices with a tiny pivot ratio
+	PILC_NCOUNTERS
+};
+
+// aligned to a cache line so that threads do not share lines when they update their own entry
+typedef struct {
+	double time[PILC_NPHASES];
+	long count[PILC_NCOUNTERS];
+} __attribute__((aligned(64))) pixelILC_thread_stats;
+
+extern pixelILC_thread_stats pixelILC_stats[PIXELILC_MAX_THREADS];
+// when set, the stats of the calling thread go there instead, for a thread running outside the teams of the entry points
+extern __thread pixelILC_thread_stats *pixelILC_stats_private;
+extern int pixelILC_stats_nthreads;
+extern const char *pixelILC_phase_names[PILC_NPHASES];
+extern const char *pixelILC_counter_names[PILC_NCOUNTERS];
+
+void pixelILC_stats_reset(int nthreads);
+
+#ifdef PIXELILC_STATS
+#define STATS_THREAD (*(pixelILC_stats_private != NULL ? pixelILC_stats_private : &pixelILC_stats[omp_get_thread_num() % PIXELILC_MAX_THREADS]))
+#define STATS_TIC(t) double t = omp_get_wtime()
+#define STATS_START(t) t = omp_get_wtime()
+// adds the time since t to phase and restarts t, so consecutive phases share one clock read
+#define STATS_LAP(phase,t) do { double t_now_ = omp_get_wtime(); STATS_THREAD.time[phase] += t_now_ - (t); (t) = t_now_; } while(0)
+#define STATS_COUNT(counter,n) (STATS_THREAD.count[counter] += (n))
+#else
+#define STATS_TIC(t)
+#define STATS_START(t)
+#define STATS_LAP(phase,t)
+#define STATS_COUNT(counter,n)
+#endif
+
+#endif
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_linalg.h>
+#include <omp.h>
+#include <query_disc_wrapper.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Pixel-space covariances from a stratified subsample of every disc. A filtered map band-limited at lmax does not
+// change on scales much below pi/lmax, so summing all the pixels of a wide disc adds little over one pixel per cell of
+// a coarser grid. The disc is queried at nside_s and each of its pixels contributes the full resolution pixel holding
+// its centre, weighted by the number of full resolution pixels per cell, so the sums estimate the full disc sums.
+// The samples alternate between two halves, and the difference of the two half sums gives the relative error of the
+// covariance, which is returned for every pixel.
+
+int pixelILC_SubsampleNside(int nside, int lmax, double oversampling){
+	// the smallest power of two, at most nside, whose pixel spacing sqrt(pi/3)/nside_s is below the Nyquist spacing
+	// pi/lmax of the filtered maps divided by oversampling
+	double nside_min = oversampling * lmax / sqrt(3.0*PI);
+	int nside_s = 1;
+	while(nside_s < nside && nside_s < nside_min) nside_s *= 2;
+	return nside_s;
+}
+
+PIXELILC_HOT static void pixelILC_DefineCovMat_NILC_Subsampled_SingleField(int Nfreqs, long npix_map, double *Field_filtered_map, double *mask, long *samples, long nsamples, double *half_a, double *half_b, int Nfreqs2){
+	// half_a and half_b get the packed sums over the even and the odd samples
+	int n,nn,c;
+	long ii, ipix2;
+	double xm, w;
+	memset(half_a, 0, Nfreqs2*sizeof(double));
+	memset(half_b, 0, Nfreqs2*sizeof(double));
+	for(ii=0;ii<nsamples;ii++){
+		ipix2 = samples[ii];
+		w = mask[ipix2];
+		if(w == 0.0) continue;
+		double *half = (ii & 1) ? half_b : half_a;
+		c = 0;
+		for(n=0;n<Nfreqs;n++){
+			xm = Field_filtered_map[n*npix_map + ipix2] * w;
+			for(nn=n;nn<Nfreqs;nn++){
+				half[c] += xm * Field_filtered_map[nn*npix_map + ipix2] ;
+				c += 1;
+			}
+		}
+	}
+}
+
+void pixelILC_Run_NILC_CovarPixelSpace_Subsampled(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, int nside_s, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, double *a, double *weights, double *rel_error){
+	// Like pixelILC_Run_NILC_CovarPixelSpace with the discs sampled at nside_s, a power of two not above nside. Covar_maps
+	// gets the estimated disc sums and rel_error[p] the estimated relative error of the covariance of ipix_arr[p],
+	// |C_a - C_b| / |C_a + C_b| over the packed entries of the two half sums, times sqrt(1 - 1/cell). With nside_s = nside
+	// the sums are exact and so is the error, zero.
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	long npix_map = 12L*nside*nside;
+	double cell = (double) nside / nside_s;
+	cell *= cell;	// full resolution pixels per sample
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	double *half_b = malloc(Nfreqs2*sizeof(double));
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)){
+			pixelILC_CancelBlock(sched, block, weights, Nfreqs);
+			pixelILC_CancelBlock(sched, block, rel_error, 1);
+			continue;
+		}
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			long nsamples;
+			int sucess, n, nn, c;
+			double diff2 = 0.0, sum2 = 0.0;
+			STATS_TIC(t_stats);
+			query_disc_subsampled_wrapper(ipix, 0.5*fwhm, nside, nest, nside_s, arena->pixel_buffer, arena->pixel_buffer_size, &nsamples, &sucess);
+			if(!sucess && nsamples > arena->pixel_buffer_size){
+				// the disc does not fit in the buffer of this thread, grow it and query again
+				arena->pixel_buffer_size = nsamples;
+				arena->pixel_buffer = realloc(arena->pixel_buffer, nsamples*sizeof(long));
+				query_disc_subsampled_wrapper(ipix, 0.5*fwhm, nside, nest, nside_s, arena->pixel_buffer, arena->pixel_buffer_size, &nsamples, &sucess);
+			}
+			STATS_LAP(PILC_QUERY_DISC, t_stats);
+			STATS_COUNT(PILC_DISC_PIXELS, nsamples);
+			double *Covar_pix = &Covar_maps[ipix*Nfreqs2];
+			pixelILC_DefineCovMat_NILC_Subsampled_SingleField(Nfreqs, npix_map, Field_filtered_map, mask, arena->pixel_buffer, nsamples, arena->acc, half_b, Nfreqs2);
+			for(c=0;c<Nfreqs2;c++){
+				double d = arena->acc[c] - half_b[c], s = arena->acc[c] + half_b[c];
+				diff2 += d*d;
+				sum2 += s*s;
+				Covar_pix[c] = cell * s;
+			}
+			// the finite population correction, the error vanishes when every pixel is a sample
+			rel_error[p] = (sum2 > 0.0) ? sqrt((1.0 - 1.0/cell) * diff2 / sum2) : 0.0;
+			c = 0;
+			for(n=0;n<Nfreqs;n++){
+				for(nn=n;nn<Nfreqs;nn++){
+					gsl_matrix_set(arena->CovF, n, nn, Covar_pix[c] );
+					if(n!=nn){
+						gsl_matrix_set(arena->CovF, nn, n, Covar_pix[c] );
+					}
+					c += 1;
+				}
+			}
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			gsl_matrix_set_zero(arena->CovFi);
+			pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+			STATS_LAP(PILC_INVERT, t_stats);
+			pixelILC_CalculateILCWeight_NILC_SingleField(a, arena->CovFi, weights, Nfreqs, p);
+			STATS_LAP(PILC_WEIGHTS, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	free(half_b);
+	}
+}
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_matrix.h>
+#include <omp.h>
+#include <pixel_ILC.h>
+#include <pixel_ILC_stats.h>
+
+// Incremental updates of the covariances, factors and weights of a finished run, for the two usual edits: one frequency
+// channel reprocessed, which changes one row and column of every covariance, and a few mask pixels changed, which only
+// changes the covariances of the pixels whose disc holds one of them.
+
+void pixelILC_Run_UpdateFactors_Channel(pixelILC_schedule *sched, long *ipix_arr, int Nfreqs, double *TEBmaps, int channel, double *U, long *refactorized){
+	// Row p of U is the packed Cholesky factor of the covariance of ipix_arr[p] before the entries (channel, n) of TEBmaps
+	// changed. The change of the covariance is e d^T + d e^T with e the unit vector of the channel and d the change of its
+	// row, with half the change of the diagonal, which is u u^T - v v^T for u,v = (alpha e +- d/alpha)/sqrt(2). alpha^2 = |d|
+	// keeps u and v at the scale of d. The factor gets the update by u and the downdate by v, and pixels where the
+	// downdate fails are factorized from scratch and counted in refactorized. After a cancel the rows not reached keep
+	// their old factors, and a second call completes the update, as the rows already updated find no change.
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	long count = 0;
+	#pragma omp parallel reduction(+:count)
+	{
+	double *old = malloc(Nfreqs*sizeof(double));
+	double *u = malloc(Nfreqs*sizeof(double));
+	double *v = malloc(Nfreqs*sizeof(double));
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)) continue;
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			double *Cov = &TEBmaps[ipix_arr[p]*Nfreqs2];
+			double *Up = &U[p*Nfreqs2];
+			double norm = 0.0, alpha;
+			int n, k;
+			STATS_TIC(t_stats);
+			// the old row of the channel, from the factor
+			for(n=0;n<Nfreqs;n++){
+				int kmax = (n < channel) ? n : channel;
+				old[n] = 0.0;
+				for(k=0;k<=kmax;k++) old[n] += Up[PIXELILC_PACKED_INDEX(k,channel,Nfreqs)] * Up[PIXELILC_PACKED_INDEX(k,n,Nfreqs)];
+			}
+			for(n=0;n<Nfreqs;n++){
+				double d = (n < channel) ? Cov[PIXELILC_PACKED_INDEX(n,channel,Nfreqs)] : Cov[PIXELILC_PACKED_INDEX(channel,n,Nfreqs)];
+				d -= old[n];
+				if(n == channel) d *= 0.5;
+				u[n] = d;
+				norm += d*d;
+			}
+			if(norm == 0.0) continue;
+			alpha = sqrt(sqrt(norm));
+			for(n=0;n<Nfreqs;n++){
+				double d = u[n] / alpha;
+				u[n] = sqrt(0.5) * (((n == channel) ? alpha : 0.0) + d);
+				v[n] = sqrt(0.5) * (((n == channel) ? alpha : 0.0) - d);
+			}
+			pixelILC_CholeskyRank1Update(Up, u, Nfreqs);
+			if(pixelILC_CholeskyRank1Downdate(Up, v, Nfreqs)){
+				pixelILC_CholeskyPacked(Cov, Up, Nfreqs);
+				count += 1;
+			}
+			STATS_LAP(PILC_INVERT, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	free(old);
+	free(u);
+	free(v);
+	}
+	*refactorized = count;
+}
+
+PIXELILC_HOT static void pixelILC_CovarPixelSpace_ChannelRow(int Nfreqs, long npix_map, double *Field_filtered_map, double *mask, long *disc_pixels, long ndisc, int channel, double *row){
+	// row[n] = the disc sum of channel times n, over the disc pixels inside the mask
+	long ii;
+	int n;
+	memset(row, 0, Nfreqs*sizeof(double));
+	for(ii=0;ii<ndisc;ii++){
+		long ipix2 = disc_pixels[ii];
+		double w = mask[ipix2];
+		if(w == 0.0) continue;
+		double xm = Field_filtered_map[channel*npix_map + ipix2] * w;
+		for(n=0;n<Nfreqs;n++) row[n] += xm * Field_filtered_map[n*npix_map + ipix2];
+	}
+}
+
+static void pixelILC_CovarPixelSpace_Solve(pixelILC_arena *arena, double *Covar_pix, int Nfreqs, double *a, double *weights, long p){
+	// the weights of row p from the packed covariance Covar_pix, replacing the previous ones
+	int n, nn, c = 0;
+	for(n=0;n<Nfreqs;n++){
+		for(nn=n;nn<Nfreqs;nn++){
+			gsl_matrix_set(arena->CovF, n, nn, Covar_pix[c]);
+			if(n != nn) gsl_matrix_set(arena->CovF, nn, n, Covar_pix[c]);
+			c += 1;
+		}
+	}
+	gsl_matrix_set_zero(arena->CovFi);
+	pixelILC_InvertMatrix(arena->CovF, arena->CovFi, Nfreqs, arena->perm);
+	for(n=0;n<Nfreqs;n++) weights[p*Nfreqs + n] = 0.0;
+	pixelILC_CalculateILCWeight_NILC_SingleField(a, arena->CovFi, weights, Nfreqs, p);
+}
+
+void pixelILC_Run_NILC_CovarPixelSpace_Channel(pixelILC_schedule *sched, pixelILC_arena *arenas, long *ipix_arr, int Nfreqs, int nside, int nest, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, int channel, double *a, double *weights){
+	// Covar_maps and weights hold the results of pixelILC_Run_NILC_CovarPixelSpace before the map of channel changed in
+	// Field_filtered_map. The discs are summed again for the Nfreqs entries of the channel only, instead of Nfreqs2.
+	// After a cancel the pixels not reached keep their old covariances and weights, and a second call completes them.
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	long npix_map = 12L*nside*nside;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	long b,q;
+	#pragma omp for schedule(dynamic,1)
+	for(b=0;b<sched->Nblocks;b++){
+		long block = sched->block_queue[b];
+		if(PIXELILC_CANCELLED(sched)) continue;
+		for(q=sched->block_start[block];q<sched->block_start[block+1];q++){
+			long p = sched->order[q];
+			long ipix = ipix_arr[p];
+			long nipix;
+			int n;
+			STATS_TIC(t_stats);
+			nipix = pixelILC_QueryDisc(arena, ipix, 0.5*fwhm, nside, nest);
+			STATS_LAP(PILC_QUERY_DISC, t_stats);
+			STATS_COUNT(PILC_DISC_PIXELS, nipix);
+			double *Covar_pix = &Covar_maps[ipix*Nfreqs2];
+			pixelILC_CovarPixelSpace_ChannelRow(Nfreqs, npix_map, Field_filtered_map, mask, arena->pixel_buffer, nipix, channel, arena->work);
+			for(n=0;n<Nfreqs;n++){
+				Covar_pix[(n < channel) ? PIXELILC_PACKED_INDEX(n,channel,Nfreqs) : PIXELILC_PACKED_INDEX(channel,n,Nfreqs)] = arena->work[n];
+			}
+			STATS_LAP(PILC_COVARIANCE, t_stats);
+			pixelILC_CovarPixelSpace_Solve(arena, Covar_pix, Nfreqs, a, weights, p);
+			STATS_LAP(PILC_INVERT, t_stats);
+			STATS_COUNT(PILC_PIXELS, 1);
+		}
+		PIXELILC_PROGRESS(sched, sched->block_start[block+1] - sched->block_start[block]);
+	}
+	}
+}
+
+typedef struct {
+	long key;
+	long index;
+} pixelILC_update_item;
+
+static int pixelILC_compare_update_items(const void *a, const void *b){
+	long ka = ((const pixelILC_update_item*) a)->key, kb = ((const pixelILC_update_item*) b)->key;
+	return (ka > kb) - (ka < kb);
+}
+
+static int pixelILC_compare_update_pairs(const void *a, const void *b){
+	// by pixel, then by edited pixel, so the sums of a pixel are added in the same order whatever the threads did
+	int c = pixelILC_compare_update_items(a, b);
+	if(c != 0) return c;
+	long ka = ((const pixelILC_update_item*) a)->index, kb = ((const pixelILC_update_item*) b)->index;
+	return (ka > kb) - (ka < kb);
+}
+
+static int pixelILC_compare_update_longs(const void *a, const void *b){
+	long ka = *(const long*) a, kb = *(const long*) b;
+	return (ka > kb) - (ka < kb);
+}
+
+long pixelILC_Run_NILC_CovarPixelSpace_MaskEdit(pixelILC_arena *arenas, long *ipix_arr, long Npixels, int Nfreqs, int nside, int nest, double fwhm, double *Covar_maps, double *Field_filtered_map, double *mask, long *edited, double *new_values, long Nedited, double *a, double *weights, long **updated, pixelILC_progress *progress){
+	// Covar_maps, weights and mask hold a finished run of pixelILC_Run_NILC_CovarPixelSpace, and mask[edited[e]] becomes
+	// new_values[e]. A disc holds a pixel when their centres are closer than the radius, so the pixels whose covariance
+	// changes are the ones in the discs around the edited pixels, and their disc sums change by the edited terms only,
+	// (new - old) x x^T. Only these pixels are solved again. mask gets the new values, *updated the positions in ipix_arr
+	// of the updated pixels, and the return value is their number, or -1 when edited has repeated pixels or pixels out of
+	// the map, or ipix_arr has repeated pixels, which would get their covariance changed twice.
+	// progress, when not NULL, counts the edited pixels and then the updated ones. A cancel is only followed while the
+	// discs of the edited pixels are queried, before anything changed, and the call then returns 0 and leaves mask as
+	// it was. Once the covariances start to change it runs to the end, so Covar_maps, weights and mask stay consistent.
+	int Nfreqs2 = Nfreqs*(Nfreqs+1)/2;
+	long npix_map = 12L*nside*nside;
+	long e, i, npairs = 0, ngroups = 0;
+	pixelILC_update_item *sorted_ipix = malloc((Npixels > 0 ? Npixels : 1)*sizeof(pixelILC_update_item));
+	pixelILC_update_item *pairs = NULL;
+	double *dm = malloc((Nedited > 0 ? Nedited : 1)*sizeof(double));
+	long *edited_sorted = malloc((Nedited > 0 ? Nedited : 1)*sizeof(long));
+
+	int invalid = 0;
+	memcpy(edited_sorted, edited, Nedited*sizeof(long));
+	qsort(edited_sorted, Nedited, sizeof(long), pixelILC_compare_update_longs);
+	for(e=0;e<Nedited;e++){
+		if(edited_sorted[e] < 0 || edited_sorted[e] >= npix_map || (e > 0 && edited_sorted[e] == edited_sorted[e-1])) invalid = 1;
+	}
+	free(edited_sorted);
+	for(i=0;i<Npixels;i++){
+		sorted_ipix[i].key = ipix_arr[i];
+		sorted_ipix[i].index = i;
+	}
+	qsort(sorted_ipix, Npixels, sizeof(pixelILC_update_item), pixelILC_compare_update_items);
+	for(i=1;i<Npixels;i++) if(sorted_ipix[i].key == sorted_ipix[i-1].key) invalid = 1;
+	if(invalid){
+		free(sorted_ipix);
+		free(dm);
+		*updated = NULL;
+		return -1;
+	}
+	for(e=0;e<Nedited;e++) dm[e] = new_values[e] - mask[edited[e]];
+	if(progress != NULL) progress->total = Nedited;
+
+	// the (pixel, edited pixel) pairs, from the discs around the edited pixels
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	pixelILC_update_item *local = NULL;
+	long nlocal = 0, size = 0;
+	#pragma omp for schedule(dynamic,16)
+	for(e=0;e<Nedited;e++){
+		long nipix, ii;
+		if(progress != NULL){
+			if(progress->cancel) continue;
+			pixelILC_ProgressBlock(progress, 1);
+		}
+		if(dm[e] == 0.0) continue;
+		STATS_TIC(t_stats);
+		nipix = pixelILC_QueryDisc(arena, edited[e], 0.5*fwhm, nside, nest);
+		STATS_LAP(PILC_QUERY_DISC, t_stats);
+		for(ii=0;ii<nipix;ii++){
+			pixelILC_update_item key = {arena->pixel_buffer[ii], 0};
+			pixelILC_update_item *found = bsearch(&key, sorted_ipix, Npixels, sizeof(pixelILC_update_item), pixelILC_compare_update_items);
+			if(found == NULL) continue;
+			if(nlocal == size){
+				size = (size > 0) ? 2*size : 1024;
+				local = realloc(local, size*sizeof(pixelILC_update_item));
+			}
+			local[nlocal].key = found->index;
+			local[nlocal].index = e;
+			nlocal += 1;
+		}
+	}
+	#pragma omp critical
+	{
+	pairs = realloc(pairs, (npairs + nlocal > 0 ? npairs + nlocal : 1)*sizeof(pixelILC_update_item));
+	memcpy(&pairs[npairs], local, nlocal*sizeof(pixelILC_update_item));
+	npairs += nlocal;
+	}
+	free(local);
+	}
+	free(sorted_ipix);
+	if(progress != NULL && progress->cancel){
+		free(pairs);
+		free(dm);
+		*updated = malloc(sizeof(long));
+		return 0;
+	}
+	qsort(pairs, npairs, sizeof(pixelILC_update_item), pixelILC_compare_update_pairs);
+
+	// the pairs of an updated pixel are consecutive, group_start[g] is the first pair of the g-th one
+	long *group_start = malloc((npairs + 1)*sizeof(long));
+	for(i=0;i<npairs;i++){
+		if(i == 0 || pairs[i].key != pairs[i-1].key) group_start[ngroups++] = i;
+	}
+	group_start[ngroups] = npairs;
+	*updated = malloc((ngroups > 0 ? ngroups : 1)*sizeof(long));
+	if(progress != NULL) progress->total += ngroups;
+
+	long g;
+	#pragma omp parallel
+	{
+	pixelILC_arena *arena = &arenas[omp_get_thread_num()];
+	#pragma omp for schedule(dynamic,16)
+	for(g=0;g<ngroups;g++){
+		long p = pairs[group_start[g]].key;
+		double *Covar_pix = &Covar_maps[ipix_arr[p]*Nfreqs2];
+		long k;
+		int n, nn, c;
+		STATS_TIC(t_stats);
+		for(k=group_start[g];k<group_start[g+1];k++){
+			long ipix2 = edited[pairs[k].index];
+			double w = dm[pairs[k].index];
+			c = 0;
+			for(n=0;n<Nfreqs;n++){
+				double xm = Field_filtered_map[n*npix_map + ipix2] * w;
+				for(nn=n;nn<Nfreqs;nn++){
+					Covar_pix[c] += xm * Field_filtered_map[nn*npix_map + ipix2];
+					c += 1;
+				}
+			}
+		}
+		STATS_COUNT(PILC_DISC_PIXELS, group_start[g+1] - group_start[g]);
+		STATS_LAP(PILC_COVARIANCE, t_stats);
+		pixelILC_CovarPixelSpace_Solve(arena, Covar_pix, Nfreqs, a, weights, p);
+		STATS_LAP(PILC_INVERT, t_stats);
+		STATS_COUNT(PILC_PIXELS, 1);
+		(*updated)[g] = p;
+		if(progress != NULL){
+			// counted only, the cancel is ignored from here
+			#pragma omp atomic
+			progress->done += 1;
+		}
+	}
+	}
+	for(e=0;e<Nedited;e++) mask[edited[e]] = new_values[e];
+	free(group_start);
+	free(pairs);
+	free(dm);
+	return ngroups;
+}
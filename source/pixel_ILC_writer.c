@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L	// pwrite, fsync, ftruncate with -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <pixel_ILC_writer.h>
+
+static int pixelILC_WriterReadManifest(pixelILC_writer *writer, const char *manifest_path, const char *header){
+	// marks the chunks of an existing manifest as done, returns 1 when its header matches the one of this run
+	char line[512];
+	long c;
+	FILE *f = fopen(manifest_path, "r");
+	if(f == NULL) return 0;
+	if(fgets(line, sizeof(line), f) == NULL || strcmp(line, header) != 0){
+		fclose(f);
+		return 0;
+	}
+	while(fscanf(f, "%ld", &c) == 1){
+		if(c >= 0 && c < writer->Nchunks) writer->done[c] = 1;
+	}
+	fclose(f);
+	return 1;
+}
+
+static void *pixelILC_WriterThread(void *arg){
+	pixelILC_writer *writer = arg;
+	for(;;){
+		pthread_mutex_lock(&writer->lock);
+		while(writer->pending < 0 && !writer->stop) pthread_cond_wait(&writer->cond, &writer->lock);
+		if(writer->pending < 0){
+			pthread_mutex_unlock(&writer->lock);
+			break;
+		}
+		long chunk = writer->pending;
+		const char *data = writer->pending_data;
+		pthread_mutex_unlock(&writer->lock);
+
+		long npix = writer->Npixels - chunk*writer->chunk_pixels;
+		if(npix > writer->chunk_pixels) npix = writer->chunk_pixels;
+		size_t left = npix*writer->row_bytes;
+		off_t offset = (off_t) chunk*writer->chunk_pixels*writer->row_bytes;
+		int error = 0;
+		while(left > 0){
+			ssize_t written = pwrite(writer->fd, data, left, offset);
+			if(written < 0){
+				if(errno == EINTR) continue;
+				error = errno;
+				break;
+			}
+			data += written;
+			offset += written;
+			left -= written;
+		}
+		// the chunk goes in the manifest only once its data is on disk
+		if(error == 0 && fsync(writer->fd) != 0) error = errno;
+		if(error == 0){
+			fprintf(writer->manifest, "%ld\n", chunk);
+			if(fflush(writer->manifest) != 0 || fsync(fileno(writer->manifest)) != 0) error = errno;
+		}
+
+		pthread_mutex_lock(&writer->lock);
+		if(error != 0 && writer->error == 0) writer->error = error;
+		if(error == 0) writer->done[chunk] = 1;
+		writer->pending = -1;
+		pthread_cond_broadcast(&writer->cond);
+		pthread_mutex_unlock(&writer->lock);
+	}
+	return NULL;
+}
+
+int pixelILC_WriterOpen(pixelILC_writer *writer, const char *path, long Npixels, int Nfreqs, size_t value_size, long chunk_pixels, const char *tag){
+	// returns 0, or the errno of the failed open
+	char header[512];
+	size_t len = strlen(path);
+	char *manifest_path = malloc(len + 10);
+	memcpy(manifest_path, path, len);
+	strcpy(manifest_path + len, ".manifest");
+	snprintf(header, sizeof(header), "PixelILC weights %ld %d %zu %ld %s\n", Npixels, Nfreqs, value_size, chunk_pixels, tag);
+
+	memset(writer, 0, sizeof(pixelILC_writer));
+	writer->row_bytes = Nfreqs*value_size;
+	writer->Npixels = Npixels;
+	writer->chunk_pixels = chunk_pixels;
+	writer->Nchunks = (Npixels + chunk_pixels - 1)/chunk_pixels;
+	writer->done = calloc(writer->Nchunks > 0 ? writer->Nchunks : 1, sizeof(char));
+	writer->pending = -1;
+	writer->fd = -1;
+
+	// resume when the manifest describes the same run and the data file is still there
+	if(pixelILC_WriterReadManifest(writer, manifest_path, header)){
+		writer->fd = open(path, O_RDWR);
+		if(writer->fd >= 0) writer->manifest = fopen(manifest_path, "a");
+	}
+	if(writer->manifest == NULL){
+		if(writer->fd >= 0) close(writer->fd);
+		memset(writer->done, 0, writer->Nchunks*sizeof(char));
+		writer->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(writer->fd >= 0 && ftruncate(writer->fd, (off_t) Npixels*writer->row_bytes) == 0){
+			writer->manifest = fopen(manifest_path, "w");
+			if(writer->manifest != NULL && (fputs(header, writer->manifest) < 0 || fflush(writer->manifest) != 0)){
+				fclose(writer->manifest);
+				writer->manifest = NULL;
+			}
+		}
+	}
+	free(manifest_path);
+	if(writer->manifest == NULL){
+		int error = errno;
+		if(writer->fd >= 0) close(writer->fd);
+		free(writer->done);
+		return error;
+	}
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	pthread_create(&writer->thread, NULL, pixelILC_WriterThread, writer);
+	return 0;
+}
+
+void pixelILC_WriterSubmit(pixelILC_writer *writer, long chunk, const void *data){
+	// Hands the chunk to the writer thread once it is done with the previous one, so with two buffers the caller
+	// can fill one while the other is written. data must stay untouched until the next call returns.
+	pthread_mutex_lock(&writer->lock);
+	while(writer->pending >= 0) pthread_cond_wait(&writer->cond, &writer->lock);
+	writer->pending = chunk;
+	writer->pending_data = data;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+int pixelILC_WriterClose(pixelILC_writer *writer){
+	// waits for the last chunk, returns the errno of the first failed write or 0
+	pthread_mutex_lock(&writer->lock);
+	while(writer->pending >= 0) pthread_cond_wait(&writer->cond, &writer->lock);
+	writer->stop = 1;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+	close(writer->fd);
+	fclose(writer->manifest);
+	free(writer->done);
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->cond);
+	return writer->error;
+}
+
+uint64_t pixelILC_WriterChecksum(uint64_t hash, const void *data, size_t bytes){
+	// a word at a time, the inputs of a run are large and only need to be told apart
+	const unsigned char *bytes_data = data;
+	uint64_t word;
+	size_t i;
+	for(i=0;i+8<=bytes;i+=8){
+		memcpy(&word, &bytes_data[i], 8);
+		hash = (hash ^ word) * 1099511628211ULL;
+	}
+	for(;i<bytes;i++) hash = (hash ^ bytes_data[i]) * 1099511628211ULL;
+	return hash;
+}
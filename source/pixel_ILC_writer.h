@@ -0,0 +1,37 @@
+#ifndef PIXEL_ILC_WRITER_H
+#define PIXEL_ILC_WRITER_H
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Write-behind of the weights in chunks of consecutive pixels of ipix_arr, to a raw file of Npixels x Nfreqs values
+// (readable with numpy.memmap) and a text manifest next to it, path + ".manifest". The manifest starts with a header
+// describing the run and gets the index of every chunk once its data is on disk, so a restarted run with the same
+// header skips the chunks it lists. A single writer thread does the writes while the caller computes the next chunk.
+// The caller puts in tag whatever tells its runs apart, e.g. a pixelILC_WriterChecksum of the inputs.
+
+typedef struct {
+	int fd;
+	FILE *manifest;
+	size_t row_bytes;		// Nfreqs * the size of a value
+	long Npixels;
+	long chunk_pixels;
+	long Nchunks;
+	char *done;			// done[c] is 1 when chunk c is in the manifest
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	long pending;			// the chunk handed to the writer thread, -1 when it is idle
+	const void *pending_data;
+	int stop;
+	int error;			// errno of the first failed write, 0 otherwise
+} pixelILC_writer;
+
+int pixelILC_WriterOpen(pixelILC_writer *writer, const char *path, long Npixels, int Nfreqs, size_t value_size, long chunk_pixels, const char *tag);
+void pixelILC_WriterSubmit(pixelILC_writer *writer, long chunk, const void *data);
+int pixelILC_WriterClose(pixelILC_writer *writer);
+// FNV-1a over the 8-byte words of data, chained through hash, starting from PIXELILC_WRITER_CHECKSUM_INIT
+#define PIXELILC_WRITER_CHECKSUM_INIT 14695981039346656037ULL
+uint64_t pixelILC_WriterChecksum(uint64_t hash, const void *data, size_t bytes);
+
+#endif
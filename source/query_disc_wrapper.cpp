@@ -1,26 +1,32 @@
 #include <healpix_cxx/healpix_base.h>
 #include <healpix_cxx/rangeset.h>
+#include <healpix_cxx/arr.h>
 #include <healpix_cxx/pointing.h>
 #include <healpix_cxx/vec3.h>
 #include <vector>
 #include <cmath>
 #include <iostream>
 #include <algorithm>
+#include <query_disc_wrapper.h>
 using namespace std;
 
 extern "C" {
-	void query_disc_wrapper(long ipix, double radius, int nside, long* ipix_arr, int* nipix, int *sucess){
+	void query_disc_wrapper(long ipix, double radius, int nside, int nest, long* ipix_arr, long max_pix, long* nipix, int *sucess){
 		// first, we need to transform ipix to a pointing center
-		// We define the hp_base. I don't know if it is faster in nested, CHECK THIS !!!
-		T_Healpix_Base<long> hp_base(nside,RING,SET_NSIDE);
-		int ipixx = (int) ipix; 
-		pointing center = hp_base.pix2ang(ipixx);
-		vec3 center_v = center.to_vec3();
+		// In NEST the disc comes back as a few long runs of consecutive indices instead of one short run per ring,
+		// so the maps are read in much longer contiguous stretches
+		T_Healpix_Base<long> hp_base(nside,nest ? NEST : RING,SET_NSIDE);
+		pointing center = hp_base.pix2ang(ipix);
 		rangeset<long> pp;
 		try{
 			hp_base.query_disc(center,radius,pp);
 			std::vector<long> v = pp.toVector();
-			*nipix	= (int) v.size();
+			*nipix	= (long) v.size();
+			if((long) v.size() > max_pix){
+				// the caller has to retry with a larger buffer
+				*sucess = 0;
+				return;
+			}
 			for(std::size_t i = 0; i < v.size(); i++) {
 				ipix_arr[i]	= (long) v[i];
 				// Here for the calculation of the angular distance, I use the same recipe as in healpy
@@ -37,4 +43,98 @@ extern "C" {
 			*sucess = 0;
 		}
 	}
-}
\ No newline at end of file
+
+	void query_disc_subsampled_wrapper(long ipix, double radius, int nside, int nest, int nside_s, long* ipix_arr, long max_pix, long* nipix, int *sucess){
+		// the disc is queried at nside_s, and each of its pixels is represented by the pixel of nside holding its centre,
+		// which gives a sample of the disc on a regular grid, one pixel per cell of nside_s
+		T_Healpix_Base<long> hp_base(nside,nest ? NEST : RING,SET_NSIDE);
+		T_Healpix_Base<long> hp_s(nside_s,NEST,SET_NSIDE);
+		pointing center = hp_base.pix2ang(ipix);
+		rangeset<long> pp;
+		try{
+			hp_s.query_disc(center,radius,pp);
+			std::vector<long> v = pp.toVector();
+			*nipix	= (long) v.size();
+			if((long) v.size() > max_pix){
+				*sucess = 0;
+				return;
+			}
+			for(std::size_t i = 0; i < v.size(); i++) ipix_arr[i] = hp_base.ang2pix(hp_s.pix2ang(v[i]));
+			*sucess = 1;
+		}
+		catch (PlanckError e){
+			*sucess = 0;
+		}
+	}
+
+	void ring2nest_wrapper(long* ipix_arr, long npix, int nside, long* ipix_out){
+		T_Healpix_Base<long> hp_base(nside,RING,SET_NSIDE);
+		for(long i = 0; i < npix; i++) ipix_out[i] = hp_base.ring2nest(ipix_arr[i]);
+	}
+
+	void nest2ring_wrapper(long* ipix_arr, long npix, int nside, long* ipix_out){
+		T_Healpix_Base<long> hp_base(nside,NEST,SET_NSIDE);
+		for(long i = 0; i < npix; i++) ipix_out[i] = hp_base.nest2ring(ipix_arr[i]);
+	}
+
+	void interpol_wrapper(long* ipix_arr, long npix, int nside, int nest, int nside_coarse, long* pix_out, double* wgt_out){
+		// the 4 NEST pixels of nside_coarse around the centre of every pixel, and their bilinear interpolation weights
+		T_Healpix_Base<long> hp_base(nside,nest ? NEST : RING,SET_NSIDE);
+		T_Healpix_Base<long> hp_coarse(nside_coarse,NEST,SET_NSIDE);
+		fix_arr<long,4> pix;
+		fix_arr<double,4> wgt;
+		for(long i = 0; i < npix; i++){
+			hp_coarse.get_interpol(hp_base.pix2ang(ipix_arr[i]), pix, wgt);
+			for(int k = 0; k < 4; k++){
+				pix_out[4*i + k] = pix[k];
+				wgt_out[4*i + k] = wgt[k];
+			}
+		}
+	}
+
+	void coarse_center_wrapper(long* coarse_arr, long ncoarse, int nside_coarse, int nside, int nest, long* ipix_out){
+		// the pixel of nside, RING or NEST, holding the centre of every NEST pixel of nside_coarse
+		T_Healpix_Base<long> hp_base(nside,nest ? NEST : RING,SET_NSIDE);
+		T_Healpix_Base<long> hp_coarse(nside_coarse,NEST,SET_NSIDE);
+		for(long i = 0; i < ncoarse; i++) ipix_out[i] = hp_base.ang2pix(hp_coarse.pix2ang(coarse_arr[i]));
+	}
+
+	void transport_wrapper(long ipix, long* ipix_arr, long npix, int nside, int nest, double* rot_out){
+		// cos 2psi and sin 2psi of every pixel of ipix_arr, where psi is the angle the (e_theta, e_phi) frame of the pixel
+		// turns by when it is parallel transported along the great circle to ipix. psi is the difference of the angles the
+		// great circle makes with e_theta at both ends, found from the tangent directions t1 at the pixel and t0 at ipix.
+		// The components of t along e_theta and e_phi are taken times sin(theta), which does not change their angle.
+		T_Healpix_Base<long> hp_base(nside,nest ? NEST : RING,SET_NSIDE);
+		vec3 r0 = hp_base.pix2vec(ipix);
+		double rho0 = r0.x*r0.x + r0.y*r0.y;
+		for(long i = 0; i < npix; i++){
+			vec3 r1 = hp_base.pix2vec(ipix_arr[i]);
+			double cosd = dotprod(r0,r1);
+			vec3 t1 = r0 - r1*cosd;
+			vec3 t0 = r0*cosd - r1;
+			double rho1 = r1.x*r1.x + r1.y*r1.y;
+			double c0 = r0.z*(t0.x*r0.x + t0.y*r0.y) - t0.z*rho0, s0 = r0.x*t0.y - r0.y*t0.x;
+			double c1 = r1.z*(t1.x*r1.x + t1.y*r1.y) - t1.z*rho1, s1 = r1.x*t1.y - r1.y*t1.x;
+			// e^{i psi} up to its modulus, and its square
+			double c = c0*c1 + s0*s1, s = s0*c1 - c0*s1;
+			double norm = c*c + s*s;
+			if(norm > 0.0){
+				rot_out[2*i] = (c*c - s*s) / norm;
+				rot_out[2*i + 1] = 2.0*c*s / norm;
+			}
+			else{
+				// the pixel itself
+				rot_out[2*i] = 1.0;
+				rot_out[2*i + 1] = 0.0;
+			}
+		}
+	}
+
+	void neighbors_wrapper(long ipix, int nside, int nest, long* ipix_out){
+		// the 8 neighbours of ipix, -1 where a pixel has only 7
+		T_Healpix_Base<long> hp_base(nside,nest ? NEST : RING,SET_NSIDE);
+		fix_arr<long,8> result;
+		hp_base.neighbors(ipix, result);
+		for(int k = 0; k < 8; k++) ipix_out[k] = result[k];
+	}
+}
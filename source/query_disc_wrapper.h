@@ -1 +1,24 @@
-void query_disc_wrapper(long ipix, double radius, int nside, long* ipix_arr, int* nipix, int *sucess);
\ No newline at end of file
+#ifndef QUERY_DISC_WRAPPER_H
+#define QUERY_DISC_WRAPPER_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ipix and the returned pixels are in RING ordering, or NEST when nest is 1.
+// If the disc has more than max_pix pixels nothing is written, sucess is 0 and nipix holds the size the buffer needs.
+void query_disc_wrapper(long ipix, double radius, int nside, int nest, long* ipix_arr, long max_pix, long* nipix, int *sucess);
+// one pixel of nside per pixel of the disc at nside_s, ordered along the NEST pixels of nside_s
+void query_disc_subsampled_wrapper(long ipix, double radius, int nside, int nest, int nside_s, long* ipix_arr, long max_pix, long* nipix, int *sucess);
+void ring2nest_wrapper(long* ipix_arr, long npix, int nside, long* ipix_out);
+void nest2ring_wrapper(long* ipix_arr, long npix, int nside, long* ipix_out);
+// coarse pixels are always NEST
+void interpol_wrapper(long* ipix_arr, long npix, int nside, int nest, int nside_coarse, long* pix_out, double* wgt_out);
+void coarse_center_wrapper(long* coarse_arr, long ncoarse, int nside_coarse, int nside, int nest, long* ipix_out);
+void neighbors_wrapper(long ipix, int nside, int nest, long* ipix_out);
+// rot_out[2*i], rot_out[2*i+1] = cos 2psi, sin 2psi, with psi the parallel transport rotation from ipix_arr[i] to ipix
+void transport_wrapper(long ipix, long* ipix_arr, long npix, int nside, int nest, double* rot_out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,63 @@
+import sys
+import time
+import numpy as np
+import healpy as hp
+import PixelILC
+
+# Timings of the hot paths, to compare the 64-bit pixel indexing against the previous build, and a check of the
+# pixel-space NILC at nside 16384, where the pixel indices go past 2**31, on a patch handled by a compact Plan.
+#   python bench-indexing.py [nside] [Nthreads] [nside_hi]
+# Run it with the module built from each commit and compare the best times.
+
+nside = int(sys.argv[1]) if len(sys.argv) > 1 else 256
+Nthreads = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+Nfreqs = 6
+Nfreqs2 = Nfreqs*(Nfreqs+1)//2
+npix = 12*nside**2
+fwhm = np.radians(60.0/60.0)
+repeats = 5
+
+np.random.seed(0)
+a = np.ones(Nfreqs)
+maps = np.random.normal(size=(Nfreqs,npix))
+X = np.random.normal(size=(npix,Nfreqs,Nfreqs+2))
+C = np.einsum('pik,pjk->pij', X, X)
+iu = np.triu_indices(Nfreqs)
+TEBmaps = np.ascontiguousarray(C[:,iu[0],iu[1]])
+del X, C
+mask = np.ones(npix)
+ipix = np.arange(npix)
+
+def best_of(f):
+	t = []
+	for r in range(repeats):
+		t0 = time.perf_counter()
+		f()
+		t.append(time.perf_counter() - t0)
+	return min(t)
+
+print('nside %d, %d frequencies, %d threads, best of %d'%(nside, Nfreqs, Nthreads, repeats))
+t = best_of(lambda: PixelILC.doNILC_SHTSmoothing_SingleField(TEBmaps, nside, a, Nfreqs, ipix, npix, 0, 0, Nthreads))
+print('%-40s %8.3f s  %8.1f ns/pixel'%('doNILC_SHTSmoothing_SingleField', t, 1e9*t/npix))
+Covar = np.zeros((npix,Nfreqs2))
+t = best_of(lambda: PixelILC.doNILC_CovarPixelSpace_SingleField(Covar, maps, mask, nside, a, fwhm, Nfreqs, ipix, npix))
+print('%-40s %8.3f s  %8.1f ns/pixel'%('doNILC_CovarPixelSpace_SingleField', t, 1e9*t/npix))
+
+# nside_hi is 16384 by default, 12*16384**2 = 3221225472 pixels. The maps are compact, so they only cover the discs of the patch,
+# and its covariances are checked against the sums over the discs from healpy
+nside_hi = int(sys.argv[3]) if len(sys.argv) > 3 else 16384
+fwhm_hi = np.radians(2.0/60.0)
+for nest in (0,1):
+	ipix_hi = np.arange(12*nside_hi**2 - 200, 12*nside_hi**2, dtype=np.int64)
+	plan = PixelILC.Plan(nside_hi, ipix_hi, Nfreqs, Nthreads, nest, fwhm_hi, None, 1)
+	support = plan.support()
+	field = np.random.normal(size=(Nfreqs,len(support)))
+	mask_hi = np.ones(len(support))
+	Covar_hi = np.zeros((len(ipix_hi),Nfreqs2))
+	w = plan.doNILC_CovarPixelSpace(Covar_hi, field, mask_hi, a)
+	err = 0.0
+	for p in range(0, len(ipix_hi), 20):
+		disc = hp.query_disc(nside_hi, hp.pix2vec(nside_hi, ipix_hi[p], nest=nest), 0.5*fwhm_hi, nest=nest)
+		x = field[:,np.searchsorted(support, disc)]
+		err = max(err, np.abs((x @ x.T)[iu] - Covar_hi[p]).max() / np.abs(Covar_hi[p]).max())
+	print('nside %d nest %d, pixels up to %d: %d support pixels, max relative covariance error %.3e, max |w.a - 1| %.3e'%(nside_hi, nest, ipix_hi[-1], len(support), err, np.abs(w @ a - 1.0).max()))
@@ -0,0 +1,66 @@
+import numpy as np
+import healpy as hp
+import PixelILC
+
+# Accuracy report of the single precision path against the double precision one, on synthetic maps.
+# The covariances are the smoothed products of the maps, as in the SHT smoothing estimator
+
+def cmb(nu):
+	x = 0.0176086761 * nu
+	ex = np.exp(x)
+	sed = ex * (x / (ex - 1)) ** 2
+	return sed
+
+freqs = np.array([27,39,93,145,225,280])
+Nfreqs = 6
+nside = 128
+npix = 12*nside**2
+fwhm = np.radians(60.0/60.0)
+Nthreads = 4
+
+a = cmb(freqs)
+a = a / a[0]
+b = (freqs / freqs[0])**1.5 * a	# a dust-like second component, for the constrained ILC
+
+np.random.seed(0)
+cl = 1.0 / (np.arange(3*nside) + 10.0)**2
+cmb_map = hp.synfast(cl, nside, verbose=False)
+fg_map = hp.synfast(100*cl, nside, verbose=False)
+maps = np.zeros((Nfreqs,npix))
+for n in range(Nfreqs):
+	maps[n] = a[n]*cmb_map + b[n]*fg_map + 0.01*np.random.normal(size=npix)
+
+# Packed upper triangle of the covariance, ordered as the C code expects
+Nfreqs2 = Nfreqs*(Nfreqs+1)//2
+TEBmaps = np.zeros((npix,Nfreqs2))
+c = 0
+for n in range(Nfreqs):
+	for nn in range(n,Nfreqs):
+		TEBmaps[:,c] = hp.smoothing(maps[n]*maps[nn], fwhm=fwhm, verbose=False)
+		c += 1
+
+ipix = np.arange(npix)
+
+def report(name, w64, w32):
+	d = np.abs(w32.astype(np.float64) - w64)
+	res64 = np.sum(w64*maps.T, axis=1) - cmb_map
+	res32 = np.sum(w32.astype(np.float64)*maps.T, axis=1) - cmb_map
+	print('%-12s max|dw|/max|w| %.3e   rms|dw|/rms|w| %.3e   rms residual %.6e (double) %.6e (single)'%(name, d.max()/np.abs(w64).max(), np.sqrt(np.mean(d**2)/np.mean(w64**2)), np.std(res64), np.std(res32)))
+
+w64 = PixelILC.doNILC_SHTSmoothing_SingleField(TEBmaps, nside, a, Nfreqs, ipix, npix, 0, 0, Nthreads)
+w32 = PixelILC.doNILC_SHTSmoothing_SingleField_float(TEBmaps.astype(np.float32), nside, a, Nfreqs, ipix, npix, 0, 0, Nthreads)
+report('NILC', w64, w32)
+
+w64 = PixelILC.doCNILC_SHTSmoothing_SingleField(TEBmaps, nside, a, b, Nfreqs, ipix, npix, 0, 0, Nthreads)
+w32 = PixelILC.doCNILC_SHTSmoothing_SingleField_float(TEBmaps.astype(np.float32), nside, a, b, Nfreqs, ipix, npix, 0, 0, Nthreads)
+report('CNILC', w64, w32)
+
+# Pixel space covariances, on a disc of the sky
+vec = np.array([0,0,1])
+pp = hp.query_disc(nside, vec, np.radians(10.0))
+mask = np.ones(npix)
+Covar_maps = np.zeros((npix,Nfreqs2))
+w64 = PixelILC.doNILC_CovarPixelSpace_SingleField(Covar_maps, maps, mask, nside, a, fwhm, Nfreqs, pp, len(pp))
+w32 = PixelILC.doNILC_CovarPixelSpace_SingleField_float(np.zeros((npix,Nfreqs2), np.float32), maps.astype(np.float32), mask.astype(np.float32), nside, a, fwhm, Nfreqs, pp, len(pp))
+d = np.abs(w32.astype(np.float64) - w64)
+print('%-12s max|dw|/max|w| %.3e   rms|dw|/rms|w| %.3e'%('PixelSpace', d.max()/np.abs(w64).max(), np.sqrt(np.mean(d**2)/np.mean(w64**2))))
@@ -0,0 +1,69 @@
+import numpy as np
+import healpy as hp
+import PixelILC
+
+# Checks the leave-out pixel-space NILC against a direct solve of the disc covariance with the core taken out,
+# C - sum_core m x x^T, and the refactorization of the pixels whose downdate fails
+
+Nfreqs = 4
+Nfreqs2 = Nfreqs*(Nfreqs+1)//2
+nside = 16
+npix = 12*nside**2
+fwhm = np.radians(25.0)
+
+np.random.seed(0)
+a = np.ones(Nfreqs)
+maps = np.random.normal(size=(Nfreqs,npix))
+mask = np.ones(npix)
+mask[np.random.random(npix) < 0.1] = 0.0
+mask[np.random.random(npix) < 0.1] = 0.5
+ipix = np.arange(0, npix, 2)
+iu = np.triu_indices(Nfreqs)
+
+def direct(Covar, p, core, nest):
+	# the reduced covariance of pixel p, solved with numpy
+	C = np.zeros((Nfreqs,Nfreqs))
+	C[iu] = Covar[p]
+	C = C + C.T - np.diag(np.diag(C))
+	for c in core:
+		C -= mask[c]*np.outer(maps[:,c], maps[:,c])
+	Ci = np.linalg.inv(C)
+	return Ci.dot(a) / a.dot(Ci).dot(a)
+
+for nest in (0,1):
+	for core_radius in (0.0, np.radians(6.0)):
+		Covar_maps = np.zeros((npix,Nfreqs2))
+		w, refactorized = PixelILC.doNILC_CovarPixelSpace_LeaveOut_SingleField(Covar_maps, maps, mask, nside, a, fwhm, Nfreqs, ipix, len(ipix), core_radius, nest)
+		err = 0.0
+		for k in range(0, len(ipix), 5):
+			p = ipix[k]
+			core = [p] if core_radius == 0.0 else hp.query_disc(nside, hp.pix2vec(nside, p, nest=nest), core_radius, nest=nest)
+			err = max(err, np.abs(direct(Covar_maps, p, core, nest) - w[k]).max())
+		print('nest %i core_radius %.3f   max|w - direct| %.3e   refactorized %i'%(nest, core_radius, err, refactorized))
+		assert err < 1e-10
+
+# A pixel far brighter than the rest of its disc in every channel: the downdate of its x x^T leaves a pivot far below the previous one,
+# so it fails and the pixel is factorized again from the sums with the pixel subtracted. That subtraction cancels most
+# of the digits, so the direct solve subtracts the same products in the same order to get the same reduced covariance.
+# pixels whose discs hold no other bright pixel, which would leave the reduced covariance ill conditioned
+bright = []
+for p in ipix[::37]:
+	if all(q not in hp.query_disc(nside, hp.pix2vec(nside, p), 0.5*fwhm) for q in bright): bright.append(p)
+bright = np.array(bright)
+maps[:,bright] = 1.0e8 * (1.0 + np.random.random((Nfreqs,len(bright))))
+mask[bright] = 1.0
+Covar_maps = np.zeros((npix,Nfreqs2))
+w, refactorized = PixelILC.doNILC_CovarPixelSpace_LeaveOut_SingleField(Covar_maps, maps, mask, nside, a, fwhm, Nfreqs, ipix, len(ipix), 0.0)
+err = 0.0
+for p in bright:
+	k = np.searchsorted(ipix, p)
+	x = maps[:,p]
+	C = np.zeros((Nfreqs,Nfreqs))
+	C[iu] = Covar_maps[p] - (x*mask[p])[iu[0]] * x[iu[1]]
+	C = C + C.T - np.diag(np.diag(C))
+	Ci = np.linalg.inv(C)
+	wd = Ci.dot(a) / a.dot(Ci).dot(a)
+	err = max(err, np.abs(wd - w[k]).max() / np.abs(wd).max())
+print('bright pixels   refactorized %i of %i   max|w - direct|/max|w| %.3e'%(refactorized, len(bright), err))
+# the pixels with a bright pixel in their disc can fail too, their covariance is close to rank one
+assert refactorized >= len(bright) and err < 1e-10
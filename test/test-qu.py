@@ -0,0 +1,73 @@
+import numpy as np
+import healpy as hp
+import PixelILC
+
+# Checks the QU-domain NILC: the sign of the parallel transport of the disc pixels to the frame of the center, and that
+# the weights keep the Q and U of the component with SED a, W A = I
+
+Nfreqs = 3
+nside = 16
+npix = 12*nside**2
+fwhm = np.radians(30.0)
+
+np.random.seed(0)
+ipix = np.arange(0, npix, 3)
+mask = np.ones(npix)
+mask[np.random.random(npix) < 0.1] = 0.0
+mask[np.random.random(npix) < 0.1] = 0.5
+
+def tensor_QU(T, nest):
+	# Q and U of a constant traceless 3D tensor projected on the sphere, in the (e_theta, e_phi) frame of every pixel
+	theta, phi = hp.pix2ang(nside, np.arange(npix), nest=nest)
+	et = np.stack([np.cos(theta)*np.cos(phi), np.cos(theta)*np.sin(phi), -np.sin(theta)], -1)
+	ep = np.stack([-np.sin(phi), np.cos(phi), 0.0*phi], -1)
+	Q = np.einsum('pi,ij,pj->p', et, T, et) - np.einsum('pi,ij,pj->p', ep, T, ep)
+	U = 2.0*np.einsum('pi,ij,pj->p', et, T, ep)
+	return Q, U
+
+T = np.random.normal(size=(3,3))
+T = T + T.T
+T -= np.trace(T)/3.0 * np.eye(3)
+
+for nest in (0,1):
+	Q, U = tensor_QU(T, nest)
+
+	# Transported to the center, the tensor field hardly changes over the disc, so with one channel the covariance of
+	# (Q, U) is close to rank one, much closer than the covariance of the unrotated Q and U. A transport with the wrong
+	# sign turns the disc pixels away from the frame of the center and leaves it further from rank one than no rotation.
+	Covar_maps = np.zeros((npix,3))
+	w = PixelILC.doNILC_CovarPixelSpace_QU_SingleField(Covar_maps, Q[None,:], U[None,:], mask, nside, np.ones(1), fwhm, 1, ipix, len(ipix), nest)
+	# a single channel keeps the field as it is
+	assert np.abs(w - np.eye(2)).max() < 1e-10
+	ratio = 0.0
+	ratio_unrotated = 0.0
+	for p in ipix:
+		C = np.array([[Covar_maps[p,0], Covar_maps[p,1]], [Covar_maps[p,1], Covar_maps[p,2]]])
+		disc = hp.query_disc(nside, hp.pix2vec(nside, p, nest=nest), 0.5*fwhm, nest=nest)
+		x = np.vstack([Q[disc], U[disc]])
+		C0 = (x*mask[disc]).dot(x.T)
+		l = np.linalg.eigvalsh(C)
+		l0 = np.linalg.eigvalsh(C0)
+		ratio += l[0]/l[1] / len(ipix)
+		ratio_unrotated += l0[0]/l0[1] / len(ipix)
+	print('nest %i   mean eigenvalue ratio of the (Q, U) covariance %.4f, unrotated %.4f'%(nest, ratio, ratio_unrotated))
+	assert ratio < 0.5*ratio_unrotated
+
+	# the tensor field as the component with SED a, a foreground with another SED and noise
+	a = np.ones(Nfreqs)
+	f = np.array([0.5, 1.0, 3.0])
+	fgQ = np.random.normal(size=npix)
+	fgU = np.random.normal(size=npix)
+	Q_maps = np.outer(a, Q) + np.outer(f, fgQ) + 0.05*np.random.normal(size=(Nfreqs,npix))
+	U_maps = np.outer(a, U) + np.outer(f, fgU) + 0.05*np.random.normal(size=(Nfreqs,npix))
+	Covar_maps = np.zeros((npix,Nfreqs*(2*Nfreqs+1)))
+	w = PixelILC.doNILC_CovarPixelSpace_QU_SingleField(Covar_maps, Q_maps, U_maps, mask, nside, a, fwhm, Nfreqs, ipix, len(ipix), nest)
+	A = np.zeros((2*Nfreqs,2))
+	A[:Nfreqs,0] = a
+	A[Nfreqs:,1] = a
+	err = np.abs(w.dot(A) - np.eye(2)).max()
+	out = np.einsum('pij,jp->ip', w, np.vstack([Q_maps[:,ipix], U_maps[:,ipix]]))
+	res = np.sqrt(((out - np.vstack([Q[ipix], U[ipix]]))**2).mean())
+	res_mean = np.sqrt(((np.vstack([Q_maps[:,ipix].mean(0), U_maps[:,ipix].mean(0)]) - np.vstack([Q[ipix], U[ipix]]))**2).mean())
+	print('nest %i   max|W A - I| %.3e   rms of the output - tensor field %.3f, of the channel mean %.3f'%(nest, err, res, res_mean))
+	assert err < 1e-10 and res < res_mean